@@ -0,0 +1,155 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Compares the image decoders of libcg on a set of assets. Every decoder that
+ * handles the type of a file decodes it a number of times, and the average
+ * time per decode is reported.
+ *
+ * Usage: bench [-n iterations] [file...]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcg.h"
+
+/* The assets of the main menu, used when no files are given. */
+static const char *defaultAssets[] = {
+	"../mainmenu/res/cc0textures-bricks047.jpg",
+};
+
+static double
+getTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+benchmarkDecoder(const char *path, const unsigned char *data, size_t size,
+				 const struct CGImageDecoder *decoder, int iterations) {
+	unsigned char *pixels;
+	int width;
+	int height;
+	int channels;
+	int i;
+	double start;
+	double average;
+
+	/* The first decode warms up the caches and is not measured. */
+	pixels = decoder->decode(data, size, &width, &height, &channels, 0);
+	if (pixels == NULL) {
+		printf("%-40s %-12s failed\n", path, decoder->name);
+		return;
+	}
+	decoder->free(pixels);
+
+	start = getTime();
+	for (i = 0; i < iterations; i++) {
+		pixels = decoder->decode(data, size, &width, &height, &channels, 0);
+		decoder->free(pixels);
+	}
+	average = (getTime() - start) / iterations;
+
+	printf("%-40s %-12s %5ix%-5i %i %10.3f %10.2f\n", path, decoder->name,
+		   width, height, channels, average * 1000.0,
+		   (double) width * height / average / 1e6);
+}
+
+int
+main(int argc, char **argv) {
+	const char **files = defaultAssets;
+	int fileCount = sizeof(defaultAssets) / sizeof(defaultAssets[0]);
+	int iterations = 10;
+	struct CGFileView *views;
+	enum CGImageType type;
+	const struct CGImageDecoder *decoder;
+	size_t i;
+	int file;
+	int status = EXIT_SUCCESS;
+
+	if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+		iterations = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (iterations <= 0) {
+		fputs("[Bench] The iteration count must be positive.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (argc > 1) {
+		files = (const char **) argv + 1;
+		fileCount = argc - 1;
+	}
+
+	/* Every file is read up front, so reading doesn't disturb the timing. */
+	views = calloc(fileCount, sizeof(struct CGFileView));
+	if (views == NULL) {
+		fputs("[Bench] Failed to allocate file views.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (CGReadFiles(views, files, fileCount) != (size_t) fileCount)
+		status = EXIT_FAILURE;
+
+	printf("%-40s %-12s %11s %s %10s %10s\n", "file", "decoder", "size", "c",
+		   "ms", "MPix/s");
+
+	for (file = 0; file < fileCount; file++) {
+		if (views[file].data == NULL)
+			continue;
+
+		if (!CGDetectImageType(views[file].data, views[file].size, &type)) {
+			fprintf(stderr, "[Bench] Unknown image type of '%s'.\n",
+					files[file]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		for (i = 0; i < CGGetImageDecoderCount(); i++) {
+			decoder = CGGetImageDecoder(i);
+			if (decoder->type == type)
+				benchmarkDecoder(files[file], views[file].data,
+								 views[file].size, decoder, iterations);
+		}
+	}
+
+	for (file = 0; file < fileCount; file++)
+		CGReleaseFileView(&views[file]);
+	free(views);
+	return status;
+}
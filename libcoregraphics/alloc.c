@@ -0,0 +1,210 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Heap allocations. Everything libcg and stb_image allocate on the heap goes
+ * through the allocator set with CGSetAllocator, which is malloc by default.
+ * The tracking allocator counts what's allocated through it, by keeping the
+ * size of every block in a header in front of it.
+ */
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/* Keeps the memory after it aligned like malloc's. */
+union TrackingHeader {
+	size_t		 size;
+	max_align_t	 alignment;
+};
+
+static void *
+systemAllocate(void *user, size_t size) {
+	(void) user;
+	return malloc(size);
+}
+
+static void *
+systemReallocate(void *user, void *pointer, size_t size) {
+	(void) user;
+	return realloc(pointer, size);
+}
+
+static void
+systemRelease(void *user, void *pointer) {
+	(void) user;
+	free(pointer);
+}
+
+static struct CGAllocationStats trackingStats;
+
+static void
+countAllocation(size_t size) {
+	size_t bytes;
+	size_t peak;
+
+	bytes = __atomic_add_fetch(&trackingStats.bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&trackingStats.allocations, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&trackingStats.totalAllocations, 1, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&trackingStats.peakBytes, __ATOMIC_RELAXED);
+	while (bytes > peak
+		   && !__atomic_compare_exchange_n(&trackingStats.peakBytes, &peak,
+										   bytes, true, __ATOMIC_RELAXED,
+										   __ATOMIC_RELAXED))
+		continue;
+}
+
+static void
+countRelease(size_t size) {
+	__atomic_sub_fetch(&trackingStats.bytes, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&trackingStats.allocations, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+trackingAllocate(void *user, size_t size) {
+	union TrackingHeader *header;
+
+	(void) user;
+	if (size > SIZE_MAX - sizeof(union TrackingHeader))
+		return NULL;
+
+	header = malloc(sizeof(union TrackingHeader) + size);
+	if (header == NULL)
+		return NULL;
+
+	header->size = size;
+	countAllocation(size);
+	return header + 1;
+}
+
+static void
+trackingRelease(void *user, void *pointer) {
+	union TrackingHeader *header;
+
+	(void) user;
+	if (pointer == NULL)
+		return;
+
+	header = (union TrackingHeader *) pointer - 1;
+	countRelease(header->size);
+	free(header);
+}
+
+static void *
+trackingReallocate(void *user, void *pointer, size_t size) {
+	union TrackingHeader *header;
+	size_t oldSize;
+
+	if (pointer == NULL)
+		return trackingAllocate(user, size);
+	if (size > SIZE_MAX - sizeof(union TrackingHeader))
+		return NULL;
+
+	header = (union TrackingHeader *) pointer - 1;
+	oldSize = header->size;
+	header = realloc(header, sizeof(union TrackingHeader) + size);
+	if (header == NULL)
+		return NULL;
+
+	/* Counted as a new allocation, as that's what it costs. */
+	countRelease(oldSize);
+	countAllocation(size);
+	header->size = size;
+	return header + 1;
+}
+
+static const struct CGAllocator systemAllocator = {
+	systemAllocate, systemReallocate, systemRelease, NULL
+};
+
+static const struct CGAllocator trackingAllocator = {
+	trackingAllocate, trackingReallocate, trackingRelease, NULL
+};
+
+static struct CGAllocator allocator = {
+	systemAllocate, systemReallocate, systemRelease, NULL
+};
+
+void
+CGSetAllocator(const struct CGAllocator *newAllocator) {
+	memcpy(&allocator, newAllocator != NULL ? newAllocator : &systemAllocator,
+		   sizeof(allocator));
+}
+
+const struct CGAllocator *
+CGGetTrackingAllocator(void) {
+	return &trackingAllocator;
+}
+
+void
+CGGetAllocationStats(struct CGAllocationStats *stats) {
+	stats->bytes = __atomic_load_n(&trackingStats.bytes, __ATOMIC_RELAXED);
+	stats->peakBytes = __atomic_load_n(&trackingStats.peakBytes,
+									   __ATOMIC_RELAXED);
+	stats->allocations = __atomic_load_n(&trackingStats.allocations,
+										 __ATOMIC_RELAXED);
+	stats->totalAllocations = __atomic_load_n(&trackingStats.totalAllocations,
+											  __ATOMIC_RELAXED);
+}
+
+void *
+cgMalloc(size_t size) {
+	return allocator.allocate(allocator.user, size);
+}
+
+void *
+cgCalloc(size_t count, size_t size) {
+	void *pointer;
+
+	if (size != 0 && count > SIZE_MAX / size)
+		return NULL;
+
+	pointer = allocator.allocate(allocator.user, count * size);
+	if (pointer != NULL)
+		memset(pointer, 0, count * size);
+	return pointer;
+}
+
+void *
+cgRealloc(void *pointer, size_t size) {
+	return allocator.reallocate(allocator.user, pointer, size);
+}
+
+void
+cgFree(void *pointer) {
+	if (pointer != NULL)
+		allocator.release(allocator.user, pointer);
+}
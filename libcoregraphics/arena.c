@@ -0,0 +1,485 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Frame and scratch arenas. Every thread that allocates transient memory with
+ * CGFrameAlloc gets an arena of two buffers, mapped on first use, and bumps a
+ * pointer through one of them. CGStart begins a new frame by counting frames;
+ * an arena notices on its next allocation and switches buffers, so what a
+ * thread allocated stays valid until the end of the frame after. The render
+ * thread switches right away, to keep its statistics per frame. Allocations
+ * that don't fit come from the heap and are freed when their buffer is reused.
+ *
+ * Scratch arenas are per thread as well, and hold the temporary memory of a
+ * scope like decoding an image, which is all released at once when the
+ * outermost scope ends.
+ */
+
+#include "libcg.h"
+
+#include <sys/mman.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#define DEFAULT_ARENA_SIZE (4 << 20)
+#define DEFAULT_SCRATCH_SIZE (64 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+/* The header of an allocation that didn't fit, in front of its memory. */
+struct ArenaOverflow {
+	struct ArenaOverflow *next;
+};
+
+struct ArenaBuffer {
+	unsigned char	*memory;
+	size_t		 used;
+	struct ArenaOverflow *overflows;
+	unsigned int	 overflowCount;
+	size_t		 overflowBytes;
+};
+
+struct FrameArena {
+	struct ArenaBuffer buffers[2];
+	/* the buffer allocated from */
+	int		 current;
+	/* the frame the current buffer belongs to */
+	uint64_t	 frame;
+	size_t		 capacity;
+	bool		 hugePages;
+	bool		 warned;
+	struct CGFrameArenaStats stats;
+};
+
+/* The header of a scratch allocation, in front of its memory. */
+union ScratchHeader {
+	size_t		 size;
+	max_align_t	 alignment;
+};
+
+struct ScratchArena {
+	unsigned char	*memory;
+	size_t		 capacity;
+	size_t		 used;
+	/* where the header of the last allocation is, which can grow in place
+	 * or be given back, SIZE_MAX if none */
+	size_t		 last;
+	/* the number of scopes begun and not ended */
+	int		 depth;
+};
+
+static size_t arenaSize = DEFAULT_ARENA_SIZE;
+static bool arenaHugePages = false;
+/* Counted by the render thread, read by all. */
+static uint64_t arenaFrame = 0;
+
+static size_t scratchSize = DEFAULT_SCRATCH_SIZE;
+
+static pthread_once_t arenaKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t arenaKey;
+static pthread_key_t scratchKey;
+static __thread struct FrameArena *threadArena = NULL;
+static __thread struct ScratchArena *threadScratch = NULL;
+
+void
+CGSetFrameArenaSize(size_t size, bool hugePages) {
+	arenaSize = size;
+	arenaHugePages = hugePages;
+}
+
+void
+CGSetScratchArenaSize(size_t size) {
+	scratchSize = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+}
+
+static void
+freeOverflows(struct ArenaBuffer *buffer) {
+	struct ArenaOverflow *overflow;
+
+	while (buffer->overflows != NULL) {
+		overflow = buffer->overflows;
+		buffer->overflows = overflow->next;
+		cgFree(overflow);
+	}
+}
+
+static void
+destroyArena(void *pointer) {
+	struct FrameArena *arena = pointer;
+
+	freeOverflows(&arena->buffers[0]);
+	freeOverflows(&arena->buffers[1]);
+	if (arena->buffers[0].memory != NULL)
+		munmap(arena->buffers[0].memory, arena->capacity * 2);
+	cgFree(arena);
+}
+
+static void
+destroyScratch(void *pointer) {
+	struct ScratchArena *scratch = pointer;
+
+	if (scratch->memory != NULL)
+		munmap(scratch->memory, scratch->capacity);
+	cgFree(scratch);
+}
+
+static void
+createArenaKeys(void) {
+	/* Arenas of threads that exit are released with them. */
+	if (pthread_key_create(&arenaKey, destroyArena) != 0
+		|| pthread_key_create(&scratchKey, destroyScratch) != 0)
+		fputs("[CGFrameAlloc] Failed to create the arena keys!\n", stderr);
+}
+
+/**
+ * Maps both buffers at once. Huge pages are tried explicitly first, and
+ * otherwise requested from transparent huge pages. Returns NULL on failure.
+ */
+static unsigned char *
+mapBuffers(size_t size, bool hugePages) {
+	void *memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	/* Without MAP_NORESERVE, so this fails instead of faulting later if too
+	 * few huge pages are reserved. */
+	if (hugePages)
+		memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE
+					  | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (memory == MAP_FAILED) {
+		memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE
+					  | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (memory == MAP_FAILED) {
+			perror("[CGFrameAlloc] mmap() failure");
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugePages)
+			madvise(memory, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	return memory;
+}
+
+/**
+ * Creates the arena of the calling thread. If its buffers can't be mapped,
+ * everything overflows.
+ */
+static struct FrameArena *
+createArena(void) {
+	struct FrameArena *arena;
+
+	arena = cgCalloc(1, sizeof(struct FrameArena));
+	if (arena == NULL) {
+		fputs("[CGFrameAlloc] Failed to allocate an arena!\n", stderr);
+		return NULL;
+	}
+
+	arena->hugePages = arenaHugePages;
+	arena->capacity = arenaSize;
+	if (arena->hugePages)
+		arena->capacity = (arena->capacity + HUGE_PAGE_SIZE - 1)
+						& ~(size_t) (HUGE_PAGE_SIZE - 1);
+	else
+		arena->capacity = (arena->capacity + ARENA_ALIGNMENT - 1)
+						& ~(size_t) (ARENA_ALIGNMENT - 1);
+
+	if (arena->capacity > 0) {
+		arena->buffers[0].memory = mapBuffers(arena->capacity * 2,
+											  arena->hugePages);
+		if (arena->buffers[0].memory == NULL)
+			arena->capacity = 0;
+		else
+			arena->buffers[1].memory = arena->buffers[0].memory
+									 + arena->capacity;
+	}
+
+	arena->frame = __atomic_load_n(&arenaFrame, __ATOMIC_RELAXED);
+	arena->stats.capacity = arena->capacity;
+
+	pthread_once(&arenaKeyOnce, createArenaKeys);
+	pthread_setspecific(arenaKey, arena);
+	return arena;
+}
+
+/**
+ * Ends the frame of the current buffer, and reuses the other one, unless a
+ * frame was skipped, in which case both are reused.
+ */
+static void
+switchBuffers(struct FrameArena *arena, uint64_t frame) {
+	struct ArenaBuffer *buffer = &arena->buffers[arena->current];
+
+	arena->stats.used = buffer->used + buffer->overflowBytes;
+	arena->stats.overflowCount = buffer->overflowCount;
+	arena->stats.overflowBytes = buffer->overflowBytes;
+	if (arena->stats.used > arena->stats.highWater)
+		arena->stats.highWater = arena->stats.used;
+
+	if (buffer->overflowCount > 0 && !arena->warned) {
+		fprintf(stderr, "[CGFrameAlloc] %zu bytes didn't fit in the frame "
+				"arena of %zu bytes.\n", buffer->overflowBytes,
+				arena->capacity);
+		arena->warned = true;
+	}
+
+	if (frame - arena->frame > 1) {
+		freeOverflows(buffer);
+		buffer->used = 0;
+		buffer->overflowCount = 0;
+		buffer->overflowBytes = 0;
+	}
+
+	arena->current ^= 1;
+	buffer = &arena->buffers[arena->current];
+	freeOverflows(buffer);
+	buffer->used = 0;
+	buffer->overflowCount = 0;
+	buffer->overflowBytes = 0;
+	arena->frame = frame;
+}
+
+static void *
+allocateOverflow(struct ArenaBuffer *buffer, size_t size, size_t alignment) {
+	struct ArenaOverflow *overflow;
+	uintptr_t address;
+
+	if (size > SIZE_MAX - sizeof(struct ArenaOverflow) - alignment)
+		return NULL;
+
+	overflow = cgMalloc(sizeof(struct ArenaOverflow) + size + alignment);
+	if (overflow == NULL)
+		return NULL;
+
+	overflow->next = buffer->overflows;
+	buffer->overflows = overflow;
+	buffer->overflowCount++;
+	buffer->overflowBytes += size;
+
+	address = (uintptr_t) (overflow + 1);
+	return (void *) ((address + alignment - 1) & ~(alignment - 1));
+}
+
+void *
+CGFrameAllocAligned(size_t size, size_t alignment) {
+	struct FrameArena *arena = threadArena;
+	struct ArenaBuffer *buffer;
+	uint64_t frame;
+	size_t offset;
+
+	if (arena == NULL) {
+		arena = threadArena = createArena();
+		if (arena == NULL)
+			return NULL;
+	}
+
+	frame = __atomic_load_n(&arenaFrame, __ATOMIC_RELAXED);
+	if (frame != arena->frame)
+		switchBuffers(arena, frame);
+
+	buffer = &arena->buffers[arena->current];
+	offset = (buffer->used + alignment - 1) & ~(alignment - 1);
+	if (offset > arena->capacity || size > arena->capacity - offset)
+		return allocateOverflow(buffer, size, alignment);
+
+	buffer->used = offset + size;
+	return buffer->memory + offset;
+}
+
+void *
+CGFrameAlloc(size_t size) {
+	return CGFrameAllocAligned(size, ARENA_ALIGNMENT);
+}
+
+bool
+CGGetFrameArenaStats(struct CGFrameArenaStats *stats) {
+	if (threadArena == NULL)
+		return false;
+
+	*stats = threadArena->stats;
+	return true;
+}
+
+void
+beginArenaFrame(void) {
+	uint64_t frame;
+
+	frame = __atomic_add_fetch(&arenaFrame, 1, __ATOMIC_RELAXED);
+	if (threadArena == NULL)
+		return;
+
+	switchBuffers(threadArena, frame);
+	CGTraceCounter("frame arena (KiB)", threadArena->stats.used / 1024.0);
+}
+
+void
+releaseFrameArena(void) {
+	if (threadArena != NULL) {
+		pthread_setspecific(arenaKey, NULL);
+		destroyArena(threadArena);
+		threadArena = NULL;
+	}
+
+	if (threadScratch != NULL) {
+		pthread_setspecific(scratchKey, NULL);
+		destroyScratch(threadScratch);
+		threadScratch = NULL;
+	}
+}
+
+static struct ScratchArena *
+createScratch(void) {
+	struct ScratchArena *scratch;
+
+	scratch = cgCalloc(1, sizeof(struct ScratchArena));
+	if (scratch == NULL) {
+		fputs("[beginScratch] Failed to allocate a scratch arena!\n", stderr);
+		return NULL;
+	}
+
+	/* Reserved only, pages are committed as they are touched. */
+	scratch->capacity = scratchSize;
+	if (scratch->capacity > 0) {
+		scratch->memory = mapBuffers(scratch->capacity, false);
+		if (scratch->memory == NULL)
+			scratch->capacity = 0;
+	}
+	scratch->last = SIZE_MAX;
+
+	pthread_once(&arenaKeyOnce, createArenaKeys);
+	pthread_setspecific(scratchKey, scratch);
+	return scratch;
+}
+
+void
+beginScratch(void) {
+	if (threadScratch == NULL) {
+		threadScratch = createScratch();
+		if (threadScratch == NULL)
+			return;
+	}
+
+	threadScratch->depth++;
+}
+
+void
+endScratch(void) {
+	struct ScratchArena *scratch = threadScratch;
+
+	if (scratch == NULL || scratch->depth == 0)
+		return;
+
+	if (--scratch->depth == 0) {
+		scratch->used = 0;
+		scratch->last = SIZE_MAX;
+	}
+}
+
+void *
+allocateScratch(size_t size) {
+	struct ScratchArena *scratch = threadScratch;
+	union ScratchHeader *header;
+	size_t needed;
+
+	if (scratch == NULL || scratch->depth == 0
+		|| size > scratch->capacity - scratch->used)
+		return NULL;
+
+	needed = sizeof(union ScratchHeader)
+		   + ((size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1));
+	if (needed > scratch->capacity - scratch->used)
+		return NULL;
+
+	header = (union ScratchHeader *) (scratch->memory + scratch->used);
+	header->size = size;
+	scratch->last = scratch->used;
+	scratch->used += needed;
+	return header + 1;
+}
+
+bool
+isScratchMemory(const void *pointer) {
+	const struct ScratchArena *scratch = threadScratch;
+
+	return scratch != NULL && scratch->memory != NULL
+		   && (const unsigned char *) pointer >= scratch->memory
+		   && (const unsigned char *) pointer
+			  < scratch->memory + scratch->capacity;
+}
+
+void *
+reallocateScratch(void *pointer, size_t size) {
+	struct ScratchArena *scratch = threadScratch;
+	union ScratchHeader *header = (union ScratchHeader *) pointer - 1;
+	size_t offset = (unsigned char *) header - scratch->memory;
+	size_t available = scratch->capacity - offset - sizeof(union ScratchHeader);
+	void *moved;
+
+	/* The last allocation grows or shrinks where it is. */
+	if (offset == scratch->last && size <= available) {
+		header->size = size;
+		scratch->used = offset + sizeof(union ScratchHeader)
+					  + ((size + ARENA_ALIGNMENT - 1)
+						 & ~(size_t) (ARENA_ALIGNMENT - 1));
+		return pointer;
+	}
+
+	moved = allocateScratch(size);
+	if (moved == NULL)
+		moved = cgMalloc(size);
+	if (moved != NULL)
+		memcpy(moved, pointer, size < header->size ? size : header->size);
+	return moved;
+}
+
+void
+releaseScratch(void *pointer) {
+	struct ScratchArena *scratch = threadScratch;
+	size_t offset;
+
+	if (scratch->depth == 0)
+		return;
+
+	/* Only the last allocation can be given back before the scope ends. */
+	offset = (unsigned char *) pointer - sizeof(union ScratchHeader)
+		   - scratch->memory;
+	if (offset == scratch->last) {
+		scratch->used = offset;
+		scratch->last = SIZE_MAX;
+	}
+}
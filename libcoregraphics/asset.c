@@ -0,0 +1,461 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Manifest loading. The work of every asset is split in the part that can
+ * run anywhere (reading, decoding, and compiling, which the driver does in
+ * the background) and the part that needs the render thread. The first part
+ * is done for all assets at once, the second in the order of the
+ * dependencies.
+ */
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+enum Mark {
+	UNVISITED,
+	VISITING,
+	VISITED,
+};
+
+struct AssetState {
+	/* indices of the dependencies */
+	size_t		*dependencies;
+	size_t		 dependencyCount;
+	enum Mark	 mark;
+	struct CGFileView sources[2];
+	bool		 compiled;
+	struct CGImagePixels *pixels;
+};
+
+struct Manifest {
+	struct CGAsset	*assets;
+	size_t		 count;
+	struct AssetState *states;
+	/* the assets in an order where dependencies come first */
+	size_t		*order;
+	size_t		 orderCount;
+};
+
+static const char *typeNames[] = {
+	[CG_AT_SHADER] = "shader",
+	[CG_AT_MESH] = "mesh",
+	[CG_AT_IMAGE] = "image",
+	[CG_AT_CUSTOM] = "custom",
+};
+
+static void
+freeManifest(struct Manifest *manifest) {
+	size_t i;
+
+	for (i = 0; i < manifest->count; i++)
+		cgFree(manifest->states[i].dependencies);
+	cgFree(manifest->states);
+	cgFree(manifest->order);
+}
+
+static void
+visitAsset(struct Manifest *manifest, size_t index, bool setFailures) {
+	struct AssetState *state = &manifest->states[index];
+	struct CGAsset *asset = &manifest->assets[index];
+	size_t dependency;
+	size_t i;
+
+	state->mark = VISITING;
+	for (i = 0; i < state->dependencyCount; i++) {
+		dependency = state->dependencies[i];
+		if (manifest->states[dependency].mark == VISITING) {
+			if (setFailures && asset->failure == NULL)
+				asset->failure = "circular dependency";
+		} else if (manifest->states[dependency].mark == UNVISITED) {
+			visitAsset(manifest, dependency, setFailures);
+		}
+	}
+
+	state->mark = VISITED;
+	manifest->order[manifest->orderCount++] = index;
+}
+
+/**
+ * Looks up the dependencies of every asset by name and sorts the assets
+ * topologically. Unknown dependencies and cycles are recorded as failures if
+ * setFailures is set.
+ */
+static bool
+resolveManifest(struct Manifest *manifest, struct CGAsset *assets,
+				size_t count, bool setFailures) {
+	struct AssetState *state;
+	const char *name;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	manifest->assets = assets;
+	manifest->count = count;
+	manifest->orderCount = 0;
+	manifest->states = cgCalloc(count, sizeof(struct AssetState));
+	manifest->order = cgCalloc(count, sizeof(size_t));
+	if (manifest->states == NULL || manifest->order == NULL) {
+		cgFree(manifest->states);
+		cgFree(manifest->order);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		state = &manifest->states[i];
+		for (j = 0; assets[i].dependencies != NULL
+			 && assets[i].dependencies[j] != NULL; j++)
+			continue;
+		if (j == 0)
+			continue;
+
+		state->dependencies = cgMalloc(j * sizeof(size_t));
+		if (state->dependencies == NULL) {
+			freeManifest(manifest);
+			return false;
+		}
+
+		for (j = 0; (name = assets[i].dependencies[j]) != NULL; j++) {
+			for (k = 0; k < count && strcmp(assets[k].name, name) != 0; k++)
+				continue;
+
+			if (k == count) {
+				if (setFailures) {
+					fprintf(stderr, "[CGLoadAssets] '%s' depends on unknown "
+							"asset '%s'!\n", assets[i].name, name);
+					assets[i].failure = "unknown dependency";
+				}
+				continue;
+			}
+
+			state->dependencies[state->dependencyCount++] = k;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (manifest->states[i].mark == UNVISITED)
+			visitAsset(manifest, i, setFailures);
+	}
+
+	return true;
+}
+
+/**
+ * Reads the sources of every shader in one batch.
+ */
+static void
+readShaders(struct Manifest *manifest) {
+	const struct CGShaderInitData *initData;
+	struct CGFileView *views;
+	const char **paths;
+	size_t shaderCount = 0;
+	size_t shader;
+	size_t bytes = 0;
+	double start;
+	double time;
+	size_t i;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	for (i = 0; i < manifest->count; i++) {
+		if (manifest->assets[i].type == CG_AT_SHADER
+			&& manifest->assets[i].failure == NULL)
+			shaderCount++;
+	}
+
+	if (shaderCount == 0)
+		return;
+
+	paths = cgMalloc(shaderCount * 2 * sizeof(const char *));
+	views = cgMalloc(shaderCount * 2 * sizeof(struct CGFileView));
+	if (paths == NULL || views == NULL) {
+		cgFree(paths);
+		cgFree(views);
+		for (i = 0; i < manifest->count; i++) {
+			if (manifest->assets[i].type == CG_AT_SHADER
+				&& manifest->assets[i].failure == NULL)
+				manifest->assets[i].failure = "out of memory";
+		}
+		return;
+	}
+
+	shader = 0;
+	for (i = 0; i < manifest->count; i++) {
+		if (manifest->assets[i].type != CG_AT_SHADER
+			|| manifest->assets[i].failure != NULL)
+			continue;
+
+		initData = manifest->assets[i].initData;
+		paths[shader * 2] = initData->vertexShaderFilePath;
+		paths[shader * 2 + 1] = initData->fragmentShaderFilePath;
+		shader++;
+	}
+
+	span = beginSpan("read shaders", NULL);
+	start = getTime();
+	CGReadFiles(views, paths, shaderCount * 2);
+	time = (getTime() - start) / shaderCount;
+	for (i = 0; i < shaderCount * 2; i++)
+		bytes += views[i].size;
+	endSpan(span, bytes);
+
+	/* The batch is timed as a whole, every shader gets its share. */
+	shader = 0;
+	for (i = 0; i < manifest->count; i++) {
+		if (manifest->assets[i].type != CG_AT_SHADER
+			|| manifest->assets[i].failure != NULL)
+			continue;
+
+		manifest->states[i].sources[0] = views[shader * 2];
+		manifest->states[i].sources[1] = views[shader * 2 + 1];
+		manifest->assets[i].decodeTime = time;
+		if (views[shader * 2].data == NULL
+			|| views[shader * 2 + 1].data == NULL)
+			manifest->assets[i].failure = "failed to read";
+		shader++;
+	}
+
+	cgFree(paths);
+	cgFree(views);
+}
+
+/**
+ * Compiles every shader that was read, so the driver can compile them while
+ * the images are decoded.
+ */
+static void
+compileShaders(struct Manifest *manifest) {
+	struct AssetState *state;
+	struct CGAsset *asset;
+	double start;
+	size_t i;
+
+	for (i = 0; i < manifest->count; i++) {
+		asset = &manifest->assets[i];
+		state = &manifest->states[i];
+		if (asset->type != CG_AT_SHADER)
+			continue;
+
+		if (asset->failure == NULL) {
+			start = getTime();
+			state->compiled = compileShader(asset->data, asset->initData,
+											state->sources);
+			asset->createTime = getTime() - start;
+			if (!state->compiled)
+				asset->failure = "failed to compile";
+		}
+
+		CGReleaseFileView(&state->sources[0]);
+		CGReleaseFileView(&state->sources[1]);
+	}
+}
+
+static void
+decodeAsset(void *argument, size_t index) {
+	struct Manifest *manifest = argument;
+	struct CGAsset *asset = &manifest->assets[index];
+	double start;
+	CG_FUNCTION_ZONE();
+
+	if (asset->type != CG_AT_IMAGE || asset->failure != NULL)
+		return;
+
+	start = getTime();
+	manifest->states[index].pixels = decodeImage(asset->data,
+												 asset->initData);
+	asset->decodeTime = getTime() - start;
+	if (manifest->states[index].pixels == NULL)
+		asset->failure = "failed to decode";
+}
+
+/**
+ * Creates the OpenGL objects of an asset whose dependencies have been
+ * created, or releases what was prepared for it if any of them failed.
+ */
+static void
+createAsset(struct Manifest *manifest, size_t index) {
+	struct AssetState *state = &manifest->states[index];
+	struct CGAsset *asset = &manifest->assets[index];
+	double start;
+	size_t i;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	for (i = 0; asset->failure == NULL && i < state->dependencyCount; i++) {
+		if (!manifest->assets[state->dependencies[i]].loaded)
+			asset->failure = "a dependency failed";
+	}
+
+	if (asset->failure != NULL) {
+		if (state->compiled)
+			CGDeleteShader(asset->data);
+		if (state->pixels != NULL)
+			releaseImagePixels(state->pixels);
+		return;
+	}
+
+	span = beginSpan("create asset", asset->name);
+	start = getTime();
+	switch (asset->type) {
+		case CG_AT_SHADER:
+			asset->loaded = finishShader(asset->data);
+			break;
+		case CG_AT_MESH:
+			asset->loaded = CGLoadMesh(asset->data, asset->initData);
+			break;
+		case CG_AT_IMAGE:
+			asset->loaded = createImageTexture(asset->data, asset->initData,
+											   state->pixels);
+			break;
+		case CG_AT_CUSTOM:
+			asset->loaded = asset->load == NULL || asset->load(asset);
+			break;
+	}
+	asset->createTime += getTime() - start;
+	endSpan(span, 0);
+
+	if (!asset->loaded)
+		asset->failure = "failed to create";
+}
+
+bool
+CGLoadAssets(struct CGAsset *assets, size_t count) {
+	struct Manifest manifest;
+	bool success = true;
+	size_t i;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	for (i = 0; i < count; i++) {
+		assets[i].loaded = false;
+		assets[i].failure = NULL;
+		assets[i].decodeTime = 0.0;
+		assets[i].createTime = 0.0;
+	}
+
+	if (!resolveManifest(&manifest, assets, count, true)) {
+		fputs("[CGLoadAssets] Failed to allocate the manifest!\n", stderr);
+		for (i = 0; i < count; i++)
+			assets[i].failure = "out of memory";
+		return false;
+	}
+
+	span = beginSpan("CGLoadAssets", NULL);
+	readShaders(&manifest);
+	compileShaders(&manifest);
+	runParallel(decodeAsset, &manifest, count);
+
+	for (i = 0; i < manifest.orderCount; i++)
+		createAsset(&manifest, manifest.order[i]);
+	endSpan(span, 0);
+
+	for (i = 0; i < count; i++) {
+		if (assets[i].loaded)
+			continue;
+
+		fprintf(stderr, "[CGLoadAssets] Failed to load %s '%s': %s\n",
+				typeNames[assets[i].type], assets[i].name,
+				assets[i].failure);
+		success = false;
+	}
+
+	freeManifest(&manifest);
+	return success;
+}
+
+static void
+unloadAsset(struct CGAsset *asset) {
+	if (!asset->loaded)
+		return;
+
+	switch (asset->type) {
+		case CG_AT_SHADER:
+			CGDeleteShader(asset->data);
+			break;
+		case CG_AT_MESH:
+			CGDeleteMesh(asset->data);
+			break;
+		case CG_AT_IMAGE:
+			CGDeleteImage(asset->data);
+			break;
+		case CG_AT_CUSTOM:
+			if (asset->unload != NULL)
+				asset->unload(asset);
+			break;
+	}
+
+	asset->loaded = false;
+}
+
+void
+CGUnloadAssets(struct CGAsset *assets, size_t count) {
+	struct Manifest manifest;
+	size_t i;
+
+	/* Without memory for the order, the manifest order has to do. */
+	if (!resolveManifest(&manifest, assets, count, false)) {
+		for (i = count; i > 0; i--)
+			unloadAsset(&assets[i - 1]);
+		return;
+	}
+
+	for (i = manifest.orderCount; i > 0; i--)
+		unloadAsset(&assets[manifest.order[i - 1]]);
+
+	freeManifest(&manifest);
+}
+
+void
+CGPrintAssetReport(const struct CGAsset *assets, size_t count) {
+	double decodeTime = 0.0;
+	double createTime = 0.0;
+	size_t i;
+
+	printf("%-24s %-6s %10s %10s %s\n", "asset", "type", "decode ms",
+		   "create ms", "status");
+
+	for (i = 0; i < count; i++) {
+		printf("%-24s %-6s %10.3f %10.3f %s\n", assets[i].name,
+			   typeNames[assets[i].type], assets[i].decodeTime * 1000.0,
+			   assets[i].createTime * 1000.0,
+			   assets[i].loaded ? "loaded" : assets[i].failure != NULL
+			   ? assets[i].failure : "not loaded");
+		decodeTime += assets[i].decodeTime;
+		createTime += assets[i].createTime;
+	}
+
+	printf("%-24s %-6s %10.3f %10.3f\n", "total", "", decodeTime * 1000.0,
+		   createTime * 1000.0);
+}
@@ -0,0 +1,256 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The texture container and block compressed (BCn) formats. Textures in the
+ * container are uploaded as they are when the driver supports their format,
+ * otherwise they're decompressed here and loaded like any other image.
+ */
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <GL/glew.h>
+
+#include "internal.h"
+
+/* Larger textures are rejected, which also keeps the sizes below in range. */
+#define MAX_DIMENSION 32768
+
+int
+getBCnChannels(enum CGTextureFormat format) {
+	switch (format) {
+		case CG_TF_BC4:
+			return 1;
+		case CG_TF_BC5:
+			return 2;
+		default:
+			return 4;
+	}
+}
+
+size_t
+getBCnBlockSize(enum CGTextureFormat format) {
+	return format == CG_TF_BC1 || format == CG_TF_BC4 ? 8 : 16;
+}
+
+size_t
+getBCnLevelSize(enum CGTextureFormat format, int width, int height) {
+	return (size_t) ((width + 3) / 4) * ((height + 3) / 4)
+		 * getBCnBlockSize(format);
+}
+
+GLenum
+getBCnInternalFormat(enum CGTextureFormat format) {
+	switch (format) {
+		case CG_TF_BC1:
+			return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+		case CG_TF_BC3:
+			return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case CG_TF_BC4:
+			return GL_COMPRESSED_RED_RGTC1;
+		default:
+			return GL_COMPRESSED_RG_RGTC2;
+	}
+}
+
+bool
+parseTextureFile(const unsigned char *data, size_t size,
+				 struct TextureFile *file) {
+	struct CGTextureFileHeader header;
+	struct CGTextureFileLevel level;
+	const unsigned char *table;
+	int width;
+	int height;
+	int i;
+
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, CG_TEXTURE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != CG_TEXTURE_VERSION
+		|| header.format < CG_TF_BC1 || header.format > CG_TF_BC5
+		|| header.width == 0 || header.width > MAX_DIMENSION
+		|| header.height == 0 || header.height > MAX_DIMENSION
+		|| header.levelCount == 0 || header.levelCount > CG_MAX_MIP_LEVELS
+		|| (int) header.levelCount > CGGetMipLevelCount(header.width,
+														header.height))
+		return false;
+
+	table = data + sizeof(header);
+	if (size - sizeof(header) < header.levelCount * sizeof(level))
+		return false;
+
+	file->format = header.format;
+	file->width = header.width;
+	file->height = header.height;
+	file->levelCount = header.levelCount;
+
+	width = header.width;
+	height = header.height;
+	for (i = 0; i < file->levelCount; i++) {
+		memcpy(&level, table + i * sizeof(level), sizeof(level));
+		if (level.offset > size || size - level.offset < level.size
+			|| level.size != getBCnLevelSize(file->format, width, height))
+			return false;
+
+		file->levels[i].data = data + level.offset;
+		file->levels[i].size = level.size;
+
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return true;
+}
+
+static void
+expand565(uint16_t color, unsigned char rgb[3]) {
+	rgb[0] = ((color >> 11) & 0x1F) * 255 / 31;
+	rgb[1] = ((color >> 5) & 0x3F) * 255 / 63;
+	rgb[2] = (color & 0x1F) * 255 / 31;
+}
+
+/**
+ * Decodes a BC1 color block into 16 RGBA texels. BC3 always uses the four
+ * color mode, whatever the order of the endpoints.
+ */
+static void
+decodeColorBlock(const unsigned char *block, unsigned char texels[16][4],
+				 bool alwaysFourColors) {
+	unsigned char palette[4][4];
+	uint16_t color0 = block[0] | block[1] << 8;
+	uint16_t color1 = block[2] | block[3] << 8;
+	uint32_t indices = block[4] | block[5] << 8 | block[6] << 16
+					 | (uint32_t) block[7] << 24;
+	int i;
+
+	expand565(color0, palette[0]);
+	expand565(color1, palette[1]);
+	palette[0][3] = palette[1][3] = 255;
+
+	for (i = 0; i < 3; i++) {
+		if (color0 > color1 || alwaysFourColors) {
+			palette[2][i] = (2 * palette[0][i] + palette[1][i] + 1) / 3;
+			palette[3][i] = (palette[0][i] + 2 * palette[1][i] + 1) / 3;
+		} else {
+			palette[2][i] = (palette[0][i] + palette[1][i] + 1) / 2;
+			palette[3][i] = 0;
+		}
+	}
+	palette[2][3] = 255;
+	palette[3][3] = color0 > color1 || alwaysFourColors ? 255 : 0;
+
+	for (i = 0; i < 16; i++)
+		memcpy(texels[i], palette[(indices >> (2 * i)) & 3], 4);
+}
+
+/**
+ * Decodes a BC4 block (also the alpha of BC3) into 16 values.
+ */
+static void
+decodeValueBlock(const unsigned char *block, unsigned char values[16]) {
+	unsigned char palette[8];
+	uint64_t indices = 0;
+	int i;
+
+	palette[0] = block[0];
+	palette[1] = block[1];
+	if (palette[0] > palette[1]) {
+		for (i = 1; i < 7; i++)
+			palette[i + 1] = ((7 - i) * palette[0] + i * palette[1] + 3) / 7;
+	} else {
+		for (i = 1; i < 5; i++)
+			palette[i + 1] = ((5 - i) * palette[0] + i * palette[1] + 2) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+
+	for (i = 0; i < 6; i++)
+		indices |= (uint64_t) block[2 + i] << (8 * i);
+
+	for (i = 0; i < 16; i++)
+		values[i] = palette[(indices >> (3 * i)) & 7];
+}
+
+void
+decompressBCn(enum CGTextureFormat format, const unsigned char *data,
+			  int width, int height, unsigned char *pixels) {
+	int channels = getBCnChannels(format);
+	size_t blockSize = getBCnBlockSize(format);
+	unsigned char texels[16][4];
+	unsigned char values[16];
+	int blockX;
+	int blockY;
+	int x;
+	int y;
+	int i;
+
+	for (blockY = 0; blockY < height; blockY += 4) {
+		for (blockX = 0; blockX < width; blockX += 4) {
+			switch (format) {
+				case CG_TF_BC1:
+					decodeColorBlock(data, texels, false);
+					break;
+				case CG_TF_BC3:
+					decodeColorBlock(data + 8, texels, true);
+					decodeValueBlock(data, values);
+					for (i = 0; i < 16; i++)
+						texels[i][3] = values[i];
+					break;
+				case CG_TF_BC4:
+					decodeValueBlock(data, values);
+					for (i = 0; i < 16; i++)
+						texels[i][0] = values[i];
+					break;
+				case CG_TF_BC5:
+					decodeValueBlock(data, values);
+					for (i = 0; i < 16; i++)
+						texels[i][0] = values[i];
+					decodeValueBlock(data + 8, values);
+					for (i = 0; i < 16; i++)
+						texels[i][1] = values[i];
+					break;
+			}
+			data += blockSize;
+
+			/* Blocks on the right and bottom edges may be partial. */
+			for (y = 0; y < 4 && blockY + y < height; y++) {
+				for (x = 0; x < 4 && blockX + x < width; x++)
+					memcpy(pixels + ((size_t) (blockY + y) * width
+									 + blockX + x) * channels,
+						   texels[y * 4 + x], channels);
+			}
+		}
+	}
+}
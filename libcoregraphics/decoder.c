@@ -0,0 +1,611 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The image decoder registry. Every decoder handles one CGImageType, and the
+ * type of an image is sniffed from its data. Decoders of the same type are
+ * tried from the highest priority to the lowest, so the fast backends are used
+ * when they are compiled in (see the Makefile) and stb_image, which handles
+ * everything, is the fallback.
+ */
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CG_HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef CG_HAVE_SPNG
+#include <spng.h>
+#endif
+
+#include "internal.h"
+#include "stb_image.h"
+
+#define MAX_DECODERS 16
+
+/**
+ * The memory stb_image should put its output in, see decodeSTBImageInto. It's
+ * per thread, as decoding may happen on several threads at once.
+ */
+static __thread struct {
+	unsigned char	*pixels;
+	size_t		 size;
+	int		 channels;
+	/* whether stb_image currently holds the memory */
+	bool		 taken;
+} stbiOutput;
+
+static bool
+isOutputMemory(const void *pointer) {
+	return stbiOutput.taken && pointer == stbiOutput.pixels;
+}
+
+/**
+ * The allocation functions of stb_image (see stb_image.c). stb_image
+ * allocates the final image with a single call of its size, which is answered
+ * with the output memory; everything else comes from the scratch arena while
+ * decoding, and from the heap when the arena is full. The JPEG decoder asks
+ * for a spare byte, which it writes past the last pixel when there are three
+ * channels, so only then it can't have the output memory.
+ */
+void *
+cgSTBIMalloc(size_t size) {
+	void *pointer;
+
+	if (stbiOutput.pixels != NULL && !stbiOutput.taken
+		&& (size == stbiOutput.size
+			|| (size == stbiOutput.size + 1 && stbiOutput.channels != 3))) {
+		stbiOutput.taken = true;
+		return stbiOutput.pixels;
+	}
+
+	pointer = allocateScratch(size);
+	if (pointer == NULL)
+		pointer = cgMalloc(size);
+	return pointer;
+}
+
+void *
+cgSTBIRealloc(void *pointer, size_t size) {
+	void *moved;
+
+	if (pointer == NULL)
+		return cgSTBIMalloc(size);
+	if (isScratchMemory(pointer))
+		return reallocateScratch(pointer, size);
+	if (!isOutputMemory(pointer))
+		return cgRealloc(pointer, size);
+
+	/* A temporary buffer of the same size got the output memory, move it
+	 * out of the way. */
+	moved = cgMalloc(size);
+	if (moved != NULL) {
+		memcpy(moved, pointer, size < stbiOutput.size ? size : stbiOutput.size);
+		stbiOutput.taken = false;
+	}
+	return moved;
+}
+
+void
+cgSTBIFree(void *pointer) {
+	if (isOutputMemory(pointer))
+		stbiOutput.taken = false;
+	else if (isScratchMemory(pointer))
+		releaseScratch(pointer);
+	else
+		cgFree(pointer);
+}
+
+static unsigned char *
+decodeSTBImage(const unsigned char *data, size_t size, int *width,
+			   int *height, int *channels, int desiredChannels) {
+	unsigned char *pixels;
+	unsigned char *copy;
+	size_t pixelsSize;
+
+	beginScratch();
+	pixels = stbi_load_from_memory(data, size, width, height, channels,
+								   desiredChannels);
+	if (pixels == NULL)
+		fprintf(stderr, "[stb_image] %s\n", stbi_failure_reason());
+	else if (desiredChannels != 0)
+		*channels = desiredChannels;
+
+	/* The image outlives the scratch memory it may have been decoded in. */
+	if (pixels != NULL && isScratchMemory(pixels)) {
+		pixelsSize = (size_t) *width * *height * *channels;
+		copy = cgMalloc(pixelsSize);
+		if (copy != NULL)
+			memcpy(copy, pixels, pixelsSize);
+		else
+			fputs("[stb_image] Failed to allocate the image!\n", stderr);
+		pixels = copy;
+	}
+	endScratch();
+
+	return pixels;
+}
+
+static void
+freeSTBImage(unsigned char *pixels) {
+	stbi_image_free(pixels);
+}
+
+static bool
+infoSTBImage(const unsigned char *data, size_t size, int *width, int *height,
+			 int *channels) {
+	return stbi_info_from_memory(data, size, width, height, channels) != 0;
+}
+
+/**
+ * Lets stb_image allocate its output from the given pixels. If it happens to
+ * allocate something else of the same size first, the output ends up in
+ * other memory and is copied.
+ */
+static bool
+decodeSTBImageInto(const unsigned char *data, size_t size,
+				   unsigned char *pixels, int width, int height,
+				   int channels) {
+	unsigned char *result;
+	int resultWidth;
+	int resultHeight;
+	int resultChannels;
+
+	stbiOutput.pixels = pixels;
+	stbiOutput.size = (size_t) width * height * channels;
+	stbiOutput.channels = channels;
+	stbiOutput.taken = false;
+
+	beginScratch();
+	result = stbi_load_from_memory(data, size, &resultWidth, &resultHeight,
+								   &resultChannels, channels);
+	if (result == NULL) {
+		fprintf(stderr, "[stb_image] %s\n", stbi_failure_reason());
+	} else if (resultWidth != width || resultHeight != height) {
+		stbi_image_free(result);
+		result = NULL;
+	} else if (result != pixels) {
+		memcpy(pixels, result, stbiOutput.size);
+		stbi_image_free(result);
+	}
+	endScratch();
+
+	stbiOutput.pixels = NULL;
+	stbiOutput.taken = false;
+	return result != NULL;
+}
+
+static void
+freeMalloced(unsigned char *pixels) {
+	cgFree(pixels);
+}
+
+/**
+ * The texture container, decompressed on the CPU. CGLoadImage only decodes it
+ * when the driver doesn't support its format, otherwise the blocks are
+ * uploaded as they are.
+ */
+static bool
+infoCGT(const unsigned char *data, size_t size, int *width, int *height,
+		int *channels) {
+	struct TextureFile file;
+
+	if (!parseTextureFile(data, size, &file))
+		return false;
+
+	*width = file.width;
+	*height = file.height;
+	*channels = getBCnChannels(file.format);
+	return true;
+}
+
+static bool
+decodeCGTInto(const unsigned char *data, size_t size, unsigned char *pixels,
+			  int width, int height, int channels) {
+	struct TextureFile file;
+
+	/* The blocks decompress to a fixed channel count. */
+	if (!parseTextureFile(data, size, &file) || file.width != width
+		|| file.height != height || getBCnChannels(file.format) != channels)
+		return false;
+
+	decompressBCn(file.format, file.levels[0].data, width, height, pixels);
+	return true;
+}
+
+static unsigned char *
+decodeCGT(const unsigned char *data, size_t size, int *width, int *height,
+		  int *channels, int desiredChannels) {
+	unsigned char *pixels;
+
+	if (!infoCGT(data, size, width, height, channels)
+		|| (desiredChannels != 0 && desiredChannels != *channels))
+		return NULL;
+
+	pixels = cgMalloc((size_t) *width * *height * *channels);
+	if (pixels == NULL)
+		return NULL;
+
+	decodeCGTInto(data, size, pixels, *width, *height, *channels);
+	return pixels;
+}
+
+#ifdef CG_HAVE_TURBOJPEG
+/**
+ * libjpeg-turbo, which uses SIMD for the IDCT and color conversion.
+ */
+static bool
+infoTurboJPEG(const unsigned char *data, size_t size, int *width, int *height,
+			  int *channels) {
+	tjhandle handle;
+	int subsampling;
+	int colorspace;
+	bool success;
+
+	handle = tjInitDecompress();
+	if (handle == NULL)
+		return false;
+
+	success = tjDecompressHeader3(handle, data, size, width, height,
+								  &subsampling, &colorspace) == 0;
+	if (success)
+		*channels = colorspace == TJCS_GRAY ? 1 : 3;
+
+	tjDestroy(handle);
+	return success;
+}
+
+static bool
+decodeTurboJPEGInto(const unsigned char *data, size_t size,
+					unsigned char *pixels, int width, int height,
+					int channels) {
+	tjhandle handle;
+	int pixelFormat;
+	bool success;
+
+	switch (channels) {
+		case 1:
+			pixelFormat = TJPF_GRAY;
+			break;
+		case 3:
+			pixelFormat = TJPF_RGB;
+			break;
+		case 4:
+			pixelFormat = TJPF_RGBA;
+			break;
+		default:
+			/* Grayscale+alpha isn't a thing for JPEG, let stb_image expand
+			 * it. */
+			return false;
+	}
+
+	handle = tjInitDecompress();
+	if (handle == NULL)
+		return false;
+
+	success = tjDecompress2(handle, data, size, pixels, width, 0, height,
+							pixelFormat, 0) == 0;
+	if (!success)
+		fprintf(stderr, "[turbojpeg] %s\n", tjGetErrorStr2(handle));
+
+	tjDestroy(handle);
+	return success;
+}
+
+static unsigned char *
+decodeTurboJPEG(const unsigned char *data, size_t size, int *width,
+				int *height, int *channels, int desiredChannels) {
+	unsigned char *pixels;
+
+	if (!infoTurboJPEG(data, size, width, height, channels))
+		return NULL;
+
+	if (desiredChannels != 0)
+		*channels = desiredChannels;
+
+	pixels = cgMalloc((size_t) *width * *height * *channels);
+	if (pixels == NULL)
+		return NULL;
+
+	if (!decodeTurboJPEGInto(data, size, pixels, *width, *height,
+							 *channels)) {
+		cgFree(pixels);
+		return NULL;
+	}
+
+	return pixels;
+}
+#endif /* CG_HAVE_TURBOJPEG */
+
+#ifdef CG_HAVE_SPNG
+/**
+ * libspng, which is considerably faster than stb_image's inflate and filters,
+ * especially when built against zlib-ng.
+ */
+static bool
+infoSPNG(const unsigned char *data, size_t size, int *width, int *height,
+		 int *channels) {
+	spng_ctx *ctx;
+	struct spng_ihdr ihdr;
+	bool success;
+
+	ctx = spng_ctx_new(0);
+	if (ctx == NULL)
+		return false;
+
+	success = spng_set_png_buffer(ctx, data, size) == 0
+		   && spng_get_ihdr(ctx, &ihdr) == 0;
+	if (success) {
+		*width = ihdr.width;
+		*height = ihdr.height;
+
+		switch (ihdr.color_type) {
+			case SPNG_COLOR_TYPE_GRAYSCALE:
+				*channels = ihdr.bit_depth <= 8 ? 1 : 3;
+				break;
+			case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+				*channels = 2;
+				break;
+			case SPNG_COLOR_TYPE_TRUECOLOR:
+				*channels = 3;
+				break;
+			default:
+				*channels = 4;
+				break;
+		}
+	}
+
+	spng_ctx_free(ctx);
+	return success;
+}
+
+static bool
+decodeSPNGInto(const unsigned char *data, size_t size, unsigned char *pixels,
+			   int width, int height, int channels) {
+	spng_ctx *ctx;
+	size_t outputSize;
+	int format;
+	bool success;
+
+	switch (channels) {
+		case 1:
+			format = SPNG_FMT_G8;
+			break;
+		case 2:
+			format = SPNG_FMT_GA8;
+			break;
+		case 3:
+			format = SPNG_FMT_RGB8;
+			break;
+		default:
+			format = SPNG_FMT_RGBA8;
+			break;
+	}
+
+	ctx = spng_ctx_new(0);
+	if (ctx == NULL)
+		return false;
+
+	success = spng_set_png_buffer(ctx, data, size) == 0
+		   && spng_decoded_image_size(ctx, format, &outputSize) == 0
+		   && outputSize == (size_t) width * height * channels
+		   && spng_decode_image(ctx, pixels, outputSize, format,
+								SPNG_DECODE_TRNS) == 0;
+
+	spng_ctx_free(ctx);
+	return success;
+}
+
+static unsigned char *
+decodeSPNG(const unsigned char *data, size_t size, int *width, int *height,
+		   int *channels, int desiredChannels) {
+	unsigned char *pixels;
+
+	if (!infoSPNG(data, size, width, height, channels))
+		return NULL;
+
+	if (desiredChannels != 0)
+		*channels = desiredChannels;
+
+	pixels = cgMalloc((size_t) *width * *height * *channels);
+	if (pixels == NULL)
+		return NULL;
+
+	if (!decodeSPNGInto(data, size, pixels, *width, *height, *channels)) {
+		cgFree(pixels);
+		return NULL;
+	}
+
+	return pixels;
+}
+#endif /* CG_HAVE_SPNG */
+
+static struct CGImageDecoder decoders[MAX_DECODERS] = {
+#ifdef CG_HAVE_TURBOJPEG
+	{ "turbojpeg", CG_IT_JPEG, 10, decodeTurboJPEG, freeMalloced,
+	  infoTurboJPEG, decodeTurboJPEGInto },
+#endif
+#ifdef CG_HAVE_SPNG
+	{ "spng", CG_IT_PNG, 10, decodeSPNG, freeMalloced, infoSPNG,
+	  decodeSPNGInto },
+#endif
+	{ "stb_image", CG_IT_JPEG, 0, decodeSTBImage, freeSTBImage,
+	  infoSTBImage, decodeSTBImageInto },
+	{ "stb_image", CG_IT_PNG, 0, decodeSTBImage, freeSTBImage,
+	  infoSTBImage, decodeSTBImageInto },
+	{ "cgt", CG_IT_CGT, 0, decodeCGT, freeMalloced, infoCGT, decodeCGTInto },
+};
+
+static size_t decoderCount = 3
+#ifdef CG_HAVE_TURBOJPEG
+	+ 1
+#endif
+#ifdef CG_HAVE_SPNG
+	+ 1
+#endif
+	;
+
+bool
+CGRegisterImageDecoder(const struct CGImageDecoder *decoder) {
+	if (decoderCount == MAX_DECODERS) {
+		fputs("[CGRegisterImageDecoder] Too many decoders!\n", stderr);
+		return false;
+	}
+
+	memcpy(&decoders[decoderCount++], decoder, sizeof(*decoder));
+	return true;
+}
+
+size_t
+CGGetImageDecoderCount(void) {
+	return decoderCount;
+}
+
+const struct CGImageDecoder *
+CGGetImageDecoder(size_t index) {
+	if (index >= decoderCount)
+		return NULL;
+
+	return &decoders[index];
+}
+
+bool
+CGDetectImageType(const unsigned char *data, size_t size,
+				  enum CGImageType *type) {
+	static const unsigned char pngSignature[] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+	};
+
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+		*type = CG_IT_JPEG;
+		return true;
+	}
+
+	if (size >= sizeof(pngSignature)
+		&& memcmp(data, pngSignature, sizeof(pngSignature)) == 0) {
+		*type = CG_IT_PNG;
+		return true;
+	}
+
+	if (size >= 4 && memcmp(data, CG_TEXTURE_MAGIC, 4) == 0) {
+		*type = CG_IT_CGT;
+		return true;
+	}
+
+	return false;
+}
+
+unsigned char *
+CGDecodeImage(const unsigned char *data, size_t size, enum CGImageType hint,
+			  int *width, int *height, int *channels, int desiredChannels,
+			  const struct CGImageDecoder **usedDecoder) {
+	enum CGImageType type = hint;
+	bool tried[MAX_DECODERS] = { false };
+	const struct CGImageDecoder *best;
+	unsigned char *pixels;
+	size_t i;
+
+	CGDetectImageType(data, size, &type);
+
+	for (;;) {
+		best = NULL;
+		for (i = 0; i < decoderCount; i++) {
+			if (tried[i] || decoders[i].type != type)
+				continue;
+			if (best == NULL || decoders[i].priority > best->priority)
+				best = &decoders[i];
+		}
+
+		if (best == NULL)
+			return NULL;
+
+		tried[best - decoders] = true;
+		pixels = best->decode(data, size, width, height, channels,
+							  desiredChannels);
+		if (pixels != NULL) {
+			if (usedDecoder != NULL)
+				*usedDecoder = best;
+			return pixels;
+		}
+
+		fprintf(stderr, "[CGDecodeImage] Decoder '%s' failed, trying the "
+				"next one.\n", best->name);
+	}
+}
+
+bool
+CGDecodeImageInto(const unsigned char *data, size_t size,
+				  enum CGImageType hint, CGImageAllocateFunc allocate,
+				  void *user, int *width, int *height, int *channels) {
+	enum CGImageType type = hint;
+	bool tried[MAX_DECODERS] = { false };
+	const struct CGImageDecoder *best;
+	unsigned char *pixels = NULL;
+	size_t i;
+
+	CGDetectImageType(data, size, &type);
+
+	for (;;) {
+		best = NULL;
+		for (i = 0; i < decoderCount; i++) {
+			if (tried[i] || decoders[i].type != type
+				|| decoders[i].info == NULL || decoders[i].decodeInto == NULL)
+				continue;
+			if (best == NULL || decoders[i].priority > best->priority)
+				best = &decoders[i];
+		}
+
+		if (best == NULL)
+			return false;
+
+		tried[best - decoders] = true;
+
+		/* The first decoder to understand the header decides the size. */
+		if (pixels == NULL) {
+			if (!best->info(data, size, width, height, channels))
+				continue;
+
+			pixels = allocate(*width, *height, channels, user);
+			if (pixels == NULL)
+				return false;
+		}
+
+		if (best->decodeInto(data, size, pixels, *width, *height, *channels))
+			return true;
+
+		fprintf(stderr, "[CGDecodeImageInto] Decoder '%s' failed, trying the "
+				"next one.\n", best->name);
+	}
+}
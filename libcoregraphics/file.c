@@ -0,0 +1,444 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * File views. Single files are mapped, so the page cache is the only copy of
+ * the data. Batches of files are read into memory instead, with every read in
+ * flight at once through an io_uring driven by raw system calls; for small
+ * files that's cheaper than the page faults and unmapping of a mapping each.
+ */
+
+#include "libcg.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "internal.h"
+
+/* Reads in flight at once. */
+#define QUEUE_DEPTH 64
+/* The result of a read is an int, so larger files are read in parts. */
+#define MAX_READ_SIZE (1u << 30)
+
+/* Empty files have no mapping, but their data mustn't be NULL. */
+static const unsigned char emptyFile[1];
+
+struct Ring {
+	int		 fd;
+	void		*sqRing;
+	size_t		 sqRingSize;
+	void		*cqRing;
+	size_t		 cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t		 sqesSize;
+	unsigned	*sqHead;
+	unsigned	*sqTail;
+	unsigned	*sqMask;
+	unsigned	*sqArray;
+	unsigned	*cqHead;
+	unsigned	*cqTail;
+	unsigned	*cqMask;
+	struct io_uring_cqe *cqes;
+	/* set when reads may be left in the ring, which then can't be reused */
+	bool		 broken;
+};
+
+static bool
+openFile(const char *caller, const char *path, int *fd, size_t *size) {
+	struct stat status;
+
+	*fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*fd == -1) {
+		fprintf(stderr, "[%s] Failed to open '%s': %s\n", caller, path,
+				strerror(errno));
+		return false;
+	}
+
+	if (fstat(*fd, &status) == -1) {
+		fprintf(stderr, "[%s] Failed to stat '%s': %s\n", caller, path,
+				strerror(errno));
+		close(*fd);
+		return false;
+	}
+
+	if (!S_ISREG(status.st_mode)) {
+		fprintf(stderr, "[%s] '%s' isn't a regular file!\n", caller, path);
+		close(*fd);
+		return false;
+	}
+
+	*size = status.st_size;
+	return true;
+}
+
+/**
+ * Reads size bytes from the offset on, retrying short and interrupted reads.
+ */
+static bool
+readFully(int fd, unsigned char *buffer, size_t size, size_t offset) {
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = pread(fd, buffer, size, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+
+		buffer += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool
+readIntoMemory(const char *caller, const char *path, int fd, size_t size,
+			   struct CGFileView *view) {
+	unsigned char *data;
+
+	data = cgMalloc(size);
+	if (data == NULL) {
+		fprintf(stderr, "[%s] Failed to allocate %zu bytes for '%s'!\n",
+				caller, size, path);
+		return false;
+	}
+
+	if (!readFully(fd, data, size, 0)) {
+		fprintf(stderr, "[%s] Failed to read '%s'!\n", caller, path);
+		cgFree(data);
+		return false;
+	}
+
+	view->data = data;
+	view->size = size;
+	return true;
+}
+
+bool
+CGMapFile(struct CGFileView *view, const char *path,
+		  enum CGFileAccess access) {
+	void *data;
+	size_t size;
+	int fd;
+	bool success;
+	CG_FUNCTION_ZONE();
+
+	view->data = NULL;
+	view->size = 0;
+	view->mapped = false;
+
+	if (!openFile("CGMapFile", path, &fd, &size))
+		return false;
+
+	if (size == 0) {
+		close(fd);
+		view->data = emptyFile;
+		return true;
+	}
+
+	/* Prefaulting reads the whole file with readahead right now, rather than
+	 * one fault at a time while it's being decoded. */
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE
+				| (access == CG_FA_SEQUENTIAL ? MAP_POPULATE : 0), fd, 0);
+	if (data == MAP_FAILED) {
+		/* Not every file system supports mapping. */
+		success = readIntoMemory("CGMapFile", path, fd, size, view);
+		close(fd);
+		return success;
+	}
+	close(fd);
+
+	/* Sequential pages may be dropped soon after they've been read, while
+	 * deferred ones are read ahead without waiting for them. */
+	madvise(data, size, access == CG_FA_SEQUENTIAL
+			? MADV_SEQUENTIAL : MADV_WILLNEED);
+
+	view->data = data;
+	view->size = size;
+	view->mapped = true;
+	return true;
+}
+
+void
+CGReleaseFileView(struct CGFileView *view) {
+	if (view->mapped)
+		munmap((void *) view->data, view->size);
+	else if (view->data != emptyFile)
+		cgFree((void *) view->data);
+
+	view->data = NULL;
+	view->size = 0;
+	view->mapped = false;
+}
+
+static bool
+setupRing(struct Ring *ring) {
+	struct io_uring_params params;
+	char *sq;
+	char *cq;
+
+	memset(&params, 0, sizeof(params));
+	ring->broken = false;
+	ring->fd = syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+	if (ring->fd < 0)
+		return false;
+
+	ring->sqRingSize = params.sq_off.array
+					 + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes
+					 + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Newer kernels map both rings at once. */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize)
+			ring->sqRingSize = ring->cqRingSize;
+		ring->cqRingSize = 0;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd,
+						IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED)
+		goto errorSQ;
+
+	ring->cqRing = ring->sqRing;
+	if (ring->cqRingSize != 0) {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, ring->fd,
+							IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED)
+			goto errorCQ;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto errorSQEs;
+
+	sq = ring->sqRing;
+	cq = ring->cqRing;
+	ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+	ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+	ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+	ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return true;
+
+errorSQEs:
+	if (ring->cqRingSize != 0)
+		munmap(ring->cqRing, ring->cqRingSize);
+errorCQ:
+	munmap(ring->sqRing, ring->sqRingSize);
+errorSQ:
+	close(ring->fd);
+	return false;
+}
+
+static void
+destroyRing(struct Ring *ring) {
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRingSize != 0)
+		munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+}
+
+static void
+queueRead(struct Ring *ring, int fd, void *buffer, unsigned size,
+		  uint64_t user) {
+	unsigned tail = *ring->sqTail;
+	unsigned index = tail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buffer;
+	sqe->len = size;
+	sqe->off = 0;
+	sqe->user_data = user;
+
+	ring->sqArray[index] = index;
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits the queued reads and waits for all of them, storing the bytes each
+ * one read in done. Reads that failed, for instance on kernels without
+ * IORING_OP_READ, are left at zero.
+ */
+static void
+submitReads(struct Ring *ring, unsigned count, size_t *done) {
+	struct io_uring_cqe *cqe;
+	unsigned submit = count;
+	unsigned completed = 0;
+	unsigned head;
+	int ret;
+
+	while (completed < count) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+					  IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* The reads that were never consumed are taken back and left
+			 * to pread, but once any are in flight their completions can't
+			 * be told apart from those of the next batch. */
+			if (submit == count)
+				*ring->sqTail = *ring->sqHead;
+			else
+				ring->broken = true;
+			return;
+		}
+		submit -= ret;
+
+		head = *ring->cqHead;
+		while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cqMask];
+			if (cqe->res > 0)
+				done[cqe->user_data] = cqe->res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+static size_t
+readBatch(struct Ring *ring, struct CGFileView *views,
+		  const char *const *paths, size_t count) {
+	int fds[QUEUE_DEPTH];
+	size_t done[QUEUE_DEPTH];
+	unsigned char *data;
+	unsigned queued = 0;
+	size_t read = 0;
+	size_t size;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		views[i].data = NULL;
+		views[i].size = 0;
+		views[i].mapped = false;
+		done[i] = 0;
+
+		if (!openFile("CGReadFiles", paths[i], &fds[i], &size)) {
+			fds[i] = -1;
+			continue;
+		}
+
+		if (size == 0) {
+			close(fds[i]);
+			fds[i] = -1;
+			views[i].data = emptyFile;
+			read++;
+			continue;
+		}
+
+		data = cgMalloc(size);
+		if (data == NULL) {
+			fprintf(stderr, "[CGReadFiles] Failed to allocate %zu bytes for "
+					"'%s'!\n", size, paths[i]);
+			close(fds[i]);
+			fds[i] = -1;
+			continue;
+		}
+
+		views[i].data = data;
+		views[i].size = size;
+		if (ring != NULL) {
+			queueRead(ring, fds[i], data,
+					  size < MAX_READ_SIZE ? size : MAX_READ_SIZE, i);
+			queued++;
+		}
+	}
+
+	if (queued > 0)
+		submitReads(ring, queued, done);
+
+	/* Whatever the ring didn't read, because the read was short, failed or
+	 * never submitted, is read synchronously. */
+	for (i = 0; i < count; i++) {
+		if (fds[i] == -1)
+			continue;
+
+		if (readFully(fds[i], (unsigned char *) views[i].data + done[i],
+					  views[i].size - done[i], done[i])) {
+			read++;
+		} else {
+			fprintf(stderr, "[CGReadFiles] Failed to read '%s'!\n", paths[i]);
+			CGReleaseFileView(&views[i]);
+		}
+		close(fds[i]);
+	}
+
+	return read;
+}
+
+size_t
+CGReadFiles(struct CGFileView *views, const char *const *paths,
+			size_t count) {
+	struct Ring ring;
+	bool hasRing;
+	size_t read = 0;
+	size_t batch;
+	size_t i;
+	CG_FUNCTION_ZONE();
+
+	/* io_uring may be missing or forbidden by a seccomp filter. */
+	hasRing = setupRing(&ring);
+
+	for (i = 0; i < count; i += batch) {
+		batch = count - i < QUEUE_DEPTH ? count - i : QUEUE_DEPTH;
+		read += readBatch(hasRing && !ring.broken ? &ring : NULL, views + i,
+						  paths + i, batch);
+	}
+
+	if (hasRing)
+		destroyRing(&ring);
+	return read;
+}
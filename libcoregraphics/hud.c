@@ -0,0 +1,532 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The performance overlay. Every frame its text and graph are built as quads
+ * on the CPU, which are drawn with a single draw call from a texture holding
+ * the built-in font. The GPU time of the frames is measured with timestamp
+ * queries that are read a few frames later, so the overlay never stalls.
+ */
+
+/* The overlay shouldn't count towards the render statistics it shows. */
+#undef CG_GL_WRAP
+
+#include "libcg.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "internal.h"
+
+/* The font is 3x5 pixels, drawn at SCALE screen pixels per font pixel. */
+#define GLYPH_WIDTH 3
+#define GLYPH_HEIGHT 5
+#define FIRST_GLYPH ' '
+#define GLYPH_COUNT 59
+/* The cell after the glyphs is solid, for the graph and the background. */
+#define ATLAS_WIDTH ((GLYPH_COUNT + 1) * GLYPH_WIDTH)
+#define SCALE 2
+#define ADVANCE ((GLYPH_WIDTH + 1) * SCALE)
+#define LINE_HEIGHT ((GLYPH_HEIGHT + 2) * SCALE)
+#define MARGIN 8
+#define PADDING 6
+
+#define MAX_QUADS 512
+#define MAX_LINE 64
+/* The graph has a bar per frame, as tall as GRAPH_TIME seconds at most. */
+#define GRAPH_FRAMES 120
+#define GRAPH_HEIGHT 60
+#define GRAPH_TIME (1.0 / 20.0)
+/* Frames are colored by how they compare to 60 Hz. */
+#define TARGET_TIME (1.0 / 60.0)
+/* The age of the queries that are read, so they're usually done. */
+#define QUERY_FRAMES 4
+
+struct HUDVertex {
+	GLfloat		 x;
+	GLfloat		 y;
+	GLfloat		 u;
+	GLfloat		 v;
+	GLubyte		 color[4];
+};
+
+/* Every glyph is 15 bits, the top row in the highest ones. Missing glyphs,
+ * like those of lowercase letters, are drawn as their uppercase ones. */
+static const uint16_t glyphs[GLYPH_COUNT] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x52a5, 0x0000, 0x0000,	/*  !"#$%&' */
+	0x2922, 0x224a, 0x0000, 0x0000, 0x0000, 0x01c0, 0x0002, 0x12a4,	/* ()*+,-./ */
+	0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9, 0x79cf, 0x79ef, 0x7249,	/* 01234567 */
+	0x7bef, 0x7bcf, 0x0410, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,	/* 89:;<=>? */
+	0x0000, 0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b,	/* @ABCDEFG */
+	0x5bed, 0x7497, 0x126a, 0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a,	/* HIJKLMNO */
+	0x6ba4, 0x2b73, 0x6bad, 0x388e, 0x7492, 0x5b6b, 0x5b52, 0x5bfd,	/* PQRSTUVW */
+	0x5aad, 0x5a92, 0x72a7						/* XYZ */
+};
+
+static const char *vertexSource =
+	"#version 330 core\n"
+	"layout(location = 0) in vec2 position;\n"
+	"layout(location = 1) in vec2 texCoord;\n"
+	"layout(location = 2) in vec4 color;\n"
+	"uniform vec2 viewport;\n"
+	"out vec2 fragTexCoord;\n"
+	"out vec4 fragColor;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(position.x / viewport.x * 2.0 - 1.0,\n"
+	"					   1.0 - position.y / viewport.y * 2.0, 0.0, 1.0);\n"
+	"	fragTexCoord = texCoord;\n"
+	"	fragColor = color;\n"
+	"}\n";
+
+static const char *fragmentSource =
+	"#version 330 core\n"
+	"in vec2 fragTexCoord;\n"
+	"in vec4 fragColor;\n"
+	"uniform sampler2D font;\n"
+	"out vec4 outColor;\n"
+	"void main() {\n"
+	"	outColor = fragColor * texture(font, fragTexCoord).r;\n"
+	"}\n";
+
+static const GLubyte textColor[4] = { 255, 255, 255, 255 };
+static const GLubyte backgroundColor[4] = { 0, 0, 0, 160 };
+static const GLubyte fastColor[4] = { 64, 200, 64, 255 };
+static const GLubyte slowColor[4] = { 230, 200, 40, 255 };
+static const GLubyte hitchColor[4] = { 230, 50, 40, 255 };
+static const GLubyte targetColor[4] = { 255, 255, 255, 96 };
+
+static bool hudEnabled = false;
+/* Whether the objects below exist, and whether creating them failed. */
+static bool hudCreated = false;
+static bool hudFailed = false;
+static struct CGShaderData shader;
+static GLint viewportUniform;
+static GLuint fontTexture;
+static GLuint vertexArray;
+static GLuint vertexBuffer;
+
+static struct HUDVertex vertices[MAX_QUADS * 6];
+static size_t quadCount;
+/* the right edge of the widest line so far, for the background */
+static float textRight;
+
+static double frameTimes[GRAPH_FRAMES];
+static unsigned int frameCount = 0;
+
+/* A ring buffer of the timestamp queries around the frames. The slots before
+ * queryFrame hold both timestamps of a frame. */
+static GLuint queries[QUERY_FRAMES][2];
+static unsigned int queryFrame = 0;
+/* whether the start of the current frame was queried */
+static bool frameQueried = false;
+static bool hasQueries = false;
+static double gpuTime = 0.0;
+
+void
+CGSetHUDEnabled(bool enabled) {
+	hudEnabled = enabled;
+	CGRequestRedraw();
+}
+
+bool
+isHUDEnabled(void) {
+	return hudEnabled;
+}
+
+static bool
+createHUD(void) {
+	static const char *attributes[] = { "position", "texCoord", "color" };
+	const struct CGShaderInitData initData = {
+		.attributes = attributes,
+		.attributesCount = sizeof(attributes) / sizeof(attributes[0]),
+		.fragmentShaderFilePath = "(hud)",
+		.vertexShaderFilePath = "(hud)"
+	};
+	const struct CGFileView sources[2] = {
+		{ (const unsigned char *) vertexSource, strlen(vertexSource), false },
+		{ (const unsigned char *) fragmentSource, strlen(fragmentSource),
+		  false }
+	};
+	GLubyte atlas[GLYPH_HEIGHT][ATLAS_WIDTH];
+	int glyph;
+	int x;
+	int y;
+
+	if (!compileShader(&shader, &initData, sources) || !finishShader(&shader))
+		return false;
+
+	viewportUniform = glGetUniformLocation(shader.program, "viewport");
+	glUseProgram(shader.program);
+	glUniform1i(glGetUniformLocation(shader.program, "font"), 0);
+
+	for (glyph = 0; glyph <= GLYPH_COUNT; glyph++) {
+		for (y = 0; y < GLYPH_HEIGHT; y++) {
+			for (x = 0; x < GLYPH_WIDTH; x++) {
+				atlas[y][glyph * GLYPH_WIDTH + x] = glyph == GLYPH_COUNT
+					|| (glyphs[glyph] >> ((GLYPH_HEIGHT - 1 - y) * GLYPH_WIDTH
+										  + GLYPH_WIDTH - 1 - x) & 1)
+					? 255 : 0;
+			}
+		}
+	}
+
+	glGenTextures(1, &fontTexture);
+	glBindTexture(GL_TEXTURE_2D, fontTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_WIDTH, GLYPH_HEIGHT, 0,
+				 GL_RED, GL_UNSIGNED_BYTE, atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	trackGPUMemory(CG_MC_TEXTURE, fontTexture, sizeof(atlas), "overlay");
+
+	glGenVertexArrays(1, &vertexArray);
+	glBindVertexArray(vertexArray);
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), NULL, GL_STREAM_DRAW);
+	trackGPUMemory(CG_MC_VERTEX, vertexBuffer, sizeof(vertices), "overlay");
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct HUDVertex),
+						  (void *) offsetof(struct HUDVertex, x));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(struct HUDVertex),
+						  (void *) offsetof(struct HUDVertex, u));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+						  sizeof(struct HUDVertex),
+						  (void *) offsetof(struct HUDVertex, color));
+
+	hasQueries = GLEW_ARB_timer_query;
+	if (hasQueries)
+		glGenQueries(QUERY_FRAMES * 2, queries[0]);
+
+	checkForErrors("createHUD", "end");
+	return true;
+}
+
+void
+deleteHUD(void) {
+	if (!hudCreated)
+		return;
+
+	CGDeleteShader(&shader);
+	untrackGPUMemory(true, fontTexture);
+	untrackGPUMemory(false, vertexBuffer);
+	glDeleteTextures(1, &fontTexture);
+	glDeleteBuffers(1, &vertexBuffer);
+	glDeleteVertexArrays(1, &vertexArray);
+	if (hasQueries)
+		glDeleteQueries(QUERY_FRAMES * 2, queries[0]);
+
+	hudCreated = false;
+	queryFrame = 0;
+	frameQueried = false;
+}
+
+/**
+ * Sets the six vertices of a quad showing the given cell of the font texture,
+ * stretched over the given rectangle.
+ */
+static void
+setQuad(struct HUDVertex *vertex, float x, float y, float width, float height,
+		int cell, const GLubyte color[4]) {
+	float u0 = (float) (cell * GLYPH_WIDTH) / ATLAS_WIDTH;
+	float u1 = (float) ((cell + 1) * GLYPH_WIDTH) / ATLAS_WIDTH;
+	const float corners[6][4] = {
+		{ x, y, u0, 0.0f },
+		{ x + width, y, u1, 0.0f },
+		{ x, y + height, u0, 1.0f },
+		{ x + width, y, u1, 0.0f },
+		{ x + width, y + height, u1, 1.0f },
+		{ x, y + height, u0, 1.0f }
+	};
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		vertex[i].x = corners[i][0];
+		vertex[i].y = corners[i][1];
+		vertex[i].u = corners[i][2];
+		vertex[i].v = corners[i][3];
+		memcpy(vertex[i].color, color, sizeof(vertex[i].color));
+	}
+}
+
+static void
+addQuad(float x, float y, float width, float height, int cell,
+		const GLubyte color[4]) {
+	if (quadCount < MAX_QUADS)
+		setQuad(&vertices[quadCount++ * 6], x, y, width, height, cell, color);
+}
+
+static void
+addRectangle(float x, float y, float width, float height,
+			 const GLubyte color[4]) {
+	addQuad(x, y, width, height, GLYPH_COUNT, color);
+}
+
+/**
+ * Adds a line of text, formatted like printf.
+ */
+__attribute__((format(printf, 3, 4)))
+static void
+addText(float x, float y, const char *format, ...) {
+	char line[MAX_LINE];
+	va_list arguments;
+	int character;
+	int i;
+
+	va_start(arguments, format);
+	vsnprintf(line, sizeof(line), format, arguments);
+	va_end(arguments);
+
+	for (i = 0; line[i] != '\0'; i++, x += ADVANCE) {
+		character = toupper((unsigned char) line[i]) - FIRST_GLYPH;
+		if (character > 0 && character < GLYPH_COUNT
+			&& glyphs[character] != 0)
+			addQuad(x, y, GLYPH_WIDTH * SCALE, GLYPH_HEIGHT * SCALE,
+					character, textColor);
+	}
+
+	if (x > textRight)
+		textRight = x;
+}
+
+static const GLubyte *
+getFrameColor(double time) {
+	if (time <= TARGET_TIME * 1.05)
+		return fastColor;
+	if (time <= TARGET_TIME * 2.1)
+		return slowColor;
+	return hitchColor;
+}
+
+static void
+addGraph(float x, float y) {
+	unsigned int count;
+	unsigned int i;
+	double time;
+	float height;
+
+	count = frameCount < GRAPH_FRAMES ? frameCount : GRAPH_FRAMES;
+	for (i = 0; i < count; i++) {
+		time = frameTimes[(frameCount - count + i) % GRAPH_FRAMES];
+		height = time < GRAPH_TIME ? time / GRAPH_TIME * GRAPH_HEIGHT
+								   : GRAPH_HEIGHT;
+		addRectangle(x + (GRAPH_FRAMES - count + i) * 2,
+					 y + GRAPH_HEIGHT - height, 2, height,
+					 getFrameColor(time));
+	}
+
+	addRectangle(x, y + GRAPH_HEIGHT * (1.0 - TARGET_TIME / GRAPH_TIME),
+				 GRAPH_FRAMES * 2, 1, targetColor);
+}
+
+/**
+ * Reads the GPU time of the frame a slot of the ring was last used for, if the
+ * GPU is done with it.
+ */
+static void
+readGPUTime(const GLuint *slot) {
+	GLuint64 start;
+	GLuint64 end;
+	GLint available;
+
+	glGetQueryObjectiv(slot[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return;
+
+	glGetQueryObjectui64v(slot[0], GL_QUERY_RESULT, &start);
+	glGetQueryObjectui64v(slot[1], GL_QUERY_RESULT, &end);
+	gpuTime = end > start ? (end - start) / 1e9 : 0.0;
+}
+
+void
+beginHUDFrame(void) {
+	const GLuint *slot;
+
+	if (!hudEnabled || !hudCreated || !hasQueries)
+		return;
+
+	/* The slot is read before it's reused, which leaves the GPU a few frames
+	 * to get there. */
+	slot = queries[queryFrame % QUERY_FRAMES];
+	if (queryFrame >= QUERY_FRAMES)
+		readGPUTime(slot);
+
+	glQueryCounter(slot[0], GL_TIMESTAMP);
+	frameQueried = true;
+}
+
+void
+drawHUD(const struct CGFrameTelemetry *telemetry) {
+	const struct CGRenderStats *stats;
+	struct CGPerfCounters renderCounters;
+	struct CGPerfCounters workerCounters;
+	struct CGFrameArenaStats arenaStats;
+	struct CGMemoryUsage memoryUsage[CG_MEMORY_CATEGORIES];
+	struct CGMemoryUsage totalMemory;
+	const struct GLState *state;
+	float x = MARGIN + PADDING;
+	float y = MARGIN + PADDING;
+	CG_FUNCTION_ZONE();
+
+	if (!hudEnabled || hudFailed)
+		return;
+
+	if (!hudCreated) {
+		hudCreated = createHUD();
+		hudFailed = !hudCreated;
+		if (hudFailed) {
+			fputs("[drawHUD] Failed to create the overlay!\n", stderr);
+			return;
+		}
+	}
+
+	/* The frame that was timed ends here, the overlay isn't part of it. */
+	if (frameQueried) {
+		glQueryCounter(queries[queryFrame % QUERY_FRAMES][1], GL_TIMESTAMP);
+		queryFrame++;
+		frameQueried = false;
+	}
+
+	if (telemetry->frameIndex > 0) {
+		frameTimes[frameCount % GRAPH_FRAMES] = telemetry->frameTime;
+		frameCount++;
+	}
+
+	/* The first quad is the background, whose size is only known at the
+	 * end. */
+	quadCount = 1;
+	textRight = x + GRAPH_FRAMES * 2;
+
+	stats = getLastFrameStats();
+	addText(x, y, "frame %6.2f ms %5.0f fps", telemetry->frameTime * 1000.0,
+			telemetry->frameTime > 0.0 ? 1.0 / telemetry->frameTime : 0.0);
+	y += LINE_HEIGHT;
+	if (stats != NULL) {
+		addText(x, y, "cpu %6.2f ms  swap %6.2f ms",
+				stats->renderTime * 1000.0, stats->swapTime * 1000.0);
+		y += LINE_HEIGHT;
+	}
+	if (hasQueries) {
+		addText(x, y, "gpu %6.2f ms  wait %6.2f ms", gpuTime * 1000.0,
+				telemetry->fenceWaitTime * 1000.0);
+		y += LINE_HEIGHT;
+	}
+	if (stats != NULL) {
+		addText(x, y, "draws %u  tris %" PRIu64, stats->drawCalls,
+				stats->triangles);
+		y += LINE_HEIGHT;
+		addText(x, y, "programs %u  textures %u  state %u",
+				stats->programBinds, stats->textureBinds,
+				stats->stateChanges);
+		y += LINE_HEIGHT;
+	}
+	if (CGGetPerfCounters(&renderCounters, &workerCounters)) {
+		addText(x, y, "ipc %.2f  cache miss %" PRIu64 "k  branch miss %"
+				PRIu64 "k", getIPC(&renderCounters),
+				renderCounters.cacheMisses / 1000,
+				renderCounters.branchMisses / 1000);
+		y += LINE_HEIGHT;
+		addText(x, y, "workers ipc %.2f  cache miss %" PRIu64 "k",
+				getIPC(&workerCounters), workerCounters.cacheMisses / 1000);
+		y += LINE_HEIGHT;
+	}
+	if (CGGetFrameArenaStats(&arenaStats)) {
+		addText(x, y, "arena %.1f kib  peak %.1f kib  overflow %u",
+				arenaStats.used / 1024.0, arenaStats.highWater / 1024.0,
+				arenaStats.overflowCount);
+		y += LINE_HEIGHT;
+	}
+	CGGetMemoryUsage(memoryUsage, &totalMemory);
+	addText(x, y, "gpu memory %.1f mib  peak %.1f mib",
+			totalMemory.bytes / (1024.0 * 1024.0),
+			totalMemory.highWater / (1024.0 * 1024.0));
+	y += LINE_HEIGHT;
+	addText(x, y, "textures %.1f mib  buffers %.1f mib",
+			memoryUsage[CG_MC_TEXTURE].bytes / (1024.0 * 1024.0),
+			(totalMemory.bytes - memoryUsage[CG_MC_TEXTURE].bytes)
+			/ (1024.0 * 1024.0));
+	y += LINE_HEIGHT;
+	addText(x, y, "uploads %.1f kib  %.2f ms",
+			telemetry->uploadBytes / 1024.0, telemetry->uploadTime * 1000.0);
+	y += LINE_HEIGHT + PADDING;
+
+	addGraph(x, y);
+	y += GRAPH_HEIGHT + PADDING;
+
+	setQuad(&vertices[0], MARGIN, MARGIN, textRight + PADDING - MARGIN,
+			y - MARGIN, GLYPH_COUNT, backgroundColor);
+
+	/* Drawn with the state of the render function, which is read back from
+	 * what the wrappers saw rather than queried, and put back afterwards. */
+	state = getGLState();
+	if (!state->blend)
+		glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (state->depthTest)
+		glDisable(GL_DEPTH_TEST);
+	if (state->cullFace)
+		glDisable(GL_CULL_FACE);
+	if (state->scissorTest)
+		glDisable(GL_SCISSOR_TEST);
+
+	glUseProgram(shader.program);
+	glUniform2f(viewportUniform, state->viewport[2], state->viewport[3]);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, fontTexture);
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	/* Orphaned, so the previous frame's draw doesn't have to finish. */
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0,
+					quadCount * 6 * sizeof(struct HUDVertex), vertices);
+	glDrawArrays(GL_TRIANGLES, 0, quadCount * 6);
+
+	restoreGLBindings();
+	glBlendFuncSeparate(state->blendSourceRGB, state->blendDestinationRGB,
+						state->blendSourceAlpha, state->blendDestinationAlpha);
+	if (!state->blend)
+		glDisable(GL_BLEND);
+	if (state->depthTest)
+		glEnable(GL_DEPTH_TEST);
+	if (state->cullFace)
+		glEnable(GL_CULL_FACE);
+	if (state->scissorTest)
+		glEnable(GL_SCISSOR_TEST);
+
+	checkForErrors("drawHUD", "end");
+}
@@ -0,0 +1,911 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Loading of images into textures.
+ */
+
+#include "libcg.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/glew.h>
+
+#include "internal.h"
+
+/* The largest levels queued at once when an image is loaded, the finer ones
+ * are streamed in one by one. */
+#define TAIL_SIZE 64
+
+/* How much the minimum LOD drops per frame after a finer level becomes
+ * resident, so it blends in instead of popping. */
+#define LOD_FADE_STEP 0.25f
+
+static struct CGTextureQuality textureQuality = { 0, 0, 0 };
+
+/* The images with levels left to stream in, only used on the render
+ * thread. */
+static struct CGImage *streamingImages = NULL;
+
+/* Of all loaded images. Changed atomically, since images may be loaded and
+ * deleted on different threads. */
+static size_t textureMemory = 0;
+/* The sum of the committed sizes of all images, which the texture budget is
+ * checked against. */
+static size_t committedMemory = 0;
+
+/**
+ * Releases pixels, with the free function of the decoder given as user data,
+ * or with cgFree() if that's NULL because the pixels were converted. Pixels
+ * decoded into the staging buffer go back to it.
+ */
+static void
+releasePixels(void *pixels, void *user) {
+	const struct CGImageDecoder *decoder = user;
+
+	if (isStagingMemory(pixels))
+		releaseStaging(pixels);
+	else if (decoder == NULL)
+		cgFree(pixels);
+	else
+		decoder->free(pixels);
+}
+
+/**
+ * Where CGDecodeImageInto writes an image that's decoded into the staging
+ * buffer, together with room for its mipmaps.
+ */
+struct StagingTarget {
+	unsigned char	*pixels;
+	/* of the image itself, before expansion */
+	int		 channels;
+};
+
+static unsigned char *
+allocateStagingImage(int width, int height, int *channels, void *user) {
+	struct StagingTarget *target = user;
+
+	/* RGB would be expanded to RGBA anyway, have the decoder do that. */
+	target->channels = *channels;
+	if (*channels == 3)
+		*channels = 4;
+
+	target->pixels = allocateStaging((size_t) width * height * *channels
+									 + getMipStorageSize(width, height,
+														 *channels));
+	return target->pixels;
+}
+
+/**
+ * The pixels of all levels of an image. The image holds a reference while
+ * levels are left to stream in, and every queued upload holds one.
+ */
+struct CGImagePixels {
+	unsigned char	*level0;
+	/* of a texture container, whose blocks are uploaded from it */
+	struct CGFileView file;
+	const struct CGImageDecoder *decoder;
+	struct CGMipChain chain;
+	int		 references;
+	/* the level of the chain that's the first level of the texture */
+	int		 first;
+	GLenum		 format;
+	GLint		 swizzle[4];
+	/* per level of the chain, zero unless the level is compressed */
+	GLsizei		 compressedSizes[CG_MAX_MIP_LEVELS];
+};
+
+static void
+releaseLevel(void *data, void *user) {
+	struct CGImagePixels *pixels = user;
+
+	(void) data;
+
+	if (__atomic_sub_fetch(&pixels->references, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	CGFreeMipChain(&pixels->chain);
+	if (pixels->level0 != NULL)
+		releasePixels(pixels->level0, (void *) pixels->decoder);
+	CGReleaseFileView(&pixels->file);
+	cgFree(pixels);
+}
+
+/**
+ * Chooses the formats to upload the pixels with, converting them if that
+ * avoids a slow path in the driver. RGB is expanded to RGBA so rows are four
+ * byte aligned, but stays RGB8 on the GPU, as do RGBA images that are fully
+ * opaque.
+ */
+static bool
+prepareFormat(struct CGImage *image, unsigned char **pixels, int channels,
+			  const struct CGImageDecoder **decoder, bool premultiply,
+			  GLenum *format, GLint swizzle[4]) {
+	size_t count = image->sourceWidth * image->sourceHeight;
+	unsigned char *converted;
+
+	swizzle[0] = GL_RED;
+	swizzle[1] = GL_GREEN;
+	swizzle[2] = GL_BLUE;
+	swizzle[3] = GL_ALPHA;
+
+	switch (channels) {
+		case 1:
+			image->internalFormat = GL_R8;
+			*format = GL_RED;
+			swizzle[1] = swizzle[2] = GL_RED;
+			swizzle[3] = GL_ONE;
+			break;
+		case 2:
+			if (premultiply)
+				premultiplyAlpha(*pixels, count, 2);
+			image->internalFormat = GL_RG8;
+			*format = GL_RG;
+			swizzle[1] = swizzle[2] = GL_RED;
+			swizzle[3] = GL_GREEN;
+			break;
+		case 3:
+			converted = cgMalloc(count * 4);
+			if (converted == NULL) {
+				fputs("[CGLoadImage] Failed to allocate RGBA pixels!\n",
+					  stderr);
+				return false;
+			}
+
+			expandRGBToRGBA(converted, *pixels, count);
+			releasePixels(*pixels, (void *) *decoder);
+			*pixels = converted;
+			*decoder = NULL;
+
+			image->internalFormat = GL_RGB8;
+			*format = GL_RGBA;
+			break;
+		case 4:
+			if (isOpaque(*pixels, count)) {
+				image->internalFormat = GL_RGB8;
+			} else {
+				if (premultiply)
+					premultiplyAlpha(*pixels, count, 4);
+				image->internalFormat = GL_RGBA8;
+			}
+			*format = GL_RGBA;
+			break;
+		default:
+			fprintf(stderr, "[CGLoadImage] Unsupported channel count %i!\n",
+					channels);
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Estimates the video memory a level takes. Drivers store RGB8 with four
+ * bytes per texel.
+ */
+static size_t
+getLevelSize(GLint internalFormat, const struct CGMipLevel *level) {
+	size_t texelSize;
+
+	switch (internalFormat) {
+		case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+			return getBCnLevelSize(CG_TF_BC1, level->width, level->height);
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+			return getBCnLevelSize(CG_TF_BC3, level->width, level->height);
+		case GL_COMPRESSED_RED_RGTC1:
+			return getBCnLevelSize(CG_TF_BC4, level->width, level->height);
+		case GL_COMPRESSED_RG_RGTC2:
+			return getBCnLevelSize(CG_TF_BC5, level->width, level->height);
+		case GL_R8:
+			texelSize = 1;
+			break;
+		case GL_RG8:
+			texelSize = 2;
+			break;
+		default:
+			texelSize = 4;
+			break;
+	}
+
+	return (size_t) level->width * level->height * texelSize;
+}
+
+/**
+ * The video memory the levels of the chain take from the given level down.
+ */
+static size_t
+getResidentSize(const struct CGMipChain *chain, GLint internalFormat,
+				int first) {
+	size_t size = 0;
+	int level;
+
+	for (level = first; level < chain->levelCount; level++)
+		size += getLevelSize(internalFormat, &chain->levels[level]);
+
+	return size;
+}
+
+static const struct CGMipLevel *
+getTextureLevel(const struct CGImage *image, int level) {
+	return &image->pixels->chain.levels[image->pixels->first + level];
+}
+
+static void
+setResidentSize(struct CGImage *image, size_t size) {
+	if (size > image->residentSize)
+		__atomic_add_fetch(&textureMemory, size - image->residentSize,
+						   __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&textureMemory, image->residentSize - size,
+						   __ATOMIC_RELAXED);
+	image->residentSize = size;
+	trackGPUMemory(CG_MC_TEXTURE, image->texture, size, "image");
+}
+
+/**
+ * Restricts sampling to the resident levels. The minimum LOD keeps the
+ * previous level visible while a new one fades in.
+ */
+static void
+applyResidency(struct CGImage *image) {
+	glBindTexture(GL_TEXTURE_2D, image->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL,
+					image->residentLevel < image->levelCount
+					? image->residentLevel : image->levelCount - 1);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, image->lodFade);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static bool
+queueLevel(struct CGImage *image, int level) {
+	const struct CGMipLevel *source = getTextureLevel(image, level);
+	struct CGTextureUploadInfo uploadInfo;
+
+	memset(&uploadInfo, 0, sizeof(uploadInfo));
+	uploadInfo.texture = image->texture;
+	uploadInfo.level = level;
+	uploadInfo.internalFormat = image->internalFormat;
+	uploadInfo.width = source->width;
+	uploadInfo.height = source->height;
+	uploadInfo.format = image->pixels->format;
+	uploadInfo.type = GL_UNSIGNED_BYTE;
+	uploadInfo.pixels = source->pixels;
+	uploadInfo.compressedSize
+		= image->pixels->compressedSizes[image->pixels->first + level];
+	uploadInfo.priority = image->priority;
+	uploadInfo.release = releaseLevel;
+	uploadInfo.user = image->pixels;
+
+	__atomic_add_fetch(&image->pixels->references, 1, __ATOMIC_ACQ_REL);
+	image->uploads[level] = CGQueueTextureUpload(&uploadInfo);
+	if (image->uploads[level] == NULL) {
+		releaseLevel(NULL, image->pixels);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Drops the pixels once nothing is left to stream in, or the image is
+ * deleted.
+ */
+static void
+stopStreaming(struct CGImage *image) {
+	struct CGImage **link = &streamingImages;
+
+	while (*link != NULL && *link != image)
+		link = &(*link)->nextStreaming;
+	if (*link == image)
+		*link = image->nextStreaming;
+	image->nextStreaming = NULL;
+
+	if (image->pixels != NULL) {
+		releaseLevel(NULL, image->pixels);
+		image->pixels = NULL;
+	}
+}
+
+/**
+ * Changes how much of the texture budget the image holds. Growing fails if
+ * the budget can't take it, unless force is set.
+ */
+static bool
+commitImageMemory(struct CGImage *image, size_t size, bool force) {
+	size_t used;
+
+	if (size <= image->committedSize) {
+		__atomic_sub_fetch(&committedMemory, image->committedSize - size,
+						   __ATOMIC_RELAXED);
+		image->committedSize = size;
+		return true;
+	}
+
+	used = __atomic_load_n(&committedMemory, __ATOMIC_RELAXED);
+	do {
+		if (!force && textureQuality.budget != 0
+			&& used + (size - image->committedSize) > textureQuality.budget)
+			return false;
+	} while (!__atomic_compare_exchange_n(&committedMemory, &used,
+										  used + (size - image->committedSize),
+										  true, __ATOMIC_RELAXED,
+										  __ATOMIC_RELAXED));
+
+	image->committedSize = size;
+	return true;
+}
+
+/**
+ * Makes the levels whose uploads have completed resident. Levels only become
+ * resident from the coarsest to the finest, so those that can be sampled are
+ * always a complete chain.
+ */
+static void
+collectLevels(struct CGImage *image) {
+	int resident = image->residentLevel;
+	size_t size = image->residentSize;
+
+	while (resident > 0 && image->uploads[resident - 1] != NULL
+		   && CGIsUploadComplete(image->uploads[resident - 1])) {
+		CGFreeUpload(image->uploads[resident - 1]);
+		image->uploads[resident - 1] = NULL;
+		resident--;
+		size += getLevelSize(image->internalFormat,
+							 getTextureLevel(image, resident));
+	}
+
+	if (resident == image->residentLevel)
+		return;
+
+	/* Nothing was visible before the first level. */
+	if (image->residentLevel < image->levelCount)
+		image->lodFade += image->residentLevel - resident;
+	image->residentLevel = resident;
+	setResidentSize(image, size);
+	applyResidency(image);
+}
+
+/**
+ * Evicts the levels finer than wanted and queues the next finer level that's
+ * wanted. Only one of those is in flight at a time, so an image that shrinks
+ * on screen doesn't keep uploading levels that are no longer needed.
+ */
+static void
+streamLevels(struct CGImage *image) {
+	size_t size = image->residentSize;
+	int resident = image->residentLevel;
+
+	/* Everything is resident, the pixels are no longer needed. */
+	if (resident == 0) {
+		if (image->pixels != NULL) {
+			releaseLevel(NULL, image->pixels);
+			image->pixels = NULL;
+		}
+		return;
+	}
+
+	if (image->uploads[resident - 1] != NULL)
+		return;
+
+	if (image->wantedLevel > resident) {
+		/* Zero-sized levels take no memory and aren't sampled above the
+		 * base level. */
+		glBindTexture(GL_TEXTURE_2D, image->texture);
+		for (; resident < image->wantedLevel; resident++) {
+			size -= getLevelSize(image->internalFormat,
+								 getTextureLevel(image, resident));
+			glTexImage2D(GL_TEXTURE_2D, resident, image->internalFormat, 0, 0,
+						 0, image->pixels->format, GL_UNSIGNED_BYTE, NULL);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		image->residentLevel = resident;
+		image->lodFade = 0.0f;
+		setResidentSize(image, size);
+		commitImageMemory(image, size, true);
+		applyResidency(image);
+	} else if (resident > image->wantedLevel) {
+		/* Levels evicted before need to fit in the budget again. */
+		if (!commitImageMemory(image,
+							   getResidentSize(&image->pixels->chain,
+											   image->internalFormat,
+											   image->pixels->first
+											   + image->wantedLevel),
+							   false))
+			return;
+
+		queueLevel(image, resident - 1);
+	}
+}
+
+void
+updateImageStreaming(void) {
+	struct CGImage *image = streamingImages;
+	struct CGImage *next;
+	bool pending = false;
+	CG_FUNCTION_ZONE();
+
+	while (image != NULL) {
+		next = image->nextStreaming;
+
+		collectLevels(image);
+		if (image->lodFade > 0.0f) {
+			image->lodFade -= LOD_FADE_STEP;
+			if (image->lodFade < 0.0f)
+				image->lodFade = 0.0f;
+			applyResidency(image);
+		}
+		streamLevels(image);
+
+		if (image->residentLevel == 0 && image->lodFade == 0.0f)
+			stopStreaming(image);
+
+		/* Keep rendering while levels are in flight or fading in. */
+		if (image->lodFade > 0.0f
+			|| (image->residentLevel > 0
+				&& image->uploads[image->residentLevel - 1] != NULL))
+			pending = true;
+
+		image = next;
+	}
+
+	if (pending)
+		CGRequestRedraw();
+}
+
+/**
+ * Picks the largest level of the chain that the texture quality policy allows
+ * to be uploaded, and commits the budget for the levels from there on. Sets
+ * overBudget if only the budget made it smaller.
+ */
+static int
+chooseFirstLevel(struct CGImage *image, const struct CGMipChain *chain,
+				 bool *overBudget) {
+	int last = chain->levelCount - 1;
+	int first = textureQuality.mipBias;
+
+	if (first > last)
+		first = last;
+
+	while (first < last && textureQuality.maxDimension > 0
+		   && (chain->levels[first].width > textureQuality.maxDimension
+			   || chain->levels[first].height > textureQuality.maxDimension))
+		first++;
+
+	/* Images that are still streaming in count with all their levels, so
+	 * that those loaded together don't all pass the budget at first. The
+	 * smallest level is always allowed. */
+	*overBudget = false;
+	image->committedSize = 0;
+	while (!commitImageMemory(image, getResidentSize(chain,
+													 image->internalFormat,
+													 first),
+							  first == last)) {
+		first++;
+		*overBudget = true;
+	}
+
+	return first;
+}
+
+bool
+createImageTexture(struct CGImage *image,
+				   const struct CGImageInitData *initData,
+				   struct CGImagePixels *pixels) {
+	const struct CGMipLevel *levelData;
+	GLsizei compressedSize;
+	bool overBudget;
+	bool recycled;
+	int level;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	memset(image->uploads, 0, sizeof(image->uploads));
+
+	/* The levels left out are still generated (or stored), as the smaller
+	 * ones are filtered from them. */
+	pixels->first = chooseFirstLevel(image, &pixels->chain, &overBudget);
+	pixels->references = 1;
+	image->pixels = pixels;
+	image->levelCount = pixels->chain.levelCount - pixels->first;
+	image->width = getTextureLevel(image, 0)->width;
+	image->height = getTextureLevel(image, 0)->height;
+	image->residentSize = 0;
+	image->wantedLevel = 0;
+	image->priority = 0;
+	image->lodFade = 0.0f;
+	image->nextStreaming = NULL;
+
+	if (overBudget)
+		fprintf(stderr, "[CGLoadImage] Over the texture budget, '%s' is "
+				"loaded at %zux%zu.\n", initData->path, image->width,
+				image->height);
+
+	/* Create OpenGL buffer, or recycle one if all levels are uploaded at
+	 * once, replacing every level. */
+	span = beginSpan("create texture", initData->path);
+	image->texture = 0;
+	if (!initData->async)
+		image->texture = acquireTexture(image->internalFormat,
+										(int) image->width,
+										(int) image->height,
+										image->levelCount);
+	recycled = image->texture != 0;
+	if (!recycled)
+		glGenTextures(1, &image->texture);
+	glBindTexture(GL_TEXTURE_2D, image->texture);
+	glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, pixels->swizzle);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image->levelCount - 1);
+
+	if (initData->async) {
+		/* Nothing can be sampled until the coarsest level arrives. The small
+		 * levels are queued right away, the rest is streamed in by
+		 * updateImageStreaming. */
+		image->residentLevel = image->levelCount;
+		applyResidency(image);
+
+		image->nextStreaming = streamingImages;
+		streamingImages = image;
+
+		for (level = image->levelCount - 1; level >= 0; level--) {
+			if (level != image->levelCount - 1
+				&& (getTextureLevel(image, level)->width > TAIL_SIZE
+					|| getTextureLevel(image, level)->height > TAIL_SIZE))
+				break;
+
+			if (!queueLevel(image, level)) {
+				endSpan(span, 0);
+				CGDeleteImage(image);
+				return false;
+			}
+		}
+
+		/* The loader thread records the uploads themselves. */
+		endSpan(span, 0);
+		return true;
+	}
+
+	for (level = 0; level < image->levelCount; level++) {
+		levelData = getTextureLevel(image, level);
+		compressedSize = pixels->compressedSizes[pixels->first + level];
+		if (compressedSize != 0 && recycled)
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0,
+									  levelData->width, levelData->height,
+									  image->internalFormat, compressedSize,
+									  bindUnpackSource(levelData->pixels));
+		else if (compressedSize != 0)
+			glCompressedTexImage2D(GL_TEXTURE_2D, level,
+								   image->internalFormat, levelData->width,
+								   levelData->height, 0, compressedSize,
+								   bindUnpackSource(levelData->pixels));
+		else if (recycled)
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, levelData->width,
+							levelData->height, pixels->format,
+							GL_UNSIGNED_BYTE,
+							bindUnpackSource(levelData->pixels));
+		else
+			glTexImage2D(GL_TEXTURE_2D, level, image->internalFormat,
+						 levelData->width, levelData->height, 0,
+						 pixels->format, GL_UNSIGNED_BYTE,
+						 bindUnpackSource(levelData->pixels));
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	image->residentLevel = 0;
+	setResidentSize(image, getResidentSize(&pixels->chain,
+										   image->internalFormat,
+										   pixels->first));
+	endSpan(span, image->residentSize);
+
+	releaseLevel(NULL, pixels);
+	image->pixels = NULL;
+
+	return true;
+}
+
+static bool
+isBCnSupported(enum CGTextureFormat format) {
+	if (format == CG_TF_BC1 || format == CG_TF_BC3)
+		return GLEW_EXT_texture_compression_s3tc;
+
+	/* RGTC is core since OpenGL 3.0. */
+	return GLEW_VERSION_3_0 || GLEW_ARB_texture_compression_rgtc;
+}
+
+/**
+ * Prepares a texture container whose format the driver supports, keeping the
+ * blocks of every level in the file view.
+ */
+static struct CGImagePixels *
+prepareCompressedImage(struct CGImage *image, struct CGFileView *file,
+					   const struct TextureFile *textureFile) {
+	struct CGImagePixels *pixels;
+	GLint *swizzle;
+	int width = textureFile->width;
+	int height = textureFile->height;
+	int level;
+
+	pixels = cgCalloc(1, sizeof(struct CGImagePixels));
+	if (pixels == NULL) {
+		CGReleaseFileView(file);
+		return NULL;
+	}
+
+	swizzle = pixels->swizzle;
+	swizzle[0] = GL_RED;
+	swizzle[1] = GL_GREEN;
+	swizzle[2] = GL_BLUE;
+	swizzle[3] = GL_ALPHA;
+
+	image->sourceHeight = height;
+	image->sourceWidth = width;
+	image->channels = getBCnChannels(textureFile->format);
+	image->internalFormat = getBCnInternalFormat(textureFile->format);
+
+	/* The same swizzles as uncompressed images with these channels. */
+	switch (image->channels) {
+		case 1:
+			pixels->format = GL_RED;
+			swizzle[1] = swizzle[2] = GL_RED;
+			swizzle[3] = GL_ONE;
+			break;
+		case 2:
+			pixels->format = GL_RG;
+			swizzle[1] = swizzle[2] = GL_RED;
+			swizzle[3] = GL_GREEN;
+			break;
+		default:
+			pixels->format = GL_RGBA;
+			break;
+	}
+
+	pixels->file = *file;
+	pixels->chain.channels = image->channels;
+	pixels->chain.levelCount = textureFile->levelCount;
+	for (level = 0; level < textureFile->levelCount; level++) {
+		pixels->chain.levels[level].pixels
+			= (unsigned char *) textureFile->levels[level].data;
+		pixels->chain.levels[level].width = width;
+		pixels->chain.levels[level].height = height;
+		pixels->compressedSizes[level] = textureFile->levels[level].size;
+
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+	}
+
+	return pixels;
+}
+
+struct CGImagePixels *
+decodeImage(struct CGImage *image, const struct CGImageInitData *initData) {
+	int width;
+	int height;
+	int nrChannels;
+	int channels;
+	struct CGFileView file;
+	unsigned char *data;
+	const struct CGImageDecoder *decoder;
+	struct StagingTarget staging;
+	struct TextureFile textureFile;
+	GLenum format;
+	GLint swizzle[4];
+	struct CGImagePixels *pixels;
+	bool mapped;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	/* The blocks of texture containers are uploaded level by level as they're
+	 * streamed in, everything else is decoded right away. */
+	span = beginSpan("read image", initData->path);
+	mapped = CGMapFile(&file, initData->path, initData->type == CG_IT_CGT
+					   ? CG_FA_DEFERRED : CG_FA_SEQUENTIAL);
+	endSpan(span, file.size);
+	if (!mapped) {
+		fprintf(stderr, "[CGLoadImage] Failed to read '%s'!\n",
+				initData->path);
+		return NULL;
+	}
+
+	/* Without support for their format, compressed textures are decoded like
+	 * any other image. */
+	if (parseTextureFile(file.data, file.size, &textureFile)
+		&& isBCnSupported(textureFile.format))
+		return prepareCompressedImage(image, &file, &textureFile);
+
+	/* The type in initData is only a hint, the data itself decides which
+	 * decoders can be used. Decoding into the staging buffer is preferred, so
+	 * neither the pixels nor their mipmaps are copied before reaching the
+	 * GPU. */
+	span = beginSpan("decode image", initData->path);
+	staging.pixels = NULL;
+	decoder = NULL;
+	if (CGDecodeImageInto(file.data, file.size, initData->type,
+						  allocateStagingImage, &staging, &width, &height,
+						  &channels)) {
+		data = staging.pixels;
+		nrChannels = staging.channels;
+	} else {
+		if (staging.pixels != NULL)
+			releaseStaging(staging.pixels);
+
+		data = CGDecodeImage(file.data, file.size, initData->type, &width,
+							 &height, &nrChannels, 0, &decoder);
+		channels = nrChannels;
+	}
+	CGReleaseFileView(&file);
+	endSpan(span, data != NULL ? (size_t) width * height * channels : 0);
+	if (data == NULL) {
+		fprintf(stderr, "[CGLoadImage] Failed to decode '%s'!\n",
+				initData->path);
+		return NULL;
+	}
+
+	image->sourceHeight = height;
+	image->sourceWidth = width;
+	image->channels = nrChannels;
+
+	if (!prepareFormat(image, &data, channels, &decoder,
+					   initData->premultiplyAlpha, &format, swizzle)) {
+		releasePixels(data, (void *) decoder);
+		return NULL;
+	}
+
+	/* After prepareFormat RGB has been expanded to RGBA. */
+	if (channels == 3)
+		channels = 4;
+
+	pixels = cgCalloc(1, sizeof(struct CGImagePixels));
+	if (pixels == NULL) {
+		releasePixels(data, (void *) decoder);
+		return NULL;
+	}
+
+	pixels->level0 = data;
+	pixels->decoder = decoder;
+	pixels->format = format;
+	memcpy(pixels->swizzle, swizzle, sizeof(pixels->swizzle));
+
+	/* Staged images have room for their mipmaps right after them. */
+	span = beginSpan("generate mipmaps", initData->path);
+	if (!generateMipChain(&pixels->chain, data, width, height, channels,
+						  initData->mipFilter, initData->gammaCorrectMips,
+						  isStagingMemory(data)
+						  ? data + (size_t) width * height * channels
+						  : NULL)) {
+		endSpan(span, 0);
+		releasePixels(data, (void *) decoder);
+		cgFree(pixels);
+		return NULL;
+	}
+	endSpan(span, getMipStorageSize(width, height, channels));
+
+	return pixels;
+}
+
+void
+releaseImagePixels(struct CGImagePixels *pixels) {
+	pixels->references = 1;
+	releaseLevel(NULL, pixels);
+}
+
+bool
+CGLoadImage(struct CGImage *image, struct CGImageInitData *initData) {
+	struct CGImagePixels *pixels;
+
+	pixels = decodeImage(image, initData);
+	if (pixels == NULL)
+		return false;
+
+	return createImageTexture(image, initData, pixels);
+}
+
+void
+CGSetImagePriority(struct CGImage *image, int priority) {
+	int level;
+
+	image->priority = priority;
+	for (level = 0; level < image->levelCount; level++) {
+		if (image->uploads[level] != NULL)
+			CGSetUploadPriority(image->uploads[level], priority);
+	}
+}
+
+void
+CGSetImageScreenSize(struct CGImage *image, int width, int height) {
+	size_t levelWidth = image->width;
+	size_t levelHeight = image->height;
+	long long area = (long long) width * height;
+	int level = 0;
+
+	if (width <= 0 || height <= 0) {
+		/* Off screen, only the levels queued at load time are kept. */
+		level = image->levelCount - 1;
+		area = 0;
+	} else {
+		while (level + 1 < image->levelCount
+			   && levelWidth / 2 >= (size_t) width
+			   && levelHeight / 2 >= (size_t) height) {
+			levelWidth /= 2;
+			levelHeight /= 2;
+			level++;
+		}
+	}
+
+	image->wantedLevel = level;
+	CGSetImagePriority(image, area > INT_MAX ? INT_MAX : (int) area);
+	CGRequestRedraw();
+}
+
+bool
+CGIsImageReady(struct CGImage *image) {
+	collectLevels(image);
+	return image->residentLevel < image->levelCount;
+}
+
+void
+CGDeleteImage(struct CGImage *image) {
+	bool pending = false;
+	size_t size;
+	int level;
+
+	for (level = 0; level < image->levelCount; level++) {
+		if (image->uploads[level] != NULL) {
+			CGFreeUpload(image->uploads[level]);
+			image->uploads[level] = NULL;
+			pending = true;
+		}
+	}
+
+	stopStreaming(image);
+	size = image->residentSize;
+	setResidentSize(image, 0);
+	commitImageMemory(image, 0, true);
+
+	/* Only textures with every level allocated can be filled in again. */
+	if (!pending && image->residentLevel == 0 && image->levelCount > 0)
+		releaseTexture(image->texture, image->internalFormat,
+					   (int) image->width, (int) image->height,
+					   image->levelCount, size);
+	else
+		glDeleteTextures(1, &image->texture);
+}
+
+size_t
+CGGetTextureMemoryUsage(void) {
+	return __atomic_load_n(&textureMemory, __ATOMIC_RELAXED);
+}
+
+void
+CGSetTextureQuality(const struct CGTextureQuality *quality) {
+	memcpy(&textureQuality, quality, sizeof(textureQuality));
+}
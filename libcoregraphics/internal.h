@@ -0,0 +1,675 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Declarations shared between the translation units of libcg. Programs using
+ * the library should only include libcg.h.
+ */
+
+#ifndef __LIBCG_INTERNAL_H__
+#define __LIBCG_INTERNAL_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <X11/Xlib.h>
+
+#include <GL/glew.h>
+#include <GL/glx.h>
+
+#include "libcg.h"
+
+/* Defined in alloc.c */
+
+/**
+ * Allocate with the allocator set by CGSetAllocator, the same way as malloc,
+ * calloc, realloc and free.
+ */
+void *
+cgCalloc(size_t count, size_t size);
+
+void
+cgFree(void *pointer);
+
+void *
+cgMalloc(size_t size);
+
+void *
+cgRealloc(void *pointer, size_t size);
+
+/* Defined in arena.c */
+
+/**
+ * Allocates from the scratch arena of the calling thread, within a scope of
+ * beginScratch and endScratch. Returns NULL outside of one, or if it's full.
+ */
+void *
+allocateScratch(size_t size);
+
+/**
+ * Begins a new frame for the frame arenas, called by CGStart before every
+ * frame. The arena of the render thread switches buffers right away.
+ */
+void
+beginArenaFrame(void);
+
+/**
+ * Begins a scope of scratch allocations on the calling thread. Scopes nest;
+ * everything allocated is released when the outermost one ends.
+ */
+void
+beginScratch(void);
+
+void
+endScratch(void);
+
+/**
+ * Tells whether the pointer is in the scratch arena of the calling thread.
+ */
+bool
+isScratchMemory(const void *pointer);
+
+/**
+ * Reallocates scratch memory. The last allocation is resized in place, others
+ * are copied, to the heap if the arena is full.
+ */
+void *
+reallocateScratch(void *pointer, size_t size);
+
+/**
+ * Releases the frame and scratch arenas of the calling thread, which exiting
+ * threads do by themselves.
+ */
+void
+releaseFrameArena(void);
+
+/**
+ * Gives back scratch memory. Only the last allocation is actually reused, the
+ * rest waits for the end of the scope.
+ */
+void
+releaseScratch(void *pointer);
+
+/* Defined in bcn.c */
+
+/**
+ * A texture container parsed by parseTextureFile. The levels point into the
+ * data of the file.
+ */
+struct TextureFile {
+	enum CGTextureFormat format;
+	int		 width;
+	int		 height;
+	int		 levelCount;
+	struct {
+		const unsigned char *data;
+		size_t		 size;
+	} levels[CG_MAX_MIP_LEVELS];
+};
+
+/**
+ * The channels decompressBCn produces: four for BC1 and BC3, one for BC4 and
+ * two for BC5.
+ */
+int
+getBCnChannels(enum CGTextureFormat);
+
+size_t
+getBCnBlockSize(enum CGTextureFormat);
+
+size_t
+getBCnLevelSize(enum CGTextureFormat, int width, int height);
+
+GLenum
+getBCnInternalFormat(enum CGTextureFormat);
+
+/**
+ * Checks the header and level table of a texture container. Returns false if
+ * the file is truncated or describes levels that don't fit its format.
+ */
+bool
+parseTextureFile(const unsigned char *data, size_t size, struct TextureFile *);
+
+/**
+ * Decompresses a level into tightly packed 8-bit pixels.
+ */
+void
+decompressBCn(enum CGTextureFormat, const unsigned char *data, int width,
+			  int height, unsigned char *pixels);
+
+/* Defined in hud.c */
+
+/**
+ * Starts timing the frame on the GPU, if the overlay is enabled.
+ */
+void
+beginHUDFrame(void);
+
+void
+deleteHUD(void);
+
+/**
+ * Draws the overlay, if it's enabled, after the render function.
+ */
+void
+drawHUD(const struct CGFrameTelemetry *);
+
+bool
+isHUDEnabled(void);
+
+/* Defined in image.c */
+
+/**
+ * The first half of CGLoadImage, which reads and decodes the image and
+ * generates its mipmaps, and fills in the format of the image. Doesn't touch
+ * OpenGL, so it may run on any thread. Returns NULL on failure.
+ */
+struct CGImagePixels *
+decodeImage(struct CGImage *, const struct CGImageInitData *);
+
+/**
+ * The second half of CGLoadImage, which creates the texture of the image from
+ * the pixels of decodeImage, applying the quality policy, and uploads it or
+ * starts streaming it in. Takes over the pixels, even if it fails.
+ */
+bool
+createImageTexture(struct CGImage *, const struct CGImageInitData *,
+				   struct CGImagePixels *);
+
+/**
+ * Releases pixels of decodeImage that won't get a texture after all.
+ */
+void
+releaseImagePixels(struct CGImagePixels *);
+
+/**
+ * Advances the images that are streaming in their levels. Called by CGStart
+ * before every frame.
+ */
+void
+updateImageStreaming(void);
+
+/* Defined in libcg.c */
+extern Display *display;
+extern GLXContext context;
+extern GLXFBConfig fbConfig;
+
+void
+checkForErrors(const char *, const char *);
+
+/**
+ * The first half of CGLoadShader, which compiles and links the shader from
+ * its vertex and fragment sources without waiting for the results, so
+ * several shaders can compile at once. The sources may be released right
+ * after.
+ */
+bool
+compileShader(struct CGShaderData *, const struct CGShaderInitData *,
+			  const struct CGFileView sources[2]);
+
+/**
+ * The second half of CGLoadShader, which waits for the results of
+ * compileShader. The shader is deleted if it failed to compile or link.
+ */
+bool
+finishShader(struct CGShaderData *);
+
+/**
+ * Creates an OpenGL context according to the CGContextConfig, sharing objects
+ * with the given context (which may be NULL).
+ */
+GLXContext
+createContext(GLXContext share);
+
+/**
+ * The index of the frame CGStart is at, counting from zero.
+ */
+uint64_t
+getFrameIndex(void);
+
+/**
+ * Returns the time of CLOCK_MONOTONIC in seconds.
+ */
+double
+getTime(void);
+
+/**
+ * Whether the GPU is done with every frame up to the given one, as far as
+ * throttling to the frames in flight guarantees.
+ */
+bool
+isFrameRetired(uint64_t frame);
+
+/* Defined in memory.c */
+
+/**
+ * Prints the buffers and textures that are still tracked, and forgets them,
+ * as they go with the context. Called by CGCleanError once libcg released
+ * everything of its own.
+ */
+void
+reportGPULeaks(void);
+
+/**
+ * Tracks the buffer bound to target, which was just given size bytes of
+ * storage, in the category of the target. The binding is taken from
+ * getGLState.
+ */
+void
+trackBufferData(GLenum target, GLsizeiptr size);
+
+/**
+ * Starts tracking a buffer or texture, or changes its size, category and
+ * label (a string that outlives it, or NULL). Textures are those of
+ * CG_MC_TEXTURE.
+ */
+void
+trackGPUMemory(enum CGMemoryCategory, GLuint name, size_t size,
+			   const char *label);
+
+/**
+ * Stops tracking a buffer or texture, for objects deleted without the
+ * wrappers.
+ */
+void
+untrackGPUMemory(bool texture, GLuint name);
+
+/* Defined in mipmap.c */
+
+/**
+ * Like CGGenerateMipChain, but the levels after the first are stored in the
+ * given memory, which must hold getMipStorageSize bytes, unless it's NULL.
+ */
+bool
+generateMipChain(struct CGMipChain *, unsigned char *pixels, int width,
+				 int height, int channels, enum CGMipFilter filter,
+				 bool gammaCorrect, unsigned char *storage);
+
+/**
+ * The number of bytes of all levels of a full chain except the first.
+ */
+size_t
+getMipStorageSize(int width, int height, int channels);
+
+/* Defined in perf.c */
+
+/**
+ * Closes the counters and forgets the worker threads, after they stopped.
+ */
+void
+closePerfCounters(void);
+
+/**
+ * Returns the instructions per cycle, or 0 if no cycles were counted.
+ */
+double
+getIPC(const struct CGPerfCounters *counters);
+
+/**
+ * Makes the calling worker thread known, so its counters can be opened.
+ */
+void
+registerPerfThread(void);
+
+/**
+ * Reads the counters of the frame that just ended, at the start of the next.
+ */
+void
+samplePerfCounters(void);
+
+/* Defined in pixel.c */
+
+/**
+ * Converts count tightly packed RGB pixels to RGBA with an opaque alpha.
+ */
+void
+expandRGBToRGBA(unsigned char *dst, const unsigned char *src, size_t count);
+
+/**
+ * Returns whether every alpha value of the RGBA pixels is 255.
+ */
+bool
+isOpaque(const unsigned char *rgba, size_t count);
+
+/**
+ * Multiplies the color channels with the alpha channel, in place. Only
+ * grayscale+alpha and RGBA pixels are affected.
+ */
+void
+premultiplyAlpha(unsigned char *pixels, size_t count, int channels);
+
+/* Defined in pool.c */
+
+/**
+ * Deletes the resources left in the pools and frees them, before the context
+ * and the loader are gone.
+ */
+void
+destroyPools(void);
+
+/* Defined in recycle.c */
+
+/**
+ * Takes a recycled buffer of at least size bytes and returns it, or zero if
+ * there's none, in which case the caller creates one. The size of the buffer
+ * is stored in capacity.
+ */
+GLuint
+acquireBuffer(GLsizeiptr size, GLsizeiptr *capacity);
+
+/**
+ * Takes a recycled texture whose levels have the given format and size, or
+ * returns zero if there's none.
+ */
+GLuint
+acquireTexture(GLint internalFormat, int width, int height, int levelCount);
+
+/**
+ * Deletes every recycled object, before the context is destroyed.
+ */
+void
+deleteRecycled(void);
+
+/**
+ * Keeps a buffer for reuse instead of deleting it, unless it doesn't fit the
+ * budget.
+ */
+void
+releaseBuffer(GLuint buffer, GLsizeiptr capacity);
+
+/**
+ * Keeps a texture whose levels are all allocated for reuse, with its
+ * parameters reset, and size bytes of video memory.
+ */
+void
+releaseTexture(GLuint texture, GLint internalFormat, int width, int height,
+			   int levelCount, size_t size);
+
+/* Defined in staging.c */
+
+/**
+ * Creates and maps the staging buffer. Returns false if buffer storage isn't
+ * supported or the size was set to zero, in which case allocateStaging always
+ * fails.
+ */
+bool
+startStaging(void);
+
+void
+stopStaging(void);
+
+/**
+ * Allocates a block of the staging buffer from any thread. Returns NULL if it
+ * doesn't fit right now, so the caller should fall back to malloc.
+ */
+unsigned char *
+allocateStaging(size_t size);
+
+bool
+isStagingMemory(const void *pointer);
+
+/**
+ * Releases a block returned by allocateStaging. When called from a thread
+ * with a current context, the block is only reused once the commands
+ * submitted so far have completed.
+ */
+void
+releaseStaging(void *pointer);
+
+/**
+ * Reclaims the blocks whose uploads have completed. Needs a current context.
+ */
+void
+retireStaging(void);
+
+/**
+ * Binds the staging buffer to GL_PIXEL_UNPACK_BUFFER and returns the offset of
+ * the pixels in it if they are staging memory. Otherwise the pixels are
+ * returned as they are. Either way, the caller unbinds the buffer afterwards.
+ */
+const void *
+bindUnpackSource(const void *pixels);
+
+/**
+ * Finds the buffer and offset of staging memory, for glCopyBufferSubData.
+ */
+bool
+getStagingOffset(const void *pointer, GLuint *buffer, GLintptr *offset);
+
+/* Defined in stats.c */
+
+/**
+ * The buffer targets whose bindings are kept in struct GLState.
+ */
+enum BufferTarget {
+	BT_ARRAY,
+	BT_ELEMENT_ARRAY,
+	BT_UNIFORM,
+	BT_PIXEL_UNPACK,
+	BT_PIXEL_PACK,
+	BT_COPY_READ,
+	BT_COPY_WRITE,
+	BT_TRANSFORM_FEEDBACK,
+	BUFFER_TARGETS
+};
+
+/* The texture units whose 2D texture binding is kept in struct GLState. */
+#define SHADOWED_TEXTURE_UNITS 16
+
+/**
+ * The state of a context as set through the wrappers, so it can be restored
+ * or looked up without asking the driver.
+ */
+struct GLState {
+	GLuint		 buffers[BUFFER_TARGETS];
+	/* false after a vertex array was bound, until an element array buffer
+	 * is */
+	bool		 elementBufferKnown;
+	GLuint		 vertexArray;
+	GLuint		 program;
+	GLenum		 activeTexture;
+	GLuint		 textures[SHADOWED_TEXTURE_UNITS];
+	GLint		 viewport[4];
+	GLenum		 blendSourceRGB;
+	GLenum		 blendDestinationRGB;
+	GLenum		 blendSourceAlpha;
+	GLenum		 blendDestinationAlpha;
+	bool		 blend;
+	bool		 cullFace;
+	bool		 depthTest;
+	bool		 scissorTest;
+};
+
+/**
+ * Starts counting the render statistics of a frame on the render thread.
+ */
+void
+beginFrameStats(void);
+
+void
+endFrameStats(double renderTime, double swapTime);
+
+/**
+ * Returns the index of a buffer target in struct GLState, or -1 for targets
+ * that aren't kept.
+ */
+int
+getBufferTarget(GLenum target);
+
+/**
+ * The state of the context of the calling thread. Changes made without the
+ * wrappers aren't seen.
+ */
+const struct GLState *
+getGLState(void);
+
+/**
+ * The render statistics of the last completed frame, or NULL before the first.
+ */
+const struct CGRenderStats *
+getLastFrameStats(void);
+
+/**
+ * Binds the array buffer, vertex array, program, active unit and the 2D
+ * texture of unit 0 the wrappers last saw again, after they were changed
+ * without them. Not counted in the statistics.
+ */
+void
+restoreGLBindings(void);
+
+/**
+ * Forgets the bindings of a buffer that's deleted, as GL does.
+ */
+void
+unbindDeletedBuffer(GLuint buffer);
+
+/**
+ * Forgets the bindings of a texture that's deleted, as GL does.
+ */
+void
+unbindDeletedTexture(GLuint texture);
+
+/* Defined in startup.c */
+
+/**
+ * Starts a span of startup on the calling thread, with a detail like a path
+ * that's copied. Returns the span for endSpan, or -1 if startup isn't
+ * profiled (anymore), in which case endSpan does nothing.
+ */
+int
+beginSpan(const char *name, const char *detail);
+
+void
+endSpan(int span, size_t bytes);
+
+/**
+ * Names the calling thread in the startup trace, for CGSetThreadName.
+ */
+void
+setSpanThreadName(const char *name);
+
+/**
+ * Ends startup and emits the report and trace. Called by CGStart after the
+ * first frame, or by CGCleanError if it never came to that.
+ */
+void
+finishStartup(void);
+
+/* Defined in trace.c */
+
+struct TraceTrack;
+
+/**
+ * Creates a track that isn't owned by a thread, for the GPU zones. Only one
+ * thread may push events to it. Returns NULL if there's no room left.
+ */
+struct TraceTrack *
+createTraceTrack(const char *name);
+
+/**
+ * Nanoseconds on the clock of the trace.
+ */
+uint64_t
+getTraceTime(void);
+
+bool
+isTracing(void);
+
+void
+pushTraceEvent(struct TraceTrack *, const char *name, uint64_t start,
+			   uint64_t end);
+
+/**
+ * Records a zone that has already ended on the track of the calling thread.
+ */
+void
+recordTraceZone(const char *name, uint64_t start, uint64_t end);
+
+/**
+ * Writes the events of the trace that (partly) happened at or after since,
+ * like CGWriteTrace.
+ */
+bool
+writeTrace(const char *path, uint64_t since);
+
+/**
+ * Writes a string as a quoted and escaped JSON string.
+ */
+void
+writeJSONString(FILE *, const char *);
+
+/* Defined in upload.c */
+
+/**
+ * Refills the upload budget for a new frame. Reports the bytes uploaded and
+ * the time the loader spent on them since the previous call.
+ */
+void
+beginUploadFrame(size_t *bytes, double *time);
+
+/**
+ * Creates the shared context and starts the loader thread. If this fails,
+ * uploads are performed on the calling thread instead.
+ */
+bool
+startLoader(void);
+
+/**
+ * Finishes the queued uploads and stops the loader thread.
+ */
+void
+stopLoader(void);
+
+/* Defined in worker.c */
+
+typedef void (*WorkerFunc)(void *argument, size_t index);
+
+/**
+ * Starts a worker thread for every processor except one. Returns false if no
+ * workers could be started, in which case runParallel runs on the calling
+ * thread.
+ */
+bool
+startWorkers(void);
+
+void
+stopWorkers(void);
+
+size_t
+getWorkerCount(void);
+
+/**
+ * Calls func for every index from 0 to count on the worker threads and the
+ * calling thread, and returns once all of them have finished. May be called
+ * from any thread, including the workers themselves.
+ */
+void
+runParallel(WorkerFunc func, void *argument, size_t count);
+
+#endif /* __LIBCG_INTERNAL_H__ */
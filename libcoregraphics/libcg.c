@@ -29,13 +29,17 @@
 
 #include "libcg.h"
 
-#include <sys/stat.h>
+#include <sys/eventfd.h>
 
-#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
@@ -45,20 +49,29 @@
 #include <GL/glew.h>
 #include <GL/glx.h>
 
-#include "stb_image.h"
+#include "internal.h"
 
 /** Function Prototypes **/
-void
-checkForErrors(const char *, const char *);
-
-char *
-loadFile(const char *);
+bool
+loadShader(const struct CGFileView *, GLenum, GLuint *);
 
 bool
-loadShader(const char *, GLenum, GLuint *);
+checkShader(GLuint);
 
 /** Global variables **/
-GLint att[] = { GLX_RGBA, GLX_DEPTH_SIZE, 24, GLX_DOUBLEBUFFER, None };
+static const int fbConfigAttributes[] = {
+	GLX_X_RENDERABLE,	True,
+	GLX_DRAWABLE_TYPE,	GLX_WINDOW_BIT,
+	GLX_RENDER_TYPE,	GLX_RGBA_BIT,
+	GLX_X_VISUAL_TYPE,	GLX_TRUE_COLOR,
+	GLX_RED_SIZE,		8,
+	GLX_GREEN_SIZE,		8,
+	GLX_BLUE_SIZE,		8,
+	GLX_DEPTH_SIZE,		24,
+	GLX_DOUBLEBUFFER,	True,
+	None
+};
+/* Cleared by CGSetShutdown from any thread, so accessed atomically. */
 bool loopState = true;
 
 /* Xorg info */
@@ -73,33 +86,454 @@ XSetWindowAttributes windowAttributes;
 
 Colormap colormap;
 GLXContext context;
+GLXFBConfig fbConfig;
+
+static struct CGContextConfig contextConfig = {
+	.majorVersion = 3,
+	.minorVersion = 3,
+	.coreProfile = true,
+#ifdef NDEBUG
+	.debug = false,
+	.noError = true,
+#else
+	.debug = true,
+	.noError = false,
+#endif
+};
+
+/* Set by ignoreXError, used to detect failed context creation. */
+static bool xErrorOccurred;
 
 /* User info */
 static CGRenderFunc renderFunction = NULL;
 static CGShutdownFunc shutdownFunc = NULL;
 
+/* On-demand rendering. frameDirty and windowVisible are only touched by the
+ * thread running CGStart; other threads go through wakeupFd. */
+static bool frameDirty = true;
+static bool windowVisible = true;
+static int wakeupFd = -1;
+
+/* Frame pacing. frameFences is a ring buffer of the fences of the frames that
+ * the GPU may still be working on, oldest first. */
+static unsigned int maxFramesInFlight = 2;
+static GLsync frameFences[CG_MAX_FRAMES_IN_FLIGHT];
+static unsigned int frameFenceHead = 0;
+static unsigned int frameFenceCount = 0;
+static struct CGFrameTelemetry frameTelemetry;
+
+/* GPU zones. gpuZones is a ring buffer of the zones whose timer queries may
+ * not have a result yet, oldest first. */
+#define MAX_GPU_ZONES 256
+/* How often the GPU clock is compared to the trace clock, in nanoseconds. */
+#define GPU_CALIBRATION_INTERVAL 1000000000
+
+struct GPUZone {
+	const char	*name;
+	bool		 ended;
+};
+
+static struct GPUZone gpuZones[MAX_GPU_ZONES];
+static GLuint gpuQueries[MAX_GPU_ZONES][2];
+static bool gpuQueriesCreated = false;
+static unsigned int gpuZoneHead = 0;
+static unsigned int gpuZoneCount = 0;
+static struct TraceTrack *gpuTrack = NULL;
+/* added to GPU timestamps to get trace time */
+static int64_t gpuClockOffset = 0;
+static uint64_t gpuCalibrationTime = 0;
+
+/* Hitch detection. recentFrameTimes is a ring buffer of the latest frame
+ * times, for the median. */
+#define RECENT_FRAMES 63
+/* The median isn't trusted before this many frames. */
+#define MIN_RECENT_FRAMES 8
+
+static struct CGHitchConfig hitchConfig;
+static bool hitchDetection = false;
+static double recentFrameTimes[RECENT_FRAMES];
+static unsigned int recentFrameCount = 0;
+static unsigned int hitchCaptures = 0;
+static bool skipHitchFrame = false;
+
+double
+getTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t
+getFrameIndex(void) {
+	return frameTelemetry.frameIndex;
+}
+
+bool
+isFrameRetired(uint64_t frame) {
+	unsigned int limit = maxFramesInFlight;
+
+	/* Without throttling nothing is certain, so give the GPU the most. */
+	if (limit == 0 || !GLEW_ARB_sync)
+		limit = CG_MAX_FRAMES_IN_FLIGHT;
+
+	return frameTelemetry.frameIndex >= frame + limit;
+}
+
+static void
+popFrameFence(bool wait) {
+	GLsync fence;
+	GLenum status;
+
+	fence = frameFences[frameFenceHead];
+	frameFenceHead = (frameFenceHead + 1) % CG_MAX_FRAMES_IN_FLIGHT;
+	frameFenceCount--;
+
+	if (wait) {
+		/* The first wait flushes, so later iterations can't deadlock. */
+		status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+								  1000000000);
+		while (status == GL_TIMEOUT_EXPIRED)
+			status = glClientWaitSync(fence, 0, 1000000000);
+
+		if (status == GL_WAIT_FAILED)
+			checkForErrors("popFrameFence", "waitFailed");
+	}
+
+	glDeleteSync(fence);
+}
+
+/**
+ * Blocks until fewer than maxFramesInFlight frames are queued on the GPU and
+ * returns the time spent waiting.
+ */
+static double
+waitForFrameFences(void) {
+	double start;
+
+	if (frameFenceCount == 0 || frameFenceCount < maxFramesInFlight)
+		return 0.0;
+
+	CG_ZONE("wait for frames");
+	start = getTime();
+	while (frameFenceCount > 0 && frameFenceCount >= maxFramesInFlight)
+		popFrameFence(true);
+
+	return getTime() - start;
+}
+
+static void
+pushFrameFence(void) {
+	GLsync fence;
+
+	if (maxFramesInFlight == 0 || !GLEW_ARB_sync)
+		return;
+
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	if (fence == NULL)
+		return;
+
+	frameFences[(frameFenceHead + frameFenceCount) % CG_MAX_FRAMES_IN_FLIGHT]
+		= fence;
+	frameFenceCount++;
+}
+
+static void
+deleteFrameFences(void) {
+	while (frameFenceCount > 0)
+		popFrameFence(false);
+}
+
+struct CGGPUTraceZone
+CGBeginGPUTraceZone(const char *name) {
+	struct CGGPUTraceZone zone = { -1 };
+
+	if (!isTracing() || !GLEW_ARB_timer_query
+		|| gpuZoneCount == MAX_GPU_ZONES)
+		return zone;
+
+	if (gpuTrack == NULL) {
+		gpuTrack = createTraceTrack("GPU");
+		if (gpuTrack == NULL)
+			return zone;
+	}
+
+	if (!gpuQueriesCreated) {
+		glGenQueries(MAX_GPU_ZONES * 2, gpuQueries[0]);
+		gpuQueriesCreated = true;
+	}
+
+	zone.index = (gpuZoneHead + gpuZoneCount) % MAX_GPU_ZONES;
+	gpuZoneCount++;
+	gpuZones[zone.index].name = name;
+	gpuZones[zone.index].ended = false;
+	glQueryCounter(gpuQueries[zone.index][0], GL_TIMESTAMP);
+
+	return zone;
+}
+
+void
+CGEndGPUTraceZone(struct CGGPUTraceZone *zone) {
+	if (zone->index == -1)
+		return;
+
+	glQueryCounter(gpuQueries[zone->index][1], GL_TIMESTAMP);
+	gpuZones[zone->index].ended = true;
+}
+
+/**
+ * Moves the GPU zones the GPU has finished to the GPU track, without waiting
+ * for the others.
+ */
+static void
+resolveGPUZones(void) {
+	GLuint *queries;
+	GLint64 gpuTime;
+	GLuint64 start;
+	GLuint64 end;
+	GLint available;
+	uint64_t before;
+
+	if (gpuZoneCount == 0)
+		return;
+
+	/* The clocks drift apart, so they're compared every now and then. */
+	before = getTraceTime();
+	if (gpuCalibrationTime == 0
+		|| before - gpuCalibrationTime >= GPU_CALIBRATION_INTERVAL) {
+		glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+		gpuCalibrationTime = getTraceTime();
+		gpuClockOffset = (int64_t) (before + (gpuCalibrationTime - before) / 2)
+					   - gpuTime;
+	}
+
+	while (gpuZoneCount > 0 && gpuZones[gpuZoneHead].ended) {
+		queries = gpuQueries[gpuZoneHead];
+		glGetQueryObjectiv(queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+
+		glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+		pushTraceEvent(gpuTrack, gpuZones[gpuZoneHead].name,
+					   (uint64_t) ((int64_t) start + gpuClockOffset),
+					   (uint64_t) ((int64_t) end + gpuClockOffset));
+
+		gpuZoneHead = (gpuZoneHead + 1) % MAX_GPU_ZONES;
+		gpuZoneCount--;
+	}
+}
+
+static void
+deleteGPUZones(void) {
+	if (gpuQueriesCreated) {
+		glDeleteQueries(MAX_GPU_ZONES * 2, gpuQueries[0]);
+		gpuQueriesCreated = false;
+	}
+
+	gpuZoneHead = 0;
+	gpuZoneCount = 0;
+	gpuCalibrationTime = 0;
+}
+
 void
 CGCleanError(void) {
+	finishStartup();
+
+	if (wakeupFd != -1) {
+		close(wakeupFd);
+		wakeupFd = -1;
+	}
+
+	destroyPools();
+	deleteRecycled();
+	stopLoader();
+	stopStaging();
+	stopWorkers();
+	deleteGPUZones();
+	deleteHUD();
+	closePerfCounters();
+	releaseFrameArena();
+	reportGPULeaks();
+
+	glXMakeCurrent(display, None, NULL);
+	glXDestroyContext(display, context);
 	XDestroyWindow(display, window);
 	XCloseDisplay(display);
 }
 
-bool
-CGInitialize(void) {
+void
+CGSetContextConfig(const struct CGContextConfig *config) {
+	memcpy(&contextConfig, config, sizeof(contextConfig));
+}
+
+static bool
+hasExtension(const char *extensions, const char *name) {
+	size_t length = strlen(name);
+	const char *pos = extensions;
+
+	while (extensions != NULL && (pos = strstr(pos, name)) != NULL) {
+		if ((pos == extensions || pos[-1] == ' ')
+			&& (pos[length] == ' ' || pos[length] == '\0'))
+			return true;
+		pos += length;
+	}
+
+	return false;
+}
+
+static int
+ignoreXError(Display *dpy, XErrorEvent *error) {
+	(void) dpy;
+	(void) error;
+
+	xErrorOccurred = true;
+	return 0;
+}
+
+/**
+ * Creates the context with glXCreateContextAttribsARB according to
+ * contextConfig. Returns NULL if the driver rejects the attributes, in which
+ * case the caller should try something more conservative.
+ */
+static GLXContext
+createContextWithAttributes(PFNGLXCREATECONTEXTATTRIBSARBPROC create,
+							const char *extensions, GLXContext share,
+							bool noError) {
+	GLXContext ctx;
+	int attributes[16];
+	int flags = 0;
+	int (*oldHandler)(Display *, XErrorEvent *);
+	size_t i = 0;
+
+	attributes[i++] = GLX_CONTEXT_MAJOR_VERSION_ARB;
+	attributes[i++] = contextConfig.majorVersion;
+	attributes[i++] = GLX_CONTEXT_MINOR_VERSION_ARB;
+	attributes[i++] = contextConfig.minorVersion;
+
+	if (hasExtension(extensions, "GLX_ARB_create_context_profile")) {
+		attributes[i++] = GLX_CONTEXT_PROFILE_MASK_ARB;
+		attributes[i++] = contextConfig.coreProfile
+						? GLX_CONTEXT_CORE_PROFILE_BIT_ARB
+						: GLX_CONTEXT_COMPATIBILITY_PROFILE_BIT_ARB;
+	}
+
+	if (contextConfig.debug)
+		flags |= GLX_CONTEXT_DEBUG_BIT_ARB;
+	if (contextConfig.coreProfile)
+		flags |= GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB;
+	attributes[i++] = GLX_CONTEXT_FLAGS_ARB;
+	attributes[i++] = flags;
+
+	if (noError) {
+		attributes[i++] = GLX_CONTEXT_OPENGL_NO_ERROR_ARB;
+		attributes[i++] = True;
+	}
+
+	attributes[i] = None;
+
+	/* A rejected attribute list is reported as an X error, which would
+	 * terminate the program with the default handler. */
+	xErrorOccurred = false;
+	oldHandler = XSetErrorHandler(ignoreXError);
+	ctx = create(display, fbConfig, share, True, attributes);
+	XSync(display, False);
+	XSetErrorHandler(oldHandler);
+
+	if (xErrorOccurred && ctx != NULL) {
+		glXDestroyContext(display, ctx);
+		ctx = NULL;
+	}
+
+	return ctx;
+}
+
+GLXContext
+createContext(GLXContext share) {
+	PFNGLXCREATECONTEXTATTRIBSARBPROC create;
+	GLXContext ctx = NULL;
+	const char *extensions;
+
+	extensions = glXQueryExtensionsString(display, screenId);
+	create = (PFNGLXCREATECONTEXTATTRIBSARBPROC) glXGetProcAddressARB(
+				(const GLubyte *) "glXCreateContextAttribsARB");
+
+	if (create != NULL && hasExtension(extensions, "GLX_ARB_create_context")) {
+		if (contextConfig.noError && !contextConfig.debug
+			&& hasExtension(extensions, "GLX_ARB_create_context_no_error"))
+			ctx = createContextWithAttributes(create, extensions, share, true);
+
+		if (ctx == NULL)
+			ctx = createContextWithAttributes(create, extensions, share,
+											  false);
+
+		if (ctx != NULL)
+			return ctx;
+
+		fprintf(stderr, "[CGInitialize] Failed to create an OpenGL %i.%i "
+				"context, falling back to a legacy context.\n",
+				contextConfig.majorVersion, contextConfig.minorVersion);
+	}
+
+	return glXCreateNewContext(display, fbConfig, GLX_RGBA_TYPE, share, True);
+}
+
+static void GLAPIENTRY
+printDebugMessage(GLenum source, GLenum type, GLuint id, GLenum severity,
+				  GLsizei length, const GLchar *message,
+				  const void *userParam) {
+	(void) source;
+	(void) type;
+	(void) id;
+	(void) length;
+	(void) userParam;
+
+	if (severity == GL_DEBUG_SEVERITY_NOTIFICATION)
+		return;
+
+	fprintf(stderr, "[OpenGLDebug] %s\n", message);
+}
+
+static bool
+initialize(void) {
+	GLXFBConfig *fbConfigs;
+	int fbConfigCount;
+	int span;
+
+	/* The loader thread uses the display connection as well. */
+	span = beginSpan("XOpenDisplay", NULL);
+	XInitThreads();
 	display = XOpenDisplay(NULL);
+	endSpan(span, 0);
 
 	if (display == NULL) {
 		fputs("Could not open display", stderr);
 		return false;
 	}
 
+	span = beginSpan("create window", NULL);
 	screen = DefaultScreenOfDisplay(display);
 	screenId = DefaultScreen(display);
 	rootWindow = RootWindowOfScreen(screen);
 
-	visualInfo = glXChooseVisual(display, 0, att);
+	/* The configurations are sorted with the best match first. */
+	fbConfigs = glXChooseFBConfig(display, screenId, fbConfigAttributes,
+								  &fbConfigCount);
+	if (fbConfigs == NULL || fbConfigCount == 0) {
+		endSpan(span, 0);
+		XCloseDisplay(display);
+		fputs("[CGInitialize] No appropriate framebuffer config found!\n",
+			  stderr);
+		return false;
+	}
+
+	fbConfig = fbConfigs[0];
+	XFree(fbConfigs);
+
+	visualInfo = glXGetVisualFromFBConfig(display, fbConfig);
 
 	if (visualInfo == NULL) {
+		endSpan(span, 0);
 		XCloseDisplay(display);
 		printf("\n\tno appropriate visual found\n\n");
 		return false;
@@ -110,9 +544,12 @@ CGInitialize(void) {
 
 	windowAttributes.colormap = colormap;
 	windowAttributes.event_mask = ExposureMask
+								| FocusChangeMask
 								| KeyPressMask
 								| KeyReleaseMask
-								| KeymapStateMask;
+								| KeymapStateMask
+								| StructureNotifyMask
+								| VisibilityChangeMask;
 
 	window = XCreateWindow(display, rootWindow, 0, 0,
 						   screen->width, screen->height, 0,
@@ -121,34 +558,293 @@ CGInitialize(void) {
 
 	XClearWindow(display, window);
 	XMapRaised(display, window);
+	endSpan(span, 0);
+
+	span = beginSpan("create context", NULL);
+	context = createContext(NULL);
+	if (context != NULL)
+		glXMakeCurrent(display, window, context);
+	endSpan(span, 0);
+	if (context == NULL) {
+		XDestroyWindow(display, window);
+		XCloseDisplay(display);
+		fputs("[CGInitialize] Failed to create an OpenGL context!\n", stderr);
+		return false;
+	}
 
-	context = glXCreateContext(display, visualInfo, NULL, GL_TRUE);
-	glXMakeCurrent(display, window, context);
-
+	/* GLEW needs this to load the entry points of a core profile. */
+	span = beginSpan("glewInit", NULL);
+	glewExperimental = GL_TRUE;
 	if (glewInit() != GLEW_OK) {
+		endSpan(span, 0);
 		glXDestroyContext(display, context);
 		XDestroyWindow(display, window);
 		XCloseDisplay(display);
 		fputs("Failed to initialize GLEW!\n", stderr);
-		return true;
+		return false;
+	}
+
+	/* glewInit queries GL_EXTENSIONS the legacy way, which is an error in core
+	 * profiles. */
+	while (glGetError() != GL_NO_ERROR)
+		continue;
+	endSpan(span, 0);
+
+	/* That's the size of the window already, but the overlay learns it from
+	 * the wrapper. */
+	glViewport(0, 0, screen->width, screen->height);
+
+	/* Rows of one and two channel images aren't four byte aligned, and the
+	 * uploads of libcg leave this alone. */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if (contextConfig.debug && GLEW_KHR_debug) {
+		glEnable(GL_DEBUG_OUTPUT);
+		glDebugMessageCallback(printDebugMessage, NULL);
 	}
 
+	/* Let the driver compile on as many threads as it likes, so shaders
+	 * compiled together (see CGLoadAssets) don't wait for each other. */
+	if (GLEW_KHR_parallel_shader_compile)
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	else if (GLEW_ARB_parallel_shader_compile)
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+
+	wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeupFd == -1)
+		perror("[CGInitialize] eventfd() failure, CGRequestRedraw disabled");
+
+	span = beginSpan("start staging", NULL);
+	if (!startStaging())
+		fputs("[CGInitialize] No staging buffer, images will be decoded "
+			  "into regular memory.\n", stderr);
+	endSpan(span, 0);
+
+	span = beginSpan("start workers", NULL);
+	if (!startWorkers())
+		fputs("[CGInitialize] No worker threads, CPU work like mipmap "
+			  "generation will run on the calling thread.\n", stderr);
+	endSpan(span, 0);
+
+	span = beginSpan("start loader", NULL);
+	if (!startLoader())
+		fputs("[CGInitialize] Loader thread unavailable, uploads will be "
+			  "performed on the render thread.\n", stderr);
+	endSpan(span, 0);
+
 	return true;
 }
 
+bool
+CGInitialize(void) {
+	bool success;
+	int span;
+
+	CGSetThreadName("render");
+	span = beginSpan("CGInitialize", NULL);
+	success = initialize();
+	endSpan(span, 0);
+
+	return success;
+}
+
+/**
+ * Sleeps until the X connection or the wakeup eventfd becomes readable.
+ */
+static void
+waitForEvents(void) {
+	struct pollfd fds[2];
+	nfds_t count = 1;
+	uint64_t value;
+
+	/* Events may already be queued by Xlib, which poll() can't see. */
+	if (XPending(display) > 0)
+		return;
+
+	fds[0].fd = ConnectionNumber(display);
+	fds[0].events = POLLIN;
+	if (wakeupFd != -1) {
+		fds[1].fd = wakeupFd;
+		fds[1].events = POLLIN;
+		count = 2;
+	}
+
+	if (poll(fds, count, -1) == -1) {
+		if (errno != EINTR)
+			perror("[waitForEvents] poll() failure");
+		return;
+	}
+
+	if (count == 2 && (fds[1].revents & POLLIN)) {
+		if (read(wakeupFd, &value, sizeof(value)) == sizeof(value))
+			frameDirty = true;
+	}
+}
+
+/**
+ * Returns the time spent in the render function.
+ */
+static double
+renderFrame(void) {
+	double start;
+	double time = 0.0;
+	CG_ZONE("render");
+	CG_GPU_ZONE("render");
+
+	beginHUDFrame();
+	glClearColor(0, 0, 0, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	checkForErrors("renderFrame", "preRender");
+	if (renderFunction) {
+		start = getTime();
+		renderFunction(frameTelemetry.frameTime);
+		time = getTime() - start;
+	}
+	checkForErrors("renderFrame", "postRender");
+
+	drawHUD(&frameTelemetry);
+
+	return time;
+}
+
+/**
+ * Returns the time spent in glXSwapBuffers.
+ */
+static double
+presentFrame(void) {
+	double start;
+	double time;
+	CG_ZONE("present");
+
+	start = getTime();
+	glXSwapBuffers(display, window);
+	time = getTime() - start;
+
+	pushFrameFence();
+	resolveGPUZones();
+
+	return time;
+}
+
+/**
+ * Records the telemetry and render statistics of the previous frame as
+ * counters, at the start of the next.
+ */
+static void
+traceFrameTelemetry(void) {
+	const struct CGRenderStats *stats = getLastFrameStats();
+
+	CGTraceCounter("frame time (ms)", frameTelemetry.frameTime * 1000.0);
+	CGTraceCounter("fence wait (ms)", frameTelemetry.fenceWaitTime * 1000.0);
+	CGTraceCounter("upload (KiB)", frameTelemetry.uploadBytes / 1024.0);
+	if (stats != NULL) {
+		CGTraceCounter("draw calls", stats->drawCalls);
+		CGTraceCounter("triangles", stats->triangles);
+	}
+}
+
+static int
+compareFrameTimes(const void *a, const void *b) {
+	return (*(const double *) a > *(const double *) b)
+		 - (*(const double *) a < *(const double *) b);
+}
+
+static double
+getMedianFrameTime(void) {
+	double times[RECENT_FRAMES];
+	unsigned int count;
+
+	count = recentFrameCount < RECENT_FRAMES ? recentFrameCount
+											 : RECENT_FRAMES;
+	memcpy(times, recentFrameTimes, count * sizeof(double));
+	qsort(times, count, sizeof(double), compareFrameTimes);
+
+	return times[count / 2];
+}
+
+/**
+ * Checks whether the previous frame, which ended at frameStart, was a hitch,
+ * and if so captures the trace leading up to it.
+ */
+static void
+detectHitch(double frameStart) {
+	double frameTime = frameTelemetry.frameTime;
+	double median = 0.0;
+	double since;
+	bool hitch = false;
+	char path[4096];
+
+	if (!hitchDetection || frameTelemetry.frameIndex == 0)
+		return;
+
+	if (skipHitchFrame) {
+		skipHitchFrame = false;
+		return;
+	}
+
+	if (recentFrameCount >= MIN_RECENT_FRAMES)
+		median = getMedianFrameTime();
+
+	if (hitchConfig.threshold > 0.0 && frameTime > hitchConfig.threshold)
+		hitch = true;
+	if (hitchConfig.medianFactor > 0.0 && median > 0.0
+		&& frameTime > median * hitchConfig.medianFactor)
+		hitch = true;
+
+	recentFrameTimes[recentFrameCount % RECENT_FRAMES] = frameTime;
+	recentFrameCount++;
+
+	if (!hitch)
+		return;
+
+	recordTraceZone("hitch", (uint64_t) ((frameStart - frameTime) * 1e9),
+					(uint64_t) (frameStart * 1e9));
+
+	if (hitchConfig.directory == NULL
+		|| hitchCaptures >= hitchConfig.maxCaptures) {
+		fprintf(stderr, "[CGStart] Frame %" PRIu64 " took %.2f ms (median "
+				"%.2f ms).\n", frameTelemetry.frameIndex - 1,
+				frameTime * 1000.0, median * 1000.0);
+		return;
+	}
+
+	snprintf(path, sizeof(path), "%s/hitch-%" PRIu64 ".json",
+			 hitchConfig.directory, frameTelemetry.frameIndex - 1);
+	since = frameStart - frameTime - hitchConfig.window;
+	if (writeTrace(path, since > 0.0 ? (uint64_t) (since * 1e9) : 0))
+		fprintf(stderr, "[CGStart] Frame %" PRIu64 " took %.2f ms (median "
+				"%.2f ms), captured in '%s'.\n",
+				frameTelemetry.frameIndex - 1, frameTime * 1000.0,
+				median * 1000.0, path);
+
+	hitchCaptures++;
+	skipHitchFrame = true;
+}
+
 int
 CGStart(void) {
 	char str[25] = { 0 }; 
 	KeySym keysym = 0;
 	int len = 0;
-
-	while (loopState) {
-		while (XCheckMaskEvent(display, -1, &event)) {
+	double frameStart;
+	double lastFrameStart = getTime();
+	double fenceWaitTime;
+	double renderTime;
+	double swapTime;
+	int firstFrameSpan = beginSpan("first frame", NULL);
+
+	while (__atomic_load_n(&loopState, __ATOMIC_ACQUIRE)) {
+		/* Drain everything, including the events without a mask such as
+		 * MappingNotify, or waitForEvents would never sleep again. */
+		while (XPending(display) > 0) {
+			XNextEvent(display, &event);
 			switch(event.type) {
-				case KeymapNotify:
+				case MappingNotify:
 					XRefreshKeyboardMapping(&event.xmapping);
 					break;
 				case KeyPress:
+					frameDirty = true;
 					len = XLookupString(&event.xkey, str, 25, &keysym, NULL);
 					str[len] = '\0';
 					if (len > 0) {
@@ -158,8 +854,11 @@ CGStart(void) {
 					if (keysym == XK_Escape) {
 						CGSetShutdown(CG_SR_DEBUG_ESCAPEKEY);
 					}
+					if (keysym == XK_F3)
+						CGSetHUDEnabled(!isHUDEnabled());
 					break;
 				case KeyRelease:
+					frameDirty = true;
 					len = XLookupString(&event.xkey, str, 25, &keysym, NULL);
 					str[len] = '\0';
 					if (len > 0) {
@@ -167,23 +866,70 @@ CGStart(void) {
 							(size_t) keysym);
 					}
 					break;
+				case Expose:
+				case FocusIn:
+				case FocusOut:
+					frameDirty = true;
+					break;
+				case VisibilityNotify:
+					windowVisible = event.xvisibility.state
+								  != VisibilityFullyObscured;
+					frameDirty = true;
+					break;
+				case MapNotify:
+					windowVisible = true;
+					frameDirty = true;
+					break;
+				case UnmapNotify:
+					windowVisible = false;
+					break;
 				default:
 					break;
 			}
 		}
 
-		glClearColor(0, 0, 0, 1);
-		glClear(GL_COLOR_BUFFER_BIT);
+		if (!__atomic_load_n(&loopState, __ATOMIC_ACQUIRE))
+			break;
+
+		if (!frameDirty || !windowVisible) {
+			waitForEvents();
+			/* Don't report the time spent sleeping as frame time. */
+			lastFrameStart = getTime();
+			continue;
+		}
 
-		checkForErrors("renderFrame", "preRender");
-		if (renderFunction)
-			renderFunction(1.0);
-		checkForErrors("renderFrame", "postRender");
+		CG_ZONE("frame");
+		fenceWaitTime = waitForFrameFences();
+
+		frameStart = getTime();
+		beginArenaFrame();
+		beginFrameStats();
+		samplePerfCounters();
+		frameTelemetry.frameTime = frameStart - lastFrameStart;
+		frameTelemetry.fenceWaitTime = fenceWaitTime;
+		lastFrameStart = frameStart;
+		beginUploadFrame(&frameTelemetry.uploadBytes,
+						 &frameTelemetry.uploadTime);
+		traceFrameTelemetry();
+		detectHitch(frameStart);
+		retireStaging();
+		updateImageStreaming();
+
+		renderTime = renderFrame();
+		swapTime = presentFrame();
+		endFrameStats(renderTime, swapTime);
+
+		if (frameTelemetry.frameIndex == 0) {
+			endSpan(firstFrameSpan, 0);
+			finishStartup();
+		}
 
-		glXSwapBuffers(display, window);
+		frameTelemetry.framesInFlight = frameFenceCount;
+		frameTelemetry.frameIndex++;
 	}
 
 	/* Cleanup */
+	deleteFrameFences();
 	if (shutdownFunc)
 		shutdownFunc();
 	CGCleanError();
@@ -204,23 +950,58 @@ CGDeleteShader(struct CGShaderData *shader) {
 
 bool
 CGLoadShader(struct CGShaderData *shader, struct CGShaderInitData *initInfo) {
+	const char *paths[2];
+	struct CGFileView sources[2];
+	bool compiled;
+	size_t read;
+	int span;
+
+	/* Both stages are read at once. */
+	paths[0] = initInfo->vertexShaderFilePath;
+	paths[1] = initInfo->fragmentShaderFilePath;
+	span = beginSpan("read shader", paths[0]);
+	read = CGReadFiles(sources, paths, 2);
+	endSpan(span, sources[0].size + sources[1].size);
+	if (read != 2) {
+		CGReleaseFileView(&sources[0]);
+		CGReleaseFileView(&sources[1]);
+		fputs("[CGLoadShader] Failed to read shader files!\n", stderr);
+		return false;
+	}
+
+	compiled = compileShader(shader, initInfo, sources);
+	CGReleaseFileView(&sources[0]);
+	CGReleaseFileView(&sources[1]);
+
+	return compiled && finishShader(shader);
+}
+
+bool
+compileShader(struct CGShaderData *shader,
+			  const struct CGShaderInitData *initInfo,
+			  const struct CGFileView sources[2]) {
 	size_t i;
+	int span;
+	CG_FUNCTION_ZONE();
 
+	span = beginSpan("compile shader", initInfo->vertexShaderFilePath);
 	shader->program = glCreateProgram();
 	if (shader->program == 0) {
+		endSpan(span, 0);
 		fputs("[CGLoadShader] Failed to create shader program!\n", stderr);
 		return false;
 	}
 
-	if (!loadShader(initInfo->vertexShaderFilePath, GL_VERTEX_SHADER,
-					&shader->vertexShader)) {
+	if (!loadShader(&sources[0], GL_VERTEX_SHADER, &shader->vertexShader)) {
+		endSpan(span, 0);
 		glDeleteProgram(shader->program);
 		fputs("[CGLoadShader] Failed to load vertex shader!\n", stderr);
 		return false;
 	}
 
-	if (!loadShader(initInfo->fragmentShaderFilePath, GL_FRAGMENT_SHADER,
+	if (!loadShader(&sources[1], GL_FRAGMENT_SHADER,
 					&shader->fragmentShader)) {
+		endSpan(span, 0);
 		glDeleteShader(shader->vertexShader);
 		glDeleteProgram(shader->program);
 		fputs("[CGLoadShader] Failed to load fragment shader!\n", stderr);
@@ -234,143 +1015,129 @@ CGLoadShader(struct CGShaderData *shader, struct CGShaderInitData *initInfo) {
 		glBindAttribLocation(shader->program, i, initInfo->attributes[i]);
 
 	glLinkProgram(shader->program);
-
-	/* Perform checks with glValidateProgram */
-
-	/* bind uniform locations */
+	endSpan(span, sources[0].size + sources[1].size);
 
 	return true;
 }
 
-char *
-loadFile(const char *path) {
-	char		*buf;
-	int			 fd;
-	size_t		 len;
-	char		*pos;
-	ssize_t		 ret;
-	struct stat	 status;
-
-	fd = open(path, O_RDONLY);
-	if (fd == -1) {
-		perror("open() failure");
-		fprintf(stderr, "Failed to open '%s'. "
-				"See the error described above.\n", path);
-		return NULL;
-	}
-
-	if (fstat(fd, &status) == -1) {
-		perror("fstat() failure");
-		close(fd);
-		fprintf(stderr, "Failed to stat() '%s'. "
-			   "See the error described above.\n", path);
-		return NULL;
-	}
-
-	if (!S_ISREG(status.st_mode)) {
-		close(fd);
-		printf("'%s' isn't a normal file!\n", path);
-		return NULL;
+bool
+finishShader(struct CGShaderData *shader) {
+	char errorLog[4096];
+	GLint status;
+	int span;
+	CG_FUNCTION_ZONE();
+
+	/* Waits for the driver if it compiles in the background. */
+	span = beginSpan("finish shader", NULL);
+	if (!checkShader(shader->vertexShader)
+		|| !checkShader(shader->fragmentShader)) {
+		endSpan(span, 0);
+		CGDeleteShader(shader);
+		return false;
 	}
 
-	len = (size_t) status.st_size;
-	buf = malloc(status.st_size + 1);
-	buf[len] = '\0';
-
-	if (buf == NULL) {
-		perror("Failed to allocate data for file");
-		close(fd);
-		fprintf(stderr, "Failed to allocate data for file '%s'!\n", path);
-		return NULL;
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	endSpan(span, 0);
+	if (status == GL_FALSE) {
+		errorLog[0] = '\0';
+		glGetProgramInfoLog(shader->program, sizeof(errorLog), NULL,
+							errorLog);
+		fprintf(stderr, "[CGLoadShader] Failed to link shader program: "
+				"\"%s\"\n", errorLog);
+		CGDeleteShader(shader);
+		return false;
 	}
 
-	pos = buf;
-	while (len > 0) {
-		ret = read(fd, pos, len);
-
-		if (ret == 0)
-			break;
-
-		if (ret == -1) {
-			perror("Failed to read from file");
-			close(fd);
-			fprintf(stderr, "Failed to read from file '%s'!\n", path);
-			return NULL;
-		}
-
-		len -= ret;
-		pos += ret;
-	}
+	/* Perform checks with glValidateProgram */
 
-	close(fd);
-	return buf;
+	return true;
 }
 
 bool
-loadShader(const char *path, GLenum type, GLuint *dest) {
+loadShader(const struct CGFileView *source, GLenum type, GLuint *dest) {
 	GLuint	 shader;
-	char	*shaderData;
-	GLint	 status;
+	const char *data;
+	GLint	 length;
 
 	checkForErrors("loadShader", "preLoad");
 
-	shader = glCreateShader(type);
-	if (shader == 0) {
-		fputs("[loadShader] Failed to glCreateShader()!\n", stderr);
+	if (source->size > INT32_MAX) {
+		fputs("[loadShader] Shader file is too large!\n", stderr);
 		return false;
 	}
 
-	shaderData = loadFile(path);
-	if (shaderData == NULL) {
-		glDeleteShader(shader);
-		fputs("[loadShader] Failed to load shader file!\n", stderr);
+	shader = glCreateShader(type);
+	if (shader == 0) {
+		fputs("[loadShader] Failed to glCreateShader()!\n", stderr);
 		return false;
 	}
 
-	glShaderSource(shader, 1, (const char *const *) &shaderData, NULL);
-	free(shaderData);
+	/* The source isn't NUL-terminated, so its length is passed along. The
+	 * result is only checked by checkShader, so the driver may compile in the
+	 * background meanwhile. */
+	data = (const char *) source->data;
+	length = source->size;
+	glShaderSource(shader, 1, &data, &length);
 	glCompileShader(shader);
 
+	*dest = shader;
+	return true;
+}
+
+bool
+checkShader(GLuint shader) {
+	GLint	 status;
+
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
 	if (status == GL_FALSE) {
 		char errorLog[4096];
 		errorLog[0] = '\0';
 
-		fputs("[loadShader] Failed to compile shader!\n", stderr);
-		checkForErrors("loadShader", "compileFailure");
+		fputs("[checkShader] Failed to compile shader!\n", stderr);
+		checkForErrors("checkShader", "compileFailure");
 
 		glGetShaderInfoLog(shader, sizeof(errorLog), NULL, errorLog);
 		if (*errorLog == '\0')
-			fputs("[loadShader] ShaderLog didn't have anything to report.\n",
+			fputs("[checkShader] ShaderLog didn't have anything to report.\n",
 				  stderr);
 		else
-			fprintf(stderr, "[loadShader] ShaderLog: \"%s\"\n", errorLog);
-
-		glDeleteShader(shader);
-		checkForErrors("loadShader", "end");
+			fprintf(stderr, "[checkShader] ShaderLog: \"%s\"\n", errorLog);
 
+		checkForErrors("checkShader", "end");
 		return false;
 	}
 
-	*dest = shader;
 	return true;
 }
 
 bool
 CGLoadMesh(struct CGMeshData *mesh, struct CGMeshInitData *initData) {
+	int span;
+	CG_FUNCTION_ZONE();
+
+	span = beginSpan("upload mesh", NULL);
 	mesh->count = initData->vertexCount;
 
 	glGenVertexArrays(1, &mesh->vao);
 	glBindVertexArray(mesh->vao);
 
-	glGenBuffers(1, &mesh->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
-	glBufferData(GL_ARRAY_BUFFER, initData->verticesSize, initData->vertices,
-				 GL_STATIC_DRAW);
+	mesh->vbo = acquireBuffer(initData->verticesSize, &mesh->vboSize);
+	if (mesh->vbo != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, initData->verticesSize,
+						initData->vertices);
+	} else {
+		glGenBuffers(1, &mesh->vbo);
+		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+		glBufferData(GL_ARRAY_BUFFER, initData->verticesSize,
+					 initData->vertices, GL_STATIC_DRAW);
+		mesh->vboSize = initData->verticesSize;
+	}
 
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer(0, initData->dimensions, GL_FLOAT, GL_FALSE,
 						  initData->dimensions * sizeof(GLfloat), NULL);
+	endSpan(span, initData->verticesSize);
 
 	return true;
 }
@@ -416,6 +1183,35 @@ CGSetShutdownFunc(CGShutdownFunc func) {
 	shutdownFunc = func;
 }
 
+void
+CGSetMaxFramesInFlight(unsigned int count) {
+	if (count > CG_MAX_FRAMES_IN_FLIGHT)
+		count = CG_MAX_FRAMES_IN_FLIGHT;
+
+	maxFramesInFlight = count;
+}
+
+void
+CGSetHitchDetection(const struct CGHitchConfig *config) {
+	hitchDetection = config != NULL;
+	if (!hitchDetection)
+		return;
+
+	memcpy(&hitchConfig, config, sizeof(hitchConfig));
+	recentFrameCount = 0;
+	skipHitchFrame = false;
+	CGSetTracing(true);
+}
+
+bool
+CGGetFrameTelemetry(struct CGFrameTelemetry *telemetry) {
+	if (frameTelemetry.frameIndex == 0)
+		return false;
+
+	memcpy(telemetry, &frameTelemetry, sizeof(*telemetry));
+	return true;
+}
+
 void
 CGSetRenderFunc(CGRenderFunc func) {
 	renderFunction = func;
@@ -427,43 +1223,26 @@ CGSetShutdown(enum CGShutdownReason reason) {
 	((void) reason);
 
 	/* Set CGStart's loopState variable to false, which will break the loop. */
-	loopState = false;
+	__atomic_store_n(&loopState, false, __ATOMIC_RELEASE);
+	CGRequestRedraw();
 }
 
 void
-CGDeleteMesh(struct CGMeshData *mesh) {
-	glDeleteBuffers(1, &mesh->vbo);
-	glDeleteVertexArrays(1, &mesh->vao);
+CGSetFrameClean(void) {
+	frameDirty = false;
 }
 
-bool
-CGLoadImage(struct CGImage *image, struct CGImageInitData *initData) {
-	int width;
-	int height;
-	int nrChannels;
-	unsigned char *data;
-
-	/* Create OpenGL buffer */
-	glGenTextures(1, &image->texture);
-	glBindTexture(GL_TEXTURE_2D, image->texture);
-
-	/* Load image using stb_image.
-	 * TODO: we can use the best/fastest image loader by checking the type from
-	 * initData.type */
-	data = stbi_load(initData->path, &width, &height, &nrChannels, 0);
-
-	image->height = height;
-	image->width = width;
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	stbi_image_free(data);
+void
+CGRequestRedraw(void) {
+	uint64_t value = 1;
 
-	return true;
+	if (wakeupFd != -1 && write(wakeupFd, &value, sizeof(value)) == -1
+		&& errno != EAGAIN)
+		perror("[CGRequestRedraw] write() failure");
 }
 
 void
-CGDeleteImage(struct CGImage *image) {
-	glDeleteTextures(1, &image->texture);
+CGDeleteMesh(struct CGMeshData *mesh) {
+	releaseBuffer(mesh->vbo, mesh->vboSize);
+	glDeleteVertexArrays(1, &mesh->vao);
 }
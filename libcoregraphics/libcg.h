@@ -43,13 +43,105 @@ extern "C" {
  */
 #include <GL/glew.h>
 
+#define CG_MAX_FRAMES_IN_FLIGHT 8
+#define CG_MAX_MIP_LEVELS 16
+
 enum CGShutdownReason {
 	CG_SR_DEBUG_ESCAPEKEY,
 };
 
+/* What video memory is used for, see CGGetMemoryUsage. */
+enum CGMemoryCategory {
+	CG_MC_TEXTURE,
+	CG_MC_VERTEX,
+	CG_MC_INDEX,
+	CG_MC_UNIFORM,
+	/* pixel pack and unpack buffers */
+	CG_MC_STAGING,
+	CG_MC_OTHER,
+};
+
+#define CG_MEMORY_CATEGORIES 6
+
 enum CGImageType {
 	CG_IT_JPEG,
 	CG_IT_PNG,
+	/* a compressed texture container, see CGTextureFileHeader */
+	CG_IT_CGT,
+};
+
+enum CGMipFilter {
+	/* 2x2 average, the fastest */
+	CG_MF_BOX,
+	/* Kaiser windowed sinc, sharper than box */
+	CG_MF_KAISER,
+	/* Lanczos-3, the sharpest, but may ring around hard edges */
+	CG_MF_LANCZOS,
+};
+
+/* Block compressed formats of the texture container. */
+enum CGTextureFormat {
+	/* BC1 (DXT1), RGB with 1-bit alpha, 8 bytes per 4x4 block */
+	CG_TF_BC1 = 1,
+	/* BC3 (DXT5), RGBA, 16 bytes per block */
+	CG_TF_BC3,
+	/* BC4 (RGTC1), one channel, 8 bytes per block */
+	CG_TF_BC4,
+	/* BC5 (RGTC2), two channels, 16 bytes per block */
+	CG_TF_BC5,
+};
+
+#define CG_TEXTURE_MAGIC "CGTX"
+#define CG_TEXTURE_VERSION 1
+
+/**
+ * The texture container (.cgt) written by texenc, with all values little
+ * endian. The header is followed by levelCount CGTextureFileLevels, which
+ * locate the blocks of each mipmap level from the largest to the smallest.
+ */
+struct CGTextureFileHeader {
+	char		 magic[4];
+	uint32_t	 version;
+	/* an enum CGTextureFormat */
+	uint32_t	 format;
+	uint32_t	 width;
+	uint32_t	 height;
+	uint32_t	 levelCount;
+};
+
+struct CGTextureFileLevel {
+	/* from the start of the file */
+	uint32_t	 offset;
+	uint32_t	 size;
+};
+
+enum CGAssetType {
+	CG_AT_SHADER,
+	CG_AT_MESH,
+	CG_AT_IMAGE,
+	/* loaded by the functions of the asset, like a material that looks up
+	 * the uniforms of its shader */
+	CG_AT_CUSTOM,
+};
+
+/* How the data of a file view will be read, see CGMapFile. */
+enum CGFileAccess {
+	/* once from front to back, like decoders do */
+	CG_FA_SEQUENTIAL,
+	/* in parts, at some later time, like levels that are streamed in */
+	CG_FA_DEFERRED,
+};
+
+/**
+ * The contents of a file, either mapped or read into memory. The data isn't
+ * NUL-terminated, but never NULL unless opening the file failed, even when
+ * it's empty.
+ */
+struct CGFileView {
+	const unsigned char *data;
+	size_t		 size;
+	/* whether data is a mapping rather than allocated memory */
+	bool		 mapped;
 };
 
 struct CGShaderInitData {
@@ -76,23 +168,414 @@ struct CGMeshData {
 	GLuint		 vao;
 	GLuint		 vbo;
 	GLsizei		 count;
+	/* of the buffer, which is larger if it was recycled */
+	GLsizeiptr	 vboSize;
 };
 
+/*
+ * Handles of the images, meshes and shaders libcg keeps in its pools, see
+ * CGCreateImage. Zero is never a valid handle.
+ */
+typedef uint32_t CGImageHandle;
+typedef uint32_t CGMeshHandle;
+typedef uint32_t CGShaderHandle;
+
+/* An upload performed by the loader thread, see CGQueueTextureUpload. */
+struct CGUpload;
+
+/* The decoded pixels of an image with levels left to stream in. */
+struct CGImagePixels;
+
 struct CGImage {
+	/* of the texture, which may be smaller than the file, see
+	 * CGSetTextureQuality */
 	size_t		 height;
 	GLuint		 texture;
 	size_t		 width;
+	size_t		 sourceHeight;
+	size_t		 sourceWidth;
+	/* channels of the source image, the texture always samples as RGBA */
+	int		 channels;
+	GLint		 internalFormat;
+	int		 levelCount;
+	/* bytes of video memory taken by the resident levels */
+	size_t		 residentSize;
+	/* bytes of the texture budget held for the levels down from wantedLevel,
+	 * whether they're resident yet or not */
+	size_t		 committedSize;
+	/* the finest level that can be sampled, levelCount if none can yet */
+	int		 residentLevel;
+	/* the finest level to stream in, see CGSetImageScreenSize */
+	int		 wantedLevel;
+	int		 priority;
+	/* pending asynchronous uploads per level */
+	struct CGUpload	*uploads[CG_MAX_MIP_LEVELS];
+	struct CGImagePixels *pixels;
+	/* the minimum LOD, which fades to zero after a level became resident */
+	float		 lodFade;
+	struct CGImage	*nextStreaming;
+};
+
+/**
+ * Limits applied when images are loaded, by leaving out the largest mipmap
+ * levels. Zero means unlimited.
+ */
+struct CGTextureQuality {
+	/* the largest width or height a texture may have */
+	int		 maxDimension;
+	/* the number of levels always left out */
+	int		 mipBias;
+	/* the video memory all images together may take, in bytes */
+	size_t		 budget;
 };
 
 struct CGImageInitData {
 	const char	*path;
 	enum CGImageType type;
+	/* upload on the loader thread, see CGIsImageReady */
+	bool		 async;
+	/* multiply the color channels with alpha before uploading */
+	bool		 premultiplyAlpha;
+	enum CGMipFilter mipFilter;
+	/* filter the color channels in linear space, for sRGB images */
+	bool		 gammaCorrectMips;
+};
+
+struct CGMipLevel {
+	unsigned char	*pixels;
+	int		 width;
+	int		 height;
+};
+
+struct CGMipChain {
+	int		 channels;
+	int		 levelCount;
+	struct CGMipLevel levels[CG_MAX_MIP_LEVELS];
+	/* holds every level except the first */
+	unsigned char	*storage;
+};
+
+/**
+ * An image decoding backend, see CGRegisterImageDecoder.
+ */
+struct CGImageDecoder {
+	const char	*name;
+	enum CGImageType type;
+	/* decoders with a higher priority are tried first */
+	int		 priority;
+	/**
+	 * Decodes the data into 8-bit pixels with desiredChannels channels, or the
+	 * number of channels of the image if it's zero, and stores the channel
+	 * count of the result in channels. Returns NULL if this decoder can't
+	 * handle the data, so the next one is tried. Must be thread-safe.
+	 */
+	unsigned char	*(*decode)(const unsigned char *data, size_t size,
+							   int *width, int *height, int *channels,
+							   int desiredChannels);
+	void		(*free)(unsigned char *pixels);
+	/**
+	 * Optional, used by CGDecodeImageInto. Reads the size and channel count
+	 * from the header of the data without decoding it.
+	 */
+	bool		(*info)(const unsigned char *data, size_t size, int *width,
+							int *height, int *channels);
+	/**
+	 * Optional, decodes into width * height * channels bytes of memory that
+	 * belongs to the caller.
+	 */
+	bool		(*decodeInto)(const unsigned char *data, size_t size,
+								  unsigned char *pixels, int width, int height,
+								  int channels);
+};
+
+/**
+ * Returns the memory CGDecodeImageInto decodes into, or NULL to cancel. The
+ * channel count of the image may be changed to the one the pixels should have.
+ */
+typedef unsigned char *(*CGImageAllocateFunc)(int width, int height,
+											  int *channels, void *user);
+
+/* Called once the loader thread no longer needs the source data. */
+typedef void (*CGUploadReleaseFunc)(void *data, void *user);
+
+struct CGTextureUploadInfo {
+	GLuint		 texture;
+	GLint		 level;
+	GLint		 internalFormat;
+	GLsizei		 width;
+	GLsizei		 height;
+	GLenum		 format;
+	GLenum		 type;
+	const void	*pixels;
+	/* if nonzero, the pixels are this many bytes in the compressed
+	 * internalFormat, and format and type are ignored */
+	GLsizei		 compressedSize;
+	bool		 generateMipmap;
+	/* higher priorities are uploaded first */
+	int		 priority;
+	CGUploadReleaseFunc release;
+	void		*user;
+};
+
+struct CGBufferUploadInfo {
+	GLuint		 buffer;
+	GLenum		 target;
+	/* where data is written to, must be zero when usage is set */
+	GLintptr	 offset;
+	GLsizeiptr	 size;
+	const void	*data;
+	/* if nonzero, the storage is (re)allocated first with glBufferData */
+	GLenum		 usage;
+	/* higher priorities are uploaded first */
+	int		 priority;
+	CGUploadReleaseFunc release;
+	void		*user;
+};
+
+/**
+ * The OpenGL context CGInitialize should create. When GLX_ARB_create_context
+ * isn't available, libcg falls back to a legacy context and these are ignored.
+ */
+struct CGContextConfig {
+	int		 majorVersion;
+	int		 minorVersion;
+	bool		 coreProfile;
+	/* create a debug context and print its messages to stderr */
+	bool		 debug;
+	/* disable error checking in the driver, ignored for debug contexts */
+	bool		 noError;
+};
+
+/**
+ * What libcg reports about startup, which lasts until CGStart has presented
+ * the first frame. Meanwhile, every stage of CGInitialize and every asset that
+ * is read, decoded, compiled or uploaded is recorded as a timed span.
+ */
+struct CGStartupProfile {
+	/* print the time per stage and the slowest spans */
+	bool		 report;
+	/* where to write the spans as a Chrome trace (chrome://tracing), or NULL
+	 * to not write one */
+	const char	*tracePath;
+};
+
+/**
+ * A zone of the trace on the calling thread, see CG_ZONE.
+ */
+struct CGTraceZone {
+	/* NULL if the zone isn't recorded */
+	const char	*name;
+	uint64_t	 start;
+};
+
+/**
+ * A zone of the trace on the GPU, see CG_GPU_ZONE.
+ */
+struct CGGPUTraceZone {
+	/* -1 if the zone isn't recorded */
+	int		 index;
+};
+
+/*
+ * Traces the rest of the enclosing block as a zone, named by a string that
+ * outlives the trace, like a literal. While tracing is disabled a zone costs
+ * two calls that return right away; defining CG_NO_TRACE compiles them out.
+ * GPU zones time the commands issued in the block with timer queries, and may
+ * only be used on the render thread.
+ */
+#ifdef CG_NO_TRACE
+#define CG_ZONE(name)		do { } while (0)
+#define CG_FUNCTION_ZONE()	do { } while (0)
+#define CG_GPU_ZONE(name)	do { } while (0)
+#else
+#define CG_ZONE_VARIABLE_(prefix, line) prefix##line
+#define CG_ZONE_VARIABLE(prefix, line) CG_ZONE_VARIABLE_(prefix, line)
+#define CG_ZONE(name) \
+	struct CGTraceZone CG_ZONE_VARIABLE(cgZone, __LINE__) \
+		__attribute__((cleanup(CGEndTraceZone))) = CGBeginTraceZone(name)
+#define CG_FUNCTION_ZONE() CG_ZONE(__func__)
+#define CG_GPU_ZONE(name) \
+	struct CGGPUTraceZone CG_ZONE_VARIABLE(cgGPUZone, __LINE__) \
+		__attribute__((cleanup(CGEndGPUTraceZone))) \
+		= CGBeginGPUTraceZone(name)
+#endif
+
+/**
+ * When CGStart considers a frame a hitch, and how it captures the trace that
+ * led up to it. Frame times are the time between the starts of two frames.
+ */
+struct CGHitchConfig {
+	/* frames taking longer than this many seconds are hitches, 0 to ignore */
+	double		 threshold;
+	/* frames taking longer than this multiple of the median of the recent
+	 * frames are hitches, 0 to ignore */
+	double		 medianFactor;
+	/* how many seconds of trace before the hitch are captured */
+	double		 window;
+	/* where captures are written, as hitch-<frame index>.json */
+	const char	*directory;
+	/* the number of captures after which hitches are only reported */
+	unsigned int	 maxCaptures;
+};
+
+/**
+ * Timing information about the most recently completed frame. All durations
+ * are in seconds.
+ */
+struct CGFrameTelemetry {
+	uint64_t	 frameIndex;
+	double		 frameTime;
+	/* time CGStart blocked on the fence of the oldest in-flight frame */
+	double		 fenceWaitTime;
+	unsigned int	 framesInFlight;
+	/* what the loader thread uploaded since the previous frame began */
+	size_t		 uploadBytes;
+	double		 uploadTime;
+};
+
+/**
+ * What the render thread asked of OpenGL during a frame, as counted by the
+ * wrapped entry points (see CG_GL_WRAP). Durations are in seconds.
+ */
+struct CGRenderStats {
+	unsigned int	 drawCalls;
+	uint64_t	 triangles;
+	unsigned int	 programBinds;
+	unsigned int	 textureBinds;
+	/* bytes passed to glBufferData and glBufferSubData */
+	size_t		 bufferUploadBytes;
+	/* binds of vertex arrays and framebuffers and other state changes */
+	unsigned int	 stateChanges;
+	/* time spent in the render function */
+	double		 renderTime;
+	/* time spent in glXSwapBuffers */
+	double		 swapTime;
+};
+
+/**
+ * What hardware performance counters counted during a frame, in user space.
+ */
+struct CGPerfCounters {
+	uint64_t	 cycles;
+	uint64_t	 instructions;
+	uint64_t	 cacheMisses;
+	uint64_t	 branchMisses;
+};
+
+/**
+ * How the frame arena of a thread was used. Except for the high water mark,
+ * these describe the last frame that ended.
+ */
+struct CGFrameArenaStats {
+	/* bytes of each of the two buffers */
+	size_t		 capacity;
+	/* bytes allocated during the frame, including those that overflowed */
+	size_t		 used;
+	/* the most bytes allocated during any frame */
+	size_t		 highWater;
+	/* allocations that didn't fit and came from the heap instead */
+	unsigned int	 overflowCount;
+	size_t		 overflowBytes;
+};
+
+/**
+ * The heap allocator libcg and stb_image allocate through, with the semantics
+ * of malloc, realloc and free, and called from any thread. The user pointer is
+ * passed to every function.
+ */
+struct CGAllocator {
+	void		*(*allocate)(void *user, size_t size);
+	void		*(*reallocate)(void *user, void *pointer, size_t size);
+	void		 (*release)(void *user, void *pointer);
+	void		*user;
 };
 
+/**
+ * What was allocated through the tracking allocator. A reallocation counts as
+ * a release and an allocation.
+ */
+struct CGAllocationStats {
+	/* bytes and blocks allocated right now */
+	size_t		 bytes;
+	size_t		 allocations;
+	/* the most bytes allocated at once */
+	size_t		 peakBytes;
+	/* blocks allocated so far */
+	uint64_t	 totalAllocations;
+};
+
+/**
+ * The video memory of a category, or of all together, as far as libcg tracks
+ * it: the buffers specified through glBufferData and glBufferStorage, and the
+ * textures of images and of the overlay.
+ */
+struct CGMemoryUsage {
+	size_t		 bytes;
+	/* the most bytes in use at any time */
+	size_t		 highWater;
+	unsigned int	 objects;
+};
+
+/* Called when a category goes over its budget, see CGSetMemoryBudget. */
+typedef void (*CGMemoryBudgetFunc)(enum CGMemoryCategory, size_t bytes,
+								   size_t budget);
+
 /* float parameter is the delta time */
 typedef bool (*CGRenderFunc)(float);
 typedef void (*CGShutdownFunc)(void);
 
+struct CGAsset;
+
+typedef bool (*CGAssetLoadFunc)(struct CGAsset *);
+typedef void (*CGAssetUnloadFunc)(struct CGAsset *);
+
+/**
+ * An entry of the manifest loaded by CGLoadAssets.
+ */
+struct CGAsset {
+	const char	*name;
+	enum CGAssetType type;
+	/* the CGShaderData, CGMeshData or CGImage to load into */
+	void		*data;
+	/* the matching CGShaderInitData, CGMeshInitData or CGImageInitData */
+	void		*initData;
+	/* names of the assets that must be loaded first, NULL-terminated */
+	const char	**dependencies;
+	/* of custom assets, called on the render thread */
+	CGAssetLoadFunc	 load;
+	CGAssetUnloadFunc unload;
+
+	/* The results, set by CGLoadAssets. */
+	bool		 loaded;
+	/* why the asset wasn't loaded, NULL if it was */
+	const char	*failure;
+	/* seconds spent reading and decoding on the worker threads */
+	double		 decodeTime;
+	/* seconds spent creating the OpenGL objects on the render thread */
+	double		 createTime;
+};
+
+/**
+ * Begins a zone of the trace on the calling thread, which must be ended with
+ * CGEndTraceZone on the same thread. CG_ZONE does both.
+ */
+struct CGTraceZone
+CGBeginTraceZone(const char *name);
+
+/**
+ * Begins a zone of the trace on the GPU, which must be ended with
+ * CGEndGPUTraceZone before the frame is presented. CG_GPU_ZONE does both.
+ * Needs ARB_timer_query, and must be called from the render thread.
+ */
+struct CGGPUTraceZone
+CGBeginGPUTraceZone(const char *name);
+
+void
+CGEndGPUTraceZone(struct CGGPUTraceZone *);
+
+void
+CGEndTraceZone(struct CGTraceZone *);
+
 /**
  * After CGInitialize the program may do some initialization work that can fail
  * before CGStart. Call this function to cleanup data generated by CGInitialize
@@ -100,6 +583,43 @@ typedef void (*CGShutdownFunc)(void);
 void
 CGCleanError(void);
 
+/**
+ * Loads an image into a slot of the image pool, which libcg owns, and returns
+ * its handle, or zero on failure. Like the other functions of the pools, this
+ * must be called from the render thread. What's left in the pools is deleted
+ * by CGCleanError.
+ */
+CGImageHandle
+CGCreateImage(struct CGImageInitData *);
+
+CGMeshHandle
+CGCreateMesh(struct CGMeshInitData *);
+
+CGShaderHandle
+CGCreateShader(struct CGShaderInitData *);
+
+/**
+ * Decodes an image with the best decoder available for its type, which is
+ * detected from the data, or taken from the hint if detection fails. The
+ * result must be released with the free function of the decoder that's
+ * stored in usedDecoder. Returns NULL if every decoder failed.
+ */
+unsigned char *
+CGDecodeImage(const unsigned char *data, size_t size, enum CGImageType hint,
+			  int *width, int *height, int *channels, int desiredChannels,
+			  const struct CGImageDecoder **usedDecoder);
+
+/**
+ * Decodes an image into memory returned by the allocate function, which is
+ * called at most once, with the size read from the header. Only decoders with
+ * info and decodeInto functions are used. Returns false if none of them could
+ * decode the data; the caller then still owns whatever it allocated.
+ */
+bool
+CGDecodeImageInto(const unsigned char *data, size_t size,
+				  enum CGImageType hint, CGImageAllocateFunc allocate,
+				  void *user, int *width, int *height, int *channels);
+
 void
 CGDeleteImage(struct CGImage *);
 
@@ -109,25 +629,422 @@ CGDeleteMesh(struct CGMeshData *);
 void
 CGDeleteShader(struct CGShaderData *);
 
+/**
+ * Deletes a resource created with its handle and frees its slot, after which
+ * the handle is stale. Stale handles are reported on stderr and ignored.
+ */
+void
+CGDestroyImage(CGImageHandle);
+
+void
+CGDestroyMesh(CGMeshHandle);
+
+void
+CGDestroyShader(CGShaderHandle);
+
+/**
+ * Releases the levels of a chain made by CGGenerateMipChain. The first level
+ * belongs to the caller and isn't freed.
+ */
+void
+CGFreeMipChain(struct CGMipChain *);
+
+/**
+ * Releases an upload returned by CGQueueTextureUpload or CGQueueBufferUpload,
+ * waiting for it first if it hasn't completed yet.
+ */
+void
+CGFreeUpload(struct CGUpload *);
+
+/**
+ * Detects the type of an encoded image from its signature.
+ */
+bool
+CGDetectImageType(const unsigned char *data, size_t size,
+				  enum CGImageType *);
+
+/**
+ * Generates the full mipmap chain of 8-bit pixels on the worker threads. The
+ * first level of the chain refers to the given pixels, the others are
+ * allocated and must be released with CGFreeMipChain.
+ */
+bool
+CGGenerateMipChain(struct CGMipChain *, unsigned char *pixels, int width,
+				   int height, int channels, enum CGMipFilter filter,
+				   bool gammaCorrect);
+
+/**
+ * Allocates transient memory from the frame arena of the calling thread, at
+ * the cost of bumping a pointer. The memory stays valid until the end of the
+ * frame after the one it was allocated in, as counted by CGStart, so the
+ * render thread can hand it to other threads for one frame. It's never freed
+ * individually. Allocations that don't fit the arena still succeed through
+ * the heap, and the first time that happens it's reported on stderr. Returns
+ * NULL if even that fails.
+ */
+void *
+CGFrameAlloc(size_t size);
+
+/**
+ * Like CGFrameAlloc, with an alignment that's a power of two.
+ */
+void *
+CGFrameAllocAligned(size_t size, size_t alignment);
+
+/**
+ * Copies the statistics of the frame arena of the calling thread. Returns
+ * false if the thread never allocated from it.
+ */
+bool
+CGGetFrameArenaStats(struct CGFrameArenaStats *);
+
+/**
+ * Copies what was allocated through the tracking allocator.
+ */
+void
+CGGetAllocationStats(struct CGAllocationStats *);
+
+/**
+ * Returns an allocator that uses malloc and counts what it allocates, see
+ * CGGetAllocationStats.
+ */
+const struct CGAllocator *
+CGGetTrackingAllocator(void);
+
+/**
+ * Returns the resource of a handle, or NULL if the handle is stale. Resources
+ * are never moved, so the pointer stays valid until the resource is destroyed.
+ */
+struct CGImage *
+CGGetImage(CGImageHandle);
+
+struct CGMeshData *
+CGGetMesh(CGMeshHandle);
+
+struct CGShaderData *
+CGGetShader(CGShaderHandle);
+
+/**
+ * Returns the handles of every resource in a pool as a dense array, to
+ * iterate over them. The array is valid until the next resource of its type is
+ * created or destroyed, which may reorder it.
+ */
+const CGImageHandle *
+CGGetImageHandles(size_t *count);
+
+const CGMeshHandle *
+CGGetMeshHandles(size_t *count);
+
+const CGShaderHandle *
+CGGetShaderHandles(size_t *count);
+
+/**
+ * Copies the telemetry of the last completed frame into the given structure.
+ * Returns false if no frame has been completed yet.
+ */
+bool
+CGGetFrameTelemetry(struct CGFrameTelemetry *);
+
+/**
+ * Copies the video memory usage of every category and their total, either of
+ * which may be NULL. May be called from any thread.
+ */
+void
+CGGetMemoryUsage(struct CGMemoryUsage categories[CG_MEMORY_CATEGORIES],
+				 struct CGMemoryUsage *total);
+
+/**
+ * A lowercase name for a category, or NULL if it doesn't exist.
+ */
+const char *
+CGGetMemoryCategoryName(enum CGMemoryCategory);
+
+/**
+ * Copies what the hardware counters of the render thread and of all worker
+ * threads together counted during the last completed frame, either of which
+ * may be NULL. Returns false if the counters aren't enabled or available, or
+ * no frame has been completed since. Must be called from the render thread.
+ */
+bool
+CGGetPerfCounters(struct CGPerfCounters *render,
+				  struct CGPerfCounters *workers);
+
+/**
+ * Copies the render statistics of the last completed frame, and their average
+ * over the last 60 frames, into the given structures, either of which may be
+ * NULL. Returns false if no frame has been completed yet. Must be called from
+ * the render thread.
+ */
+bool
+CGGetRenderStats(struct CGRenderStats *last, struct CGRenderStats *average);
+
+/**
+ * The video memory taken by the buffers and textures kept for reuse, see
+ * CGSetRecycleBudget.
+ */
+size_t
+CGGetRecycledMemory(void);
+
+/**
+ * The video memory taken by the textures of all loaded images, in bytes.
+ */
+size_t
+CGGetTextureMemoryUsage(void);
+
+/**
+ * The number of levels of a full mipmap chain, down to 1x1.
+ */
+int
+CGGetMipLevelCount(int width, int height);
+
+/**
+ * Enumerates the registered image decoders, including the built-in ones.
+ * Returns NULL if the index is out of range.
+ */
+const struct CGImageDecoder *
+CGGetImageDecoder(size_t index);
+
+size_t
+CGGetImageDecoderCount(void);
+
+/**
+ * Returns whether the texture of an image loaded with the async flag has at
+ * least one level resident, in which case the image may be used for
+ * rendering. Finer levels are streamed in by CGStart. Always true for
+ * synchronously loaded images.
+ */
+bool
+CGIsImageReady(struct CGImage *);
+
+/**
+ * Returns whether the GPU has finished the given upload, without blocking.
+ * Must be called from the render thread.
+ */
+bool
+CGIsUploadComplete(struct CGUpload *);
+
 /**
  * This function should be called before any other function of libcg, otherwise
- * undefined behavior may occur.
+ * undefined behavior may occur. It sets GL_UNPACK_ALIGNMENT to 1, which libcg
+ * relies on when it uploads textures, so programs must leave it at that.
  */
 bool
 CGInitialize(void);
 
+/**
+ * Sets the heap allocator, or NULL for malloc, which is the default. As memory
+ * must be released by the allocator it came from, this must be called before
+ * any other libcg function. The allocator is copied.
+ */
+void
+CGSetAllocator(const struct CGAllocator *);
+
+/**
+ * Sets the configuration of the OpenGL context. This must be called before
+ * CGInitialize. The default is a 3.3 core profile context, which is a debug
+ * context unless NDEBUG is defined and a no-error context otherwise.
+ */
+void
+CGSetContextConfig(const struct CGContextConfig *);
+
+/**
+ * Limits how many frames may be queued on the GPU before CGStart waits for the
+ * oldest one to finish. Zero disables throttling. The default is 2, and values
+ * above CG_MAX_FRAMES_IN_FLIGHT are clamped.
+ */
+void
+CGSetMaxFramesInFlight(unsigned int);
+
+/**
+ * Sets the size of each of the two buffers of the frame arenas created from
+ * now on, so it should be called before anything is allocated. With huge
+ * pages, the size is rounded up to 2 MiB and the buffers are mapped with
+ * MAP_HUGETLB if the system has huge pages reserved, and otherwise advised to
+ * use transparent huge pages. The default is 4 MiB without huge pages.
+ */
+void
+CGSetFrameArenaSize(size_t size, bool hugePages);
+
+/**
+ * Sets how much video memory a category may use before the budget function is
+ * called, zero meaning unlimited, which is the default. Going over the budget
+ * is reported once, until the category is back under it.
+ */
+void
+CGSetMemoryBudget(enum CGMemoryCategory, size_t bytes);
+
+/**
+ * Sets the function called when a category goes over its budget, on the
+ * thread that allocated, or NULL to print a warning on stderr instead.
+ */
+void
+CGSetMemoryBudgetFunc(CGMemoryBudgetFunc);
+
+/**
+ * Limits the video memory of the buffers and textures that CGDeleteMesh and
+ * CGDeleteImage keep for CGLoadMesh and CGLoadImage to reuse, instead of
+ * deleting them. Zero disables recycling. The default is 32 MiB.
+ */
+void
+CGSetRecycleBudget(size_t bytes);
+
+/**
+ * Sets the size of the scratch arenas created from now on, in which decoders
+ * keep their temporary memory, one per thread that decodes. The memory is only
+ * reserved, and pages are committed as they're used. What doesn't fit comes
+ * from the heap. The default is 64 MiB.
+ */
+void
+CGSetScratchArenaSize(size_t size);
+
+/**
+ * Marks the current frame as clean. Until something invalidates it again (an
+ * X event such as Expose or a key press, or CGRequestRedraw), CGStart stops
+ * rendering and sleeps on the X connection instead. The frame is dirty by
+ * default, so programs that never call this render continuously.
+ */
+void
+CGSetFrameClean(void);
+
+/**
+ * Sets how fast a pending image is uploaded relative to other uploads, so
+ * images that are visible can go first. Does nothing if it's already ready.
+ */
+void
+CGSetImagePriority(struct CGImage *, int priority);
+
+/**
+ * Tells how large an asynchronously loaded image is drawn, in pixels. Only the
+ * levels needed for that size are streamed in, and finer levels that are
+ * already resident are evicted while the image is still streaming. The
+ * priority of the image becomes its area on screen. Zero means off screen.
+ */
+void
+CGSetImageScreenSize(struct CGImage *, int width, int height);
+
+/**
+ * Wakes CGStart up and renders at least one more frame. Unlike the other
+ * functions of libcg, this may be called from any thread.
+ */
+void
+CGRequestRedraw(void);
+
+/**
+ * Prints the status and timing of every asset of a manifest.
+ */
+void
+CGPrintAssetReport(const struct CGAsset *, size_t count);
+
+/**
+ * Adds an image decoder. Decoders should be registered before images are
+ * loaded. Returns false if there's no room left in the registry.
+ */
+bool
+CGRegisterImageDecoder(const struct CGImageDecoder *);
+
 void
 CGSetRenderFunc(CGRenderFunc);
 
+/**
+ * Starts or stops recording zones, which is off by default. Every thread keeps
+ * its most recent zones, so a trace covers the last moments before it's
+ * written. May be called from any thread.
+ */
+void
+CGSetTracing(bool enabled);
+
 void
 CGSetShutdownFunc(CGShutdownFunc);
 
 /**
- * Notify libcg that the program should go in shutdown mode soon.
+ * Sets the size of the persistently mapped buffer images are decoded into, so
+ * their pixels reach the GPU without a copy. Zero disables it. Must be called
+ * before CGInitialize, the default is 64 MiB.
+ */
+void
+CGSetStagingBufferSize(size_t);
+
+/**
+ * Enables startup profiling, which is off by default. Must be called before
+ * CGInitialize to include it.
+ */
+void
+CGSetStartupProfile(const struct CGStartupProfile *);
+
+/**
+ * Names the calling thread in traces and the startup profile. The name must
+ * outlive the trace.
+ */
+void
+CGSetThreadName(const char *);
+
+/**
+ * Shows or hides the performance overlay, which F3 toggles as well. It shows
+ * the frame time and its history, the CPU and GPU time, the render statistics
+ * and the texture memory in use. Off by default. It's drawn after the render
+ * function, and leaves texture unit 0 active with no program, vertex array,
+ * array buffer or 2D texture bound.
+ */
+void
+CGSetHUDEnabled(bool);
+
+/**
+ * Sets how hitches are detected, or disables detection with NULL, which is the
+ * default. Detection enables tracing, which records the frame telemetry as
+ * counters, and every hitch is marked with a zone in the trace. The capture
+ * itself delays the next frame, so that one isn't considered.
+ */
+void
+CGSetHitchDetection(const struct CGHitchConfig *);
+
+/**
+ * Enables or disables the hardware performance counters of the render and
+ * worker threads, which CGStart samples every frame with perf_event_open.
+ * They're recorded as trace counters and shown by the overlay as well. Off by
+ * default; must be called from the render thread.
+ */
+void
+CGSetPerfCounters(bool enabled);
+
+/**
+ * Sets the quality policy for images loaded from now on. Images that would
+ * exceed the budget are loaded at a lower resolution, down to 1x1. The budget
+ * counts the levels an image will stream in as soon as it's loaded, and finer
+ * levels that are streamed in again after being evicted must fit as well.
+ */
+void
+CGSetTextureQuality(const struct CGTextureQuality *);
+
+/**
+ * Limits how many bytes the loader thread uploads per frame, and how much time
+ * it may spend doing so. Zero means unlimited. The default is 16 MiB and 4 ms.
+ * Uploads performed without a loader thread are not limited, and neither are
+ * those waited for with CGWaitForUpload.
+ */
+void
+CGSetUploadBudget(size_t bytes, double time);
+
+void
+CGSetUploadPriority(struct CGUpload *, int priority);
+
+/**
+ * Notify libcg that the program should go in shutdown mode soon. This may be
+ * called from any thread.
  */
 void
 CGSetShutdown(enum CGShutdownReason);
 
+/**
+ * Loads a manifest of assets at once. Shader sources are read in one batch
+ * and compiled while the images are decoded on the worker threads, after
+ * which the OpenGL objects are created in the order of the dependencies.
+ * Assets whose dependencies failed are skipped, but everything else is still
+ * loaded. Returns whether every asset was loaded; the others have their
+ * failure set and are reported on stderr.
+ */
+bool
+CGLoadAssets(struct CGAsset *, size_t count);
+
 bool
 CGLoadImage(struct CGImage *, struct CGImageInitData *);
 
@@ -137,9 +1054,261 @@ CGLoadMesh(struct CGMeshData *, struct CGMeshInitData *);
 bool
 CGLoadShader(struct CGShaderData *, struct CGShaderInitData *);
 
+/**
+ * Maps a file into memory, so it's read by the page cache without another
+ * copy. Sequential views are prefaulted before this returns, deferred ones are
+ * read ahead in the background. Files that can't be mapped are read instead.
+ * The view must be released with CGReleaseFileView. May be called from any
+ * thread.
+ */
+bool
+CGMapFile(struct CGFileView *, const char *path, enum CGFileAccess);
+
+/**
+ * Reads a batch of files into memory at once, with all reads in flight
+ * together through io_uring, or one after another with pread if that isn't
+ * available. Cheaper than mapping many small files. The data of views whose
+ * file couldn't be read is NULL, and the number of files that were read is
+ * returned. Every view must still be released with CGReleaseFileView. May be
+ * called from any thread.
+ */
+size_t
+CGReadFiles(struct CGFileView *views, const char *const *paths, size_t count);
+
+/**
+ * Releases a view made by CGMapFile or CGReadFiles, and resets it.
+ */
+void
+CGReleaseFileView(struct CGFileView *);
+
+/**
+ * Queues data to be uploaded to a buffer object by the loader thread, which
+ * runs a context sharing objects with the render thread. The data must stay
+ * valid until the release function has been called. The buffer must have been
+ * created with glGenBuffers on the render thread.
+ *
+ * Queued uploads are performed in order of priority, and are split into
+ * ranges so a frame never exceeds the budget set by CGSetUploadBudget.
+ */
+struct CGUpload *
+CGQueueBufferUpload(const struct CGBufferUploadInfo *);
+
+/**
+ * Queues a glTexImage2D upload of one level of a GL_TEXTURE_2D texture, in the
+ * same manner as CGQueueBufferUpload. The rows of the pixels must be tightly
+ * packed, since large levels are uploaded in bands of rows. When the loader
+ * thread finishes an upload it wakes up CGStart with CGRequestRedraw.
+ */
+struct CGUpload *
+CGQueueTextureUpload(const struct CGTextureUploadInfo *);
+
 int
 CGStart(void);
 
+/**
+ * Unloads the loaded assets of a manifest, dependents before their
+ * dependencies.
+ */
+void
+CGUnloadAssets(struct CGAsset *, size_t count);
+
+/**
+ * Records a value of a counter in the trace, which is drawn as a graph over
+ * time. The name must outlive the trace.
+ */
+void
+CGTraceCounter(const char *name, double value);
+
+/**
+ * Writes the zones every thread and the GPU still hold as a trace in the
+ * Chrome trace event format, which chrome://tracing and the Perfetto UI open.
+ * GPU zones are included once their frame has been presented and the GPU has
+ * reached them. May be called from any thread, even while tracing.
+ */
+bool
+CGWriteTrace(const char *path);
+
+/**
+ * Blocks until the given upload has completed on the GPU. Must be called from
+ * the render thread.
+ */
+void
+CGWaitForUpload(struct CGUpload *);
+
+/*
+ * The GL entry points that make up the render statistics are counted by these
+ * wrappers. A file that defines CG_GL_WRAP before including this header calls
+ * them in place of the real entry points, as libcg's own sources do; others
+ * can call them by name. Those that specify and delete buffers and textures
+ * account their video memory as well, finding the buffer from the bindings
+ * the wrappers saw.
+ *
+ * libcg only knows what went through the wrappers, so whatever a program
+ * calls directly is missing from CGGetRenderStats, from the buffer memory
+ * reported to the memory budget (a buffer bound directly is mistaken for the
+ * one bound last through a wrapper), and from the state the HUD puts back
+ * after drawing.
+ */
+void
+CGActiveTexture(GLenum unit);
+
+void
+CGBindBuffer(GLenum target, GLuint buffer);
+
+void
+CGBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+void
+CGBindBufferRange(GLenum target, GLuint index, GLuint buffer,
+				  GLintptr offset, GLsizeiptr size);
+
+void
+CGBindFramebuffer(GLenum target, GLuint framebuffer);
+
+void
+CGBindTexture(GLenum target, GLuint texture);
+
+void
+CGBindVertexArray(GLuint array);
+
+void
+CGBlendFunc(GLenum source, GLenum destination);
+
+void
+CGBlendFuncSeparate(GLenum sourceRGB, GLenum destinationRGB,
+					GLenum sourceAlpha, GLenum destinationAlpha);
+
+void
+CGBufferData(GLenum target, GLsizeiptr size, const void *data, GLenum usage);
+
+void
+CGBufferStorage(GLenum target, GLsizeiptr size, const void *data,
+				GLbitfield flags);
+
+void
+CGBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size,
+				const void *data);
+
+void
+CGCullFace(GLenum mode);
+
+void
+CGDeleteBuffers(GLsizei count, const GLuint *buffers);
+
+void
+CGDeleteTextures(GLsizei count, const GLuint *textures);
+
+void
+CGDepthFunc(GLenum func);
+
+void
+CGDepthMask(GLboolean flag);
+
+void
+CGDisable(GLenum capability);
+
+void
+CGDrawArrays(GLenum mode, GLint first, GLsizei count);
+
+void
+CGDrawArraysInstanced(GLenum mode, GLint first, GLsizei count,
+					  GLsizei instances);
+
+void
+CGDrawElements(GLenum mode, GLsizei count, GLenum type, const void *indices);
+
+void
+CGDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type,
+						const void *indices, GLsizei instances);
+
+void
+CGDrawRangeElements(GLenum mode, GLuint start, GLuint end, GLsizei count,
+					GLenum type, const void *indices);
+
+void
+CGEnable(GLenum capability);
+
+void
+CGScissor(GLint x, GLint y, GLsizei width, GLsizei height);
+
+void
+CGUseProgram(GLuint program);
+
+void
+CGViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+#ifdef CG_GL_WRAP
+/* GLEW defines most of them as macros already. */
+#undef glActiveTexture
+#undef glBindBuffer
+#undef glBindBufferBase
+#undef glBindBufferRange
+#undef glBindFramebuffer
+#undef glBindTexture
+#undef glBindVertexArray
+#undef glBlendFunc
+#undef glBlendFuncSeparate
+#undef glBufferData
+#undef glBufferStorage
+#undef glBufferSubData
+#undef glCullFace
+#undef glDeleteBuffers
+#undef glDeleteTextures
+#undef glDepthFunc
+#undef glDepthMask
+#undef glDisable
+#undef glDrawArrays
+#undef glDrawArraysInstanced
+#undef glDrawElements
+#undef glDrawElementsInstanced
+#undef glDrawRangeElements
+#undef glEnable
+#undef glScissor
+#undef glUseProgram
+#undef glViewport
+
+#define glActiveTexture(unit) CGActiveTexture(unit)
+#define glBindBuffer(target, buffer) CGBindBuffer(target, buffer)
+#define glBindBufferBase(target, index, buffer) \
+	CGBindBufferBase(target, index, buffer)
+#define glBindBufferRange(target, index, buffer, offset, size) \
+	CGBindBufferRange(target, index, buffer, offset, size)
+#define glBindFramebuffer(target, framebuffer) \
+	CGBindFramebuffer(target, framebuffer)
+#define glBindTexture(target, texture) CGBindTexture(target, texture)
+#define glBindVertexArray(array) CGBindVertexArray(array)
+#define glBlendFunc(source, destination) CGBlendFunc(source, destination)
+#define glBlendFuncSeparate(sourceRGB, destinationRGB, sourceAlpha, \
+							destinationAlpha) \
+	CGBlendFuncSeparate(sourceRGB, destinationRGB, sourceAlpha, \
+						destinationAlpha)
+#define glBufferData(target, size, data, usage) \
+	CGBufferData(target, size, data, usage)
+#define glBufferStorage(target, size, data, flags) \
+	CGBufferStorage(target, size, data, flags)
+#define glBufferSubData(target, offset, size, data) \
+	CGBufferSubData(target, offset, size, data)
+#define glCullFace(mode) CGCullFace(mode)
+#define glDeleteBuffers(count, buffers) CGDeleteBuffers(count, buffers)
+#define glDeleteTextures(count, textures) CGDeleteTextures(count, textures)
+#define glDepthFunc(func) CGDepthFunc(func)
+#define glDepthMask(flag) CGDepthMask(flag)
+#define glDisable(capability) CGDisable(capability)
+#define glDrawArrays(mode, first, count) CGDrawArrays(mode, first, count)
+#define glDrawArraysInstanced(mode, first, count, instances) \
+	CGDrawArraysInstanced(mode, first, count, instances)
+#define glDrawElements(mode, count, type, indices) \
+	CGDrawElements(mode, count, type, indices)
+#define glDrawElementsInstanced(mode, count, type, indices, instances) \
+	CGDrawElementsInstanced(mode, count, type, indices, instances)
+#define glDrawRangeElements(mode, start, end, count, type, indices) \
+	CGDrawRangeElements(mode, start, end, count, type, indices)
+#define glEnable(capability) CGEnable(capability)
+#define glScissor(x, y, width, height) CGScissor(x, y, width, height)
+#define glUseProgram(program) CGUseProgram(program)
+#define glViewport(x, y, width, height) CGViewport(x, y, width, height)
+#endif
+
 #ifdef __cplusplus
 }
 #endif
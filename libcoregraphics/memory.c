@@ -0,0 +1,409 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Video memory accounting. Every buffer and texture libcg allocates is
+ * tracked by its name, with its size and category: buffers through the
+ * wrapped glBufferData and glBufferStorage, by the target they were bound to
+ * as the wrappers saw it, and textures by the code that sizes them. The
+ * wrapped delete functions stop tracking them, so whatever is still tracked
+ * once CGCleanError has released everything of libcg was leaked.
+ */
+
+/* The wrappers call the real entry points. */
+#undef CG_GL_WRAP
+
+#include "libcg.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#define INITIAL_OBJECTS 256
+/* The number of leaked objects listed individually. */
+#define LISTED_LEAKS 32
+
+struct TrackedObject {
+	/* the name, with the highest bit set for textures, zero if unused */
+	uint64_t	 key;
+	enum CGMemoryCategory category;
+	size_t		 size;
+	const char	*label;
+};
+
+static const char *categoryNames[CG_MEMORY_CATEGORIES] = {
+	"texture", "vertex", "index", "uniform", "staging", "other"
+};
+
+static pthread_mutex_t memoryMutex = PTHREAD_MUTEX_INITIALIZER;
+/* An open addressing table, a power of two in size. */
+static struct TrackedObject *objects = NULL;
+static size_t objectCapacity = 0;
+static size_t objectCount = 0;
+static struct CGMemoryUsage usage[CG_MEMORY_CATEGORIES];
+static struct CGMemoryUsage totalUsage;
+static size_t budgets[CG_MEMORY_CATEGORIES];
+/* Whether a category is over its budget, so that's only reported once. */
+static bool overBudget[CG_MEMORY_CATEGORIES];
+static CGMemoryBudgetFunc budgetFunc = NULL;
+
+static uint64_t
+getKey(bool texture, GLuint name) {
+	return (texture ? UINT64_C(1) << 63 : 0) | ((uint64_t) name + 1);
+}
+
+static size_t
+getHome(uint64_t key, size_t capacity) {
+	return (size_t) ((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32)
+		 & (capacity - 1);
+}
+
+/**
+ * Returns the slot of a key, or the empty slot where it belongs. Needs the
+ * mutex and a table with at least one empty slot.
+ */
+static struct TrackedObject *
+findObject(uint64_t key) {
+	size_t index = getHome(key, objectCapacity);
+
+	while (objects[index].key != 0 && objects[index].key != key)
+		index = (index + 1) & (objectCapacity - 1);
+
+	return &objects[index];
+}
+
+/**
+ * Keeps the table at most half full. Needs the mutex.
+ */
+static bool
+reserveObject(void) {
+	struct TrackedObject *oldObjects = objects;
+	size_t oldCapacity = objectCapacity;
+	size_t capacity;
+	size_t i;
+
+	if ((objectCount + 1) * 2 <= objectCapacity)
+		return true;
+
+	capacity = objectCapacity > 0 ? objectCapacity * 2 : INITIAL_OBJECTS;
+	objects = cgCalloc(capacity, sizeof(struct TrackedObject));
+	if (objects == NULL) {
+		objects = oldObjects;
+		return false;
+	}
+
+	objectCapacity = capacity;
+	for (i = 0; i < oldCapacity; i++) {
+		if (oldObjects[i].key != 0)
+			*findObject(oldObjects[i].key) = oldObjects[i];
+	}
+
+	cgFree(oldObjects);
+	return true;
+}
+
+/**
+ * Empties a slot, moving the objects after it that were displaced from their
+ * home back, so lookups don't need tombstones. Needs the mutex.
+ */
+static void
+removeObject(struct TrackedObject *object) {
+	size_t hole = object - objects;
+	size_t index = hole;
+	size_t home;
+
+	for (;;) {
+		index = (index + 1) & (objectCapacity - 1);
+		if (objects[index].key == 0)
+			break;
+
+		/* Moves unless the home lies cyclically in (hole, index]. */
+		home = getHome(objects[index].key, objectCapacity);
+		if (((index - home) & (objectCapacity - 1))
+			>= ((index - hole) & (objectCapacity - 1))) {
+			objects[hole] = objects[index];
+			hole = index;
+		}
+	}
+
+	objects[hole].key = 0;
+	objectCount--;
+}
+
+static void
+addUsage(enum CGMemoryCategory category, size_t size, int objectDelta) {
+	usage[category].bytes += size;
+	usage[category].objects += objectDelta;
+	if (usage[category].bytes > usage[category].highWater)
+		usage[category].highWater = usage[category].bytes;
+
+	totalUsage.bytes += size;
+	totalUsage.objects += objectDelta;
+	if (totalUsage.bytes > totalUsage.highWater)
+		totalUsage.highWater = totalUsage.bytes;
+}
+
+static void
+subtractUsage(enum CGMemoryCategory category, size_t size, int objectDelta) {
+	usage[category].bytes -= size;
+	usage[category].objects -= objectDelta;
+	totalUsage.bytes -= size;
+	totalUsage.objects -= objectDelta;
+}
+
+/**
+ * Reports a category that went over its budget, once until it's back under.
+ */
+static void
+checkBudget(enum CGMemoryCategory category) {
+	CGMemoryBudgetFunc func;
+	size_t bytes;
+	size_t budget;
+	bool report;
+
+	pthread_mutex_lock(&memoryMutex);
+	bytes = usage[category].bytes;
+	budget = budgets[category];
+	report = budget != 0 && bytes > budget && !overBudget[category];
+	overBudget[category] = budget != 0 && bytes > budget;
+	func = budgetFunc;
+	pthread_mutex_unlock(&memoryMutex);
+
+	if (!report)
+		return;
+
+	if (func != NULL)
+		func(category, bytes, budget);
+	else
+		fprintf(stderr, "[CGMemory] %s memory is at %.1f MiB, over the "
+				"budget of %.1f MiB.\n", categoryNames[category],
+				bytes / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+}
+
+void
+trackGPUMemory(enum CGMemoryCategory category, GLuint name, size_t size,
+			   const char *label) {
+	struct TrackedObject *object;
+	uint64_t key = getKey(category == CG_MC_TEXTURE, name);
+
+	if (name == 0)
+		return;
+
+	pthread_mutex_lock(&memoryMutex);
+	if (!reserveObject()) {
+		pthread_mutex_unlock(&memoryMutex);
+		fputs("[CGMemory] Failed to track an object!\n", stderr);
+		return;
+	}
+
+	object = findObject(key);
+	if (object->key == key) {
+		subtractUsage(object->category, object->size, 1);
+	} else {
+		object->key = key;
+		objectCount++;
+	}
+
+	object->category = category;
+	object->size = size;
+	object->label = label;
+	addUsage(category, size, 1);
+	pthread_mutex_unlock(&memoryMutex);
+
+	checkBudget(category);
+}
+
+void
+untrackGPUMemory(bool texture, GLuint name) {
+	struct TrackedObject *object;
+
+	if (name == 0)
+		return;
+
+	pthread_mutex_lock(&memoryMutex);
+	if (objectCapacity > 0) {
+		object = findObject(getKey(texture, name));
+		if (object->key != 0) {
+			subtractUsage(object->category, object->size, 1);
+			removeObject(object);
+		}
+	}
+	pthread_mutex_unlock(&memoryMutex);
+}
+
+/* The categories of the buffer targets, by enum BufferTarget. */
+static const enum CGMemoryCategory bufferCategories[BUFFER_TARGETS] = {
+	[BT_ARRAY] = CG_MC_VERTEX,
+	[BT_ELEMENT_ARRAY] = CG_MC_INDEX,
+	[BT_UNIFORM] = CG_MC_UNIFORM,
+	[BT_PIXEL_UNPACK] = CG_MC_STAGING,
+	[BT_PIXEL_PACK] = CG_MC_STAGING,
+	[BT_COPY_READ] = CG_MC_OTHER,
+	[BT_COPY_WRITE] = CG_MC_OTHER,
+	[BT_TRANSFORM_FEEDBACK] = CG_MC_OTHER,
+};
+
+void
+trackBufferData(GLenum target, GLsizeiptr size) {
+	const struct GLState *state = getGLState();
+	int index = getBufferTarget(target);
+	GLint buffer;
+
+	if (index == -1)
+		return;
+
+	/* The element array binding belongs to the vertex array, so it's only
+	 * asked for when no element buffer was bound since the vertex array. */
+	if (index == BT_ELEMENT_ARRAY && !state->elementBufferKnown)
+		glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &buffer);
+	else
+		buffer = state->buffers[index];
+
+	trackGPUMemory(bufferCategories[index], buffer, size, NULL);
+}
+
+void
+CGBufferStorage(GLenum target, GLsizeiptr size, const void *data,
+				GLbitfield flags) {
+	glBufferStorage(target, size, data, flags);
+	trackBufferData(target, size);
+}
+
+void
+CGDeleteBuffers(GLsizei count, const GLuint *buffers) {
+	GLsizei i;
+
+	for (i = 0; i < count; i++) {
+		untrackGPUMemory(false, buffers[i]);
+		unbindDeletedBuffer(buffers[i]);
+	}
+	glDeleteBuffers(count, buffers);
+}
+
+void
+CGDeleteTextures(GLsizei count, const GLuint *textures) {
+	GLsizei i;
+
+	for (i = 0; i < count; i++) {
+		untrackGPUMemory(true, textures[i]);
+		unbindDeletedTexture(textures[i]);
+	}
+	glDeleteTextures(count, textures);
+}
+
+void
+CGGetMemoryUsage(struct CGMemoryUsage categories[CG_MEMORY_CATEGORIES],
+				 struct CGMemoryUsage *total) {
+	pthread_mutex_lock(&memoryMutex);
+	if (categories != NULL)
+		memcpy(categories, usage, sizeof(usage));
+	if (total != NULL)
+		*total = totalUsage;
+	pthread_mutex_unlock(&memoryMutex);
+}
+
+const char *
+CGGetMemoryCategoryName(enum CGMemoryCategory category) {
+	return (unsigned int) category < CG_MEMORY_CATEGORIES
+		 ? categoryNames[category] : NULL;
+}
+
+void
+CGSetMemoryBudget(enum CGMemoryCategory category, size_t bytes) {
+	if ((unsigned int) category >= CG_MEMORY_CATEGORIES)
+		return;
+
+	pthread_mutex_lock(&memoryMutex);
+	budgets[category] = bytes;
+	overBudget[category] = false;
+	pthread_mutex_unlock(&memoryMutex);
+
+	checkBudget(category);
+}
+
+void
+CGSetMemoryBudgetFunc(CGMemoryBudgetFunc func) {
+	pthread_mutex_lock(&memoryMutex);
+	budgetFunc = func;
+	pthread_mutex_unlock(&memoryMutex);
+}
+
+void
+reportGPULeaks(void) {
+	struct TrackedObject *object;
+	size_t listed = 0;
+	size_t i;
+
+	pthread_mutex_lock(&memoryMutex);
+	if (objectCount > 0) {
+		fprintf(stderr, "[CGCleanError] %zu buffers and textures taking "
+				"%.1f KiB were never deleted:\n", objectCount,
+				totalUsage.bytes / 1024.0);
+
+		for (i = 0; i < objectCapacity; i++) {
+			object = &objects[i];
+			if (object->key == 0)
+				continue;
+			if (listed++ == LISTED_LEAKS)
+				break;
+
+			if (object->key >> 63)
+				fputs("\ttexture", stderr);
+			else
+				fprintf(stderr, "\t%s buffer",
+						categoryNames[object->category]);
+			fprintf(stderr, " %u, %zu bytes%s%s\n",
+					(GLuint) ((object->key & ~(UINT64_C(1) << 63)) - 1),
+					object->size, object->label != NULL ? ", " : "",
+					object->label != NULL ? object->label : "");
+		}
+
+		if (objectCount > LISTED_LEAKS)
+			fprintf(stderr, "\tand %zu more\n", objectCount - LISTED_LEAKS);
+	}
+
+	/* They go with the context. */
+	cgFree(objects);
+	objects = NULL;
+	objectCapacity = 0;
+	objectCount = 0;
+	for (i = 0; i < CG_MEMORY_CATEGORIES; i++) {
+		usage[i].bytes = 0;
+		usage[i].objects = 0;
+	}
+	totalUsage.bytes = 0;
+	totalUsage.objects = 0;
+	pthread_mutex_unlock(&memoryMutex);
+}
@@ -0,0 +1,642 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Mipmap generation on the CPU. Levels are generated one after another from
+ * the previous level, and every level is split into bands of rows that are
+ * computed on the worker threads. Generating mipmaps here instead of with
+ * glGenerateMipmap keeps the work off the render thread, and makes the result
+ * the same on every driver.
+ *
+ * The box filter has SSE2 and AVX2 kernels for four channel images. The other
+ * filters are separable windowed sinc filters, computed in floating point.
+ */
+
+#include "libcg.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CG_MIPMAP_X86
+#include <immintrin.h>
+#endif
+
+#include "internal.h"
+
+#define ROWS_PER_BAND 16
+#define MAX_TAPS 24
+
+/* The radius of the windowed sinc filters, in destination pixels. */
+#define FILTER_RADIUS 3.0
+#define KAISER_BETA 4.0
+
+struct FilterTaps {
+	int		 first;
+	int		 count;
+	float		 weights[MAX_TAPS];
+};
+
+struct LevelJob {
+	const struct CGMipLevel *source;
+	struct CGMipLevel *destination;
+	int		 channels;
+	enum CGMipFilter filter;
+	bool		 gammaCorrect;
+	/* separable filters only */
+	struct FilterTaps *horizontalTaps;
+	struct FilterTaps *verticalTaps;
+	/* the horizontally filtered rows, destination width by source height */
+	float		*intermediate;
+};
+
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+static float srgbToLinear[256];
+static unsigned char linearToSRGB[4096];
+
+static void
+buildTables(void) {
+	double value;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		value = i / 255.0;
+		srgbToLinear[i] = value <= 0.04045 ? value / 12.92
+						: pow((value + 0.055) / 1.055, 2.4);
+	}
+
+	for (i = 0; i < 4096; i++) {
+		value = (i + 0.5) / 4096.0;
+		value = value <= 0.0031308 ? value * 12.92
+			  : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+		linearToSRGB[i] = (unsigned char) (value * 255.0 + 0.5);
+	}
+}
+
+static inline unsigned char
+encodeLinear(float value) {
+	int index = (int) (value * 4096.0f);
+
+	if (index < 0)
+		index = 0;
+	else if (index > 4095)
+		index = 4095;
+
+	return linearToSRGB[index];
+}
+
+static inline unsigned char
+clampByte(float value) {
+	if (value <= 0.0f)
+		return 0;
+	if (value >= 255.0f)
+		return 255;
+	return (unsigned char) (value + 0.5f);
+}
+
+/**
+ * Whether the channel holds color, as opposed to alpha, which is always
+ * filtered linearly.
+ */
+static inline bool
+isColorChannel(int channel, int channels) {
+	return channels == 1 || channels == 3 || (channel < channels - 1);
+}
+
+static void
+boxRowScalar(const unsigned char *row0, const unsigned char *row1,
+			 unsigned char *out, int sourceWidth, int first, int last,
+			 int channels) {
+	int x;
+	int x0;
+	int x1;
+	int c;
+
+	for (x = first; x < last; x++) {
+		x0 = x * 2;
+		x1 = x0 + 1 < sourceWidth ? x0 + 1 : x0;
+		for (c = 0; c < channels; c++) {
+			out[x * channels + c] = (row0[x0 * channels + c]
+								   + row0[x1 * channels + c]
+								   + row1[x0 * channels + c]
+								   + row1[x1 * channels + c] + 2) >> 2;
+		}
+	}
+}
+
+#ifdef CG_MIPMAP_X86
+/**
+ * Averages the four channel pixels, producing four pixels per iteration.
+ * Returns the number of pixels done.
+ */
+static int
+boxRowSSE2(const unsigned char *row0, const unsigned char *row1,
+		   unsigned char *out, int pairs) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	__m128i a;
+	__m128i b;
+	__m128i low;
+	__m128i high;
+	__m128i result[2];
+	int x;
+	int half;
+
+	for (x = 0; x + 4 <= pairs; x += 4) {
+		for (half = 0; half < 2; half++) {
+			a = _mm_loadu_si128((const __m128i *) (row0 + x * 8 + half * 16));
+			b = _mm_loadu_si128((const __m128i *) (row1 + x * 8 + half * 16));
+
+			/* Vertical sums of pixels 0 and 1, and of 2 and 3. */
+			low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+								_mm_unpacklo_epi8(b, zero));
+			high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+								 _mm_unpackhi_epi8(b, zero));
+
+			/* Add the neighbouring pixels together. */
+			low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+			high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+
+			result[half] = _mm_srli_epi16(_mm_add_epi16(
+					_mm_unpacklo_epi64(low, high), two), 2);
+		}
+
+		_mm_storeu_si128((__m128i *) (out + x * 4),
+						 _mm_packus_epi16(result[0], result[1]));
+	}
+
+	return x;
+}
+
+/**
+ * Like boxRowSSE2, but eight pixels per iteration. The bytes of two
+ * neighbouring pixels are interleaved per channel, so a multiply-add with
+ * ones sums the pairs.
+ */
+__attribute__((target("avx2")))
+static int
+boxRowAVX2(const unsigned char *row0, const unsigned char *row1,
+		   unsigned char *out, int pairs) {
+	const __m256i interleave = _mm256_setr_epi8(
+			0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+			0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+	const __m256i ones = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi16(2);
+	__m256i sums[2];
+	__m256i a;
+	__m256i b;
+	__m256i packed;
+	int x;
+	int half;
+
+	for (x = 0; x + 8 <= pairs; x += 8) {
+		for (half = 0; half < 2; half++) {
+			a = _mm256_loadu_si256((const __m256i *)
+								   (row0 + x * 8 + half * 32));
+			b = _mm256_loadu_si256((const __m256i *)
+								   (row1 + x * 8 + half * 32));
+
+			a = _mm256_maddubs_epi16(_mm256_shuffle_epi8(a, interleave),
+									 ones);
+			b = _mm256_maddubs_epi16(_mm256_shuffle_epi8(b, interleave),
+									 ones);
+			sums[half] = _mm256_srli_epi16(_mm256_add_epi16(
+					_mm256_add_epi16(a, b), two), 2);
+		}
+
+		/* packus works per 128-bit lane, so put the quadwords back in
+		 * order afterwards. */
+		packed = _mm256_packus_epi16(sums[0], sums[1]);
+		packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *) (out + x * 4), packed);
+	}
+
+	return x;
+}
+#endif /* CG_MIPMAP_X86 */
+
+static void
+boxRow(const unsigned char *row0, const unsigned char *row1,
+	   unsigned char *out, int sourceWidth, int width, int channels) {
+	/* Output pixels whose two source columns both exist. */
+	int pairs = sourceWidth / 2 < width ? sourceWidth / 2 : width;
+	int done = 0;
+
+#ifdef CG_MIPMAP_X86
+	if (channels == 4) {
+		if (__builtin_cpu_supports("avx2"))
+			done = boxRowAVX2(row0, row1, out, pairs);
+		done += boxRowSSE2(row0 + done * 8, row1 + done * 8, out + done * 4,
+						   pairs - done);
+	}
+#else
+	(void) pairs;
+#endif
+
+	boxRowScalar(row0, row1, out, sourceWidth, done, width, channels);
+}
+
+static void
+boxRowGamma(const unsigned char *row0, const unsigned char *row1,
+			unsigned char *out, int sourceWidth, int width, int channels) {
+	int x;
+	int x0;
+	int x1;
+	int c;
+	int i;
+	float sum;
+
+	for (x = 0; x < width; x++) {
+		x0 = x * 2 * channels;
+		x1 = x * 2 + 1 < sourceWidth ? x0 + channels : x0;
+		for (c = 0; c < channels; c++) {
+			i = x * channels + c;
+			if (!isColorChannel(c, channels)) {
+				out[i] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c]
+						+ row1[x1 + c] + 2) >> 2;
+				continue;
+			}
+
+			sum = srgbToLinear[row0[x0 + c]] + srgbToLinear[row0[x1 + c]]
+				+ srgbToLinear[row1[x0 + c]] + srgbToLinear[row1[x1 + c]];
+			out[i] = encodeLinear(sum * 0.25f);
+		}
+	}
+}
+
+static void
+boxBand(void *argument, size_t band) {
+	struct LevelJob *job = argument;
+	const struct CGMipLevel *source = job->source;
+	struct CGMipLevel *destination = job->destination;
+	size_t sourceStride = (size_t) source->width * job->channels;
+	size_t stride = (size_t) destination->width * job->channels;
+	const unsigned char *row0;
+	const unsigned char *row1;
+	int y;
+	int last;
+	CG_FUNCTION_ZONE();
+
+	y = band * ROWS_PER_BAND;
+	last = y + ROWS_PER_BAND;
+	if (last > destination->height)
+		last = destination->height;
+
+	for (; y < last; y++) {
+		row0 = source->pixels + (size_t) y * 2 * sourceStride;
+		row1 = y * 2 + 1 < source->height ? row0 + sourceStride : row0;
+
+		if (job->gammaCorrect)
+			boxRowGamma(row0, row1, destination->pixels + y * stride,
+						source->width, destination->width, job->channels);
+		else
+			boxRow(row0, row1, destination->pixels + y * stride,
+				   source->width, destination->width, job->channels);
+	}
+}
+
+static double
+sinc(double x) {
+	if (x == 0.0)
+		return 1.0;
+
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+/**
+ * The zeroth order modified Bessel function of the first kind.
+ */
+static double
+besselI0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+	int k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+
+	return sum;
+}
+
+static double
+evaluateFilter(enum CGMipFilter filter, double t) {
+	double ratio;
+
+	if (fabs(t) >= FILTER_RADIUS)
+		return 0.0;
+
+	if (filter == CG_MF_LANCZOS)
+		return sinc(t) * sinc(t / FILTER_RADIUS);
+
+	ratio = t / FILTER_RADIUS;
+	return sinc(t) * besselI0(KAISER_BETA * sqrt(1.0 - ratio * ratio))
+		 / besselI0(KAISER_BETA);
+}
+
+/**
+ * Computes the normalized weights of the source pixels for every destination
+ * pixel along one axis. Samples outside the image are clamped to the edge.
+ */
+static void
+computeTaps(struct FilterTaps *taps, int sourceSize, int size,
+			enum CGMipFilter filter) {
+	double scale = (double) sourceSize / size;
+	double center;
+	double sum;
+	int x;
+	int i;
+	int j;
+	int clamped;
+	int first;
+	int last;
+	float weight;
+
+	for (x = 0; x < size; x++) {
+		center = (x + 0.5) * scale;
+		first = (int) floor(center - FILTER_RADIUS * scale);
+		last = (int) ceil(center + FILTER_RADIUS * scale);
+		if (last - first > MAX_TAPS) {
+			first += (last - first - MAX_TAPS) / 2;
+			last = first + MAX_TAPS;
+		}
+
+		/* Taps are stored relative to taps->first, with the clamped edge
+		 * pixels folded into the first and last ones. */
+		taps[x].first = first < 0 ? 0 : first;
+		taps[x].count = (last < sourceSize ? last : sourceSize)
+					  - taps[x].first;
+		memset(taps[x].weights, 0, sizeof(taps[x].weights));
+
+		sum = 0.0;
+		for (i = first; i < last; i++) {
+			weight = evaluateFilter(filter, (i + 0.5 - center) / scale);
+			clamped = i < 0 ? 0 : (i >= sourceSize ? sourceSize - 1 : i);
+			j = clamped - taps[x].first;
+			taps[x].weights[j] += weight;
+			sum += weight;
+		}
+
+		for (j = 0; j < taps[x].count; j++)
+			taps[x].weights[j] /= sum;
+	}
+}
+
+static void
+horizontalBand(void *argument, size_t band) {
+	struct LevelJob *job = argument;
+	const struct CGMipLevel *source = job->source;
+	int width = job->destination->width;
+	int channels = job->channels;
+	const struct FilterTaps *taps;
+	const unsigned char *row;
+	float *out;
+	float sum;
+	int y;
+	int last;
+	int x;
+	int c;
+	int i;
+	CG_FUNCTION_ZONE();
+
+	y = band * ROWS_PER_BAND;
+	last = y + ROWS_PER_BAND;
+	if (last > source->height)
+		last = source->height;
+
+	for (; y < last; y++) {
+		row = source->pixels + (size_t) y * source->width * channels;
+		out = job->intermediate + (size_t) y * width * channels;
+
+		for (x = 0; x < width; x++) {
+			taps = &job->horizontalTaps[x];
+			for (c = 0; c < channels; c++) {
+				sum = 0.0f;
+				for (i = 0; i < taps->count; i++) {
+					if (job->gammaCorrect && isColorChannel(c, channels))
+						sum += taps->weights[i] * srgbToLinear[
+							row[(taps->first + i) * channels + c]];
+					else
+						sum += taps->weights[i]
+							 * row[(taps->first + i) * channels + c];
+				}
+				out[x * channels + c] = sum;
+			}
+		}
+	}
+}
+
+static void
+verticalBand(void *argument, size_t band) {
+	struct LevelJob *job = argument;
+	struct CGMipLevel *destination = job->destination;
+	size_t stride = (size_t) destination->width * job->channels;
+	const struct FilterTaps *taps;
+	unsigned char *out;
+	float sum;
+	int y;
+	int last;
+	size_t x;
+	int i;
+	CG_FUNCTION_ZONE();
+
+	y = band * ROWS_PER_BAND;
+	last = y + ROWS_PER_BAND;
+	if (last > destination->height)
+		last = destination->height;
+
+	for (; y < last; y++) {
+		taps = &job->verticalTaps[y];
+		out = destination->pixels + y * stride;
+
+		for (x = 0; x < stride; x++) {
+			sum = 0.0f;
+			for (i = 0; i < taps->count; i++)
+				sum += taps->weights[i]
+					 * job->intermediate[(taps->first + i) * stride + x];
+
+			if (job->gammaCorrect
+				&& isColorChannel(x % job->channels, job->channels))
+				out[x] = encodeLinear(sum);
+			else
+				out[x] = clampByte(sum);
+		}
+	}
+}
+
+static bool
+generateLevel(struct LevelJob *job) {
+	const struct CGMipLevel *source = job->source;
+	struct CGMipLevel *destination = job->destination;
+	size_t bands = (destination->height + ROWS_PER_BAND - 1) / ROWS_PER_BAND;
+	CG_FUNCTION_ZONE();
+
+	if (job->filter == CG_MF_BOX) {
+		runParallel(boxBand, job, bands);
+		return true;
+	}
+
+	job->horizontalTaps = cgMalloc(destination->width
+								   * sizeof(struct FilterTaps));
+	job->verticalTaps = cgMalloc(destination->height
+								 * sizeof(struct FilterTaps));
+	job->intermediate = cgMalloc((size_t) destination->width * source->height
+								 * job->channels * sizeof(float));
+	if (job->horizontalTaps == NULL || job->verticalTaps == NULL
+		|| job->intermediate == NULL) {
+		cgFree(job->horizontalTaps);
+		cgFree(job->verticalTaps);
+		cgFree(job->intermediate);
+		return false;
+	}
+
+	computeTaps(job->horizontalTaps, source->width, destination->width,
+				job->filter);
+	computeTaps(job->verticalTaps, source->height, destination->height,
+				job->filter);
+
+	runParallel(horizontalBand, job,
+				(source->height + ROWS_PER_BAND - 1) / ROWS_PER_BAND);
+	runParallel(verticalBand, job, bands);
+
+	cgFree(job->horizontalTaps);
+	cgFree(job->verticalTaps);
+	cgFree(job->intermediate);
+	return true;
+}
+
+int
+CGGetMipLevelCount(int width, int height) {
+	int count = 1;
+
+	while ((width > 1 || height > 1) && count < CG_MAX_MIP_LEVELS) {
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		count++;
+	}
+
+	return count;
+}
+
+size_t
+getMipStorageSize(int width, int height, int channels) {
+	size_t size = 0;
+	int levelCount = CGGetMipLevelCount(width, height);
+	int level;
+
+	for (level = 1; level < levelCount; level++) {
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		size += (size_t) width * height * channels;
+	}
+
+	return size;
+}
+
+bool
+generateMipChain(struct CGMipChain *chain, unsigned char *pixels, int width,
+				 int height, int channels, enum CGMipFilter filter,
+				 bool gammaCorrect, unsigned char *storage) {
+	struct LevelJob job;
+	size_t storageSize;
+	unsigned char *position;
+	int level;
+
+	pthread_once(&tablesOnce, buildTables);
+
+	memset(chain, 0, sizeof(*chain));
+	chain->channels = channels;
+	chain->levelCount = CGGetMipLevelCount(width, height);
+
+	/* Only storage allocated here is owned by the chain. */
+	storageSize = getMipStorageSize(width, height, channels);
+	if (storage == NULL && storageSize > 0) {
+		chain->storage = cgMalloc(storageSize);
+		if (chain->storage == NULL) {
+			fputs("[CGGenerateMipChain] Failed to allocate levels!\n",
+				  stderr);
+			return false;
+		}
+		storage = chain->storage;
+	}
+
+	chain->levels[0].pixels = pixels;
+	chain->levels[0].width = width;
+	chain->levels[0].height = height;
+
+	position = storage;
+	for (level = 1; level < chain->levelCount; level++) {
+		chain->levels[level].width = chain->levels[level - 1].width > 1
+								   ? chain->levels[level - 1].width / 2 : 1;
+		chain->levels[level].height = chain->levels[level - 1].height > 1
+									? chain->levels[level - 1].height / 2 : 1;
+		chain->levels[level].pixels = position;
+		position += (size_t) chain->levels[level].width
+				  * chain->levels[level].height * channels;
+
+		job.source = &chain->levels[level - 1];
+		job.destination = &chain->levels[level];
+		job.channels = channels;
+		job.filter = filter;
+		job.gammaCorrect = gammaCorrect;
+
+		if (!generateLevel(&job)) {
+			fputs("[CGGenerateMipChain] Failed to allocate filter data!\n",
+				  stderr);
+			CGFreeMipChain(chain);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+CGGenerateMipChain(struct CGMipChain *chain, unsigned char *pixels,
+				   int width, int height, int channels,
+				   enum CGMipFilter filter, bool gammaCorrect) {
+	return generateMipChain(chain, pixels, width, height, channels, filter,
+							gammaCorrect, NULL);
+}
+
+void
+CGFreeMipChain(struct CGMipChain *chain) {
+	cgFree(chain->storage);
+	chain->storage = NULL;
+	chain->levelCount = 0;
+}
@@ -0,0 +1,288 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Hardware performance counters. Each thread that's measured gets a group of
+ * perf events counting its cycles, instructions, cache misses and branch
+ * misses in user space. CGStart opens the groups of itself and of the worker
+ * threads, and reads all of them at the start of every frame, so the counts of
+ * the previous frame are the difference with the last reading.
+ */
+
+#include "libcg.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define PERF_EVENTS 4
+#define MAX_PERF_THREADS 64
+
+struct PerfThread {
+	pid_t		 tid;
+	/* the group leader is the first, -1 if the group isn't open */
+	int		 fds[PERF_EVENTS];
+	/* the scaled counts at the last reading */
+	double		 last[PERF_EVENTS];
+};
+
+/* The layout of a read of a group with PERF_FORMAT_GROUP and both times. */
+struct PerfGroupRead {
+	uint64_t	 count;
+	uint64_t	 timeEnabled;
+	uint64_t	 timeRunning;
+	uint64_t	 values[PERF_EVENTS];
+};
+
+static const uint64_t eventConfigs[PERF_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* The worker threads that registered, protected by perfMutex. */
+static pthread_mutex_t perfMutex = PTHREAD_MUTEX_INITIALIZER;
+static pid_t workerTids[MAX_PERF_THREADS];
+static int workerTidCount = 0;
+
+/* Only touched by the render thread. */
+static bool perfEnabled = false;
+static bool perfUnavailable = false;
+static struct PerfThread renderThread = { 0, { -1, -1, -1, -1 }, { 0 } };
+static struct PerfThread workerThreads[MAX_PERF_THREADS];
+static int openWorkerCount = 0;
+static struct CGPerfCounters renderCounters;
+static struct CGPerfCounters workerCounters;
+static bool hasPerfSample = false;
+
+void
+registerPerfThread(void) {
+	pthread_mutex_lock(&perfMutex);
+	if (workerTidCount < MAX_PERF_THREADS)
+		workerTids[workerTidCount++] = syscall(SYS_gettid);
+	pthread_mutex_unlock(&perfMutex);
+}
+
+void
+CGSetPerfCounters(bool enabled) {
+	perfEnabled = enabled;
+}
+
+static void
+closeThread(struct PerfThread *thread) {
+	int i;
+
+	for (i = PERF_EVENTS - 1; i >= 0; i--) {
+		if (thread->fds[i] != -1)
+			close(thread->fds[i]);
+		thread->fds[i] = -1;
+	}
+}
+
+/**
+ * Opens the group of a thread, where zero is the calling thread.
+ */
+static bool
+openThread(struct PerfThread *thread, pid_t tid) {
+	struct perf_event_attr attributes;
+	int i;
+
+	memset(thread, 0, sizeof(*thread));
+	thread->tid = tid;
+	for (i = 0; i < PERF_EVENTS; i++)
+		thread->fds[i] = -1;
+
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.read_format = PERF_FORMAT_GROUP
+						   | PERF_FORMAT_TOTAL_TIME_ENABLED
+						   | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	/* User space only, which perf_event_paranoid 2 still allows. */
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+
+	for (i = 0; i < PERF_EVENTS; i++) {
+		attributes.config = eventConfigs[i];
+		thread->fds[i] = syscall(SYS_perf_event_open, &attributes, tid, -1,
+								 i == 0 ? -1 : thread->fds[0],
+								 PERF_FLAG_FD_CLOEXEC);
+		if (thread->fds[i] == -1) {
+			closeThread(thread);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Adds what the thread counted since the last reading to counters. Counts are
+ * scaled up when the kernel had to multiplex the counters between groups.
+ */
+static void
+readThread(struct PerfThread *thread, struct CGPerfCounters *counters) {
+	struct PerfGroupRead group;
+	double delta[PERF_EVENTS];
+	double scale;
+	double value;
+	int i;
+
+	if (thread->fds[0] == -1)
+		return;
+
+	if (read(thread->fds[0], &group, sizeof(group)) != sizeof(group)
+		|| group.count != PERF_EVENTS || group.timeRunning == 0)
+		return;
+
+	scale = (double) group.timeEnabled / group.timeRunning;
+	for (i = 0; i < PERF_EVENTS; i++) {
+		/* The scale changes, so the scaled counts may even go back. */
+		value = group.values[i] * scale;
+		delta[i] = value > thread->last[i] ? value - thread->last[i] : 0.0;
+		thread->last[i] = value;
+	}
+
+	counters->cycles += delta[0];
+	counters->instructions += delta[1];
+	counters->cacheMisses += delta[2];
+	counters->branchMisses += delta[3];
+}
+
+static void
+closeThreads(void) {
+	int i;
+
+	closeThread(&renderThread);
+	for (i = 0; i < openWorkerCount; i++)
+		closeThread(&workerThreads[i]);
+
+	openWorkerCount = 0;
+	hasPerfSample = false;
+}
+
+void
+closePerfCounters(void) {
+	closeThreads();
+
+	/* The workers have been stopped, new ones register again. */
+	pthread_mutex_lock(&perfMutex);
+	workerTidCount = 0;
+	pthread_mutex_unlock(&perfMutex);
+}
+
+/**
+ * Opens the groups of the render thread and of the workers that registered
+ * since the last call.
+ */
+static bool
+openThreads(void) {
+	int count;
+
+	if (renderThread.fds[0] == -1 && !openThread(&renderThread, 0)) {
+		perror("[CGSetPerfCounters] perf_event_open() failure, counters "
+			   "disabled");
+		perfUnavailable = true;
+		return false;
+	}
+
+	pthread_mutex_lock(&perfMutex);
+	count = workerTidCount;
+	pthread_mutex_unlock(&perfMutex);
+
+	/* A worker whose group can't be opened just isn't counted. */
+	for (; openWorkerCount < count; openWorkerCount++)
+		openThread(&workerThreads[openWorkerCount],
+				   workerTids[openWorkerCount]);
+
+	return true;
+}
+
+double
+getIPC(const struct CGPerfCounters *counters) {
+	return counters->cycles > 0
+		 ? (double) counters->instructions / counters->cycles : 0.0;
+}
+
+void
+samplePerfCounters(void) {
+	bool opened;
+	int i;
+	CG_FUNCTION_ZONE();
+
+	if (!perfEnabled || perfUnavailable) {
+		if (renderThread.fds[0] != -1)
+			closeThreads();
+		return;
+	}
+
+	/* Groups opened now have nothing to report until the next frame. */
+	opened = renderThread.fds[0] != -1;
+	if (!openThreads())
+		return;
+
+	memset(&renderCounters, 0, sizeof(renderCounters));
+	memset(&workerCounters, 0, sizeof(workerCounters));
+	readThread(&renderThread, &renderCounters);
+	for (i = 0; i < openWorkerCount; i++)
+		readThread(&workerThreads[i], &workerCounters);
+
+	if (!opened)
+		return;
+
+	hasPerfSample = true;
+	CGTraceCounter("render IPC", getIPC(&renderCounters));
+	CGTraceCounter("render cache misses", renderCounters.cacheMisses);
+	CGTraceCounter("render branch misses", renderCounters.branchMisses);
+	CGTraceCounter("worker IPC", getIPC(&workerCounters));
+	CGTraceCounter("worker cache misses", workerCounters.cacheMisses);
+}
+
+bool
+CGGetPerfCounters(struct CGPerfCounters *render,
+				  struct CGPerfCounters *workers) {
+	if (!hasPerfSample)
+		return false;
+
+	if (render != NULL)
+		memcpy(render, &renderCounters, sizeof(*render));
+	if (workers != NULL)
+		memcpy(workers, &workerCounters, sizeof(*workers));
+	return true;
+}
@@ -0,0 +1,193 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Pixel conversion kernels used before uploading images. The x86 versions use
+ * SSE2, which every x86_64 CPU has, and SSSE3 when the CPU supports it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CG_PIXEL_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#include "internal.h"
+
+static void
+expandRGBToRGBAScalar(unsigned char *dst, const unsigned char *src,
+					  size_t count) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		dst[i * 4 + 0] = src[i * 3 + 0];
+		dst[i * 4 + 1] = src[i * 3 + 1];
+		dst[i * 4 + 2] = src[i * 3 + 2];
+		dst[i * 4 + 3] = 0xFF;
+	}
+}
+
+#ifdef CG_PIXEL_X86
+__attribute__((target("ssse3")))
+static void
+expandRGBToRGBASSSE3(unsigned char *dst, const unsigned char *src,
+					 size_t count) {
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+										  6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+	__m128i pixels;
+	size_t i = 0;
+
+	/* Every load reads 16 bytes but only uses 12 of them, so stop while
+	 * there are at least 6 pixels left to stay inside the source. */
+	for (; i + 6 <= count; i += 4) {
+		pixels = _mm_loadu_si128((const __m128i *) (src + i * 3));
+		pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha);
+		_mm_storeu_si128((__m128i *) (dst + i * 4), pixels);
+	}
+
+	expandRGBToRGBAScalar(dst + i * 4, src + i * 3, count - i);
+}
+#endif
+
+void
+expandRGBToRGBA(unsigned char *dst, const unsigned char *src, size_t count) {
+#ifdef CG_PIXEL_X86
+	if (__builtin_cpu_supports("ssse3")) {
+		expandRGBToRGBASSSE3(dst, src, count);
+		return;
+	}
+#endif
+
+	expandRGBToRGBAScalar(dst, src, count);
+}
+
+bool
+isOpaque(const unsigned char *rgba, size_t count) {
+	size_t i = 0;
+
+#ifdef CG_PIXEL_X86
+	const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+	__m128i accumulator = _mm_set1_epi32(-1);
+
+	for (; i + 4 <= count; i += 4) {
+		accumulator = _mm_and_si128(accumulator,
+				_mm_loadu_si128((const __m128i *) (rgba + i * 4)));
+
+		/* Check now and then, so translucent images bail out early. */
+		if ((i & 1023) == 0 && _mm_movemask_epi8(_mm_cmpeq_epi32(
+				_mm_and_si128(accumulator, alpha), alpha)) != 0xFFFF)
+			return false;
+	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(accumulator, alpha),
+										  alpha)) != 0xFFFF)
+		return false;
+#endif
+
+	for (; i < count; i++) {
+		if (rgba[i * 4 + 3] != 0xFF)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Computes c * a / 255, rounded to the nearest integer.
+ */
+static inline unsigned char
+multiplyAlpha(unsigned char c, unsigned char a) {
+	unsigned int t = c * a + 128;
+
+	return (t + (t >> 8)) >> 8;
+}
+
+#ifdef CG_PIXEL_X86
+static inline __m128i
+multiplyAlphaSSE2(__m128i pixels) {
+	const __m128i half = _mm_set1_epi16(128);
+	__m128i alpha;
+	__m128i t;
+
+	/* Broadcast the alpha of both pixels to all of their lanes. */
+	alpha = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+	alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+
+	t = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), half);
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+void
+premultiplyAlpha(unsigned char *pixels, size_t count, int channels) {
+	size_t i = 0;
+
+	if (channels == 2) {
+		for (i = 0; i < count; i++)
+			pixels[i * 2] = multiplyAlpha(pixels[i * 2], pixels[i * 2 + 1]);
+		return;
+	}
+
+	if (channels != 4)
+		return;
+
+#ifdef CG_PIXEL_X86
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+		__m128i source;
+		__m128i low;
+		__m128i high;
+		__m128i result;
+
+		for (; i + 4 <= count; i += 4) {
+			source = _mm_loadu_si128((const __m128i *) (pixels + i * 4));
+			low = multiplyAlphaSSE2(_mm_unpacklo_epi8(source, zero));
+			high = multiplyAlphaSSE2(_mm_unpackhi_epi8(source, zero));
+
+			/* The alpha channel itself is kept as it was. */
+			result = _mm_packus_epi16(low, high);
+			result = _mm_or_si128(_mm_andnot_si128(alpha, result),
+								  _mm_and_si128(alpha, source));
+			_mm_storeu_si128((__m128i *) (pixels + i * 4), result);
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		pixels[i * 4 + 0] = multiplyAlpha(pixels[i * 4 + 0], pixels[i * 4 + 3]);
+		pixels[i * 4 + 1] = multiplyAlpha(pixels[i * 4 + 1], pixels[i * 4 + 3]);
+		pixels[i * 4 + 2] = multiplyAlpha(pixels[i * 4 + 2], pixels[i * 4 + 3]);
+	}
+}
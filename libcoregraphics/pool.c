@@ -0,0 +1,376 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Resource pools. Images, meshes and shaders created through their handles
+ * live in pools owned by libcg, in chunks of slots that are never moved, so
+ * pointers to them stay valid like those to caller-owned structures. A handle
+ * holds the index of its slot and the generation of the slot when it was
+ * handed out, which is bumped whenever the slot is freed, so stale handles
+ * are recognized. Every pool also keeps a dense list of the handles alive.
+ */
+
+#include "libcg.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((UINT32_C(1) << HANDLE_INDEX_BITS) - 1)
+/* Generations count from 1 to this, so no handle is zero. */
+#define MAX_GENERATION ((UINT32_C(1) << (32 - HANDLE_INDEX_BITS)) - 1)
+#define CHUNK_SLOTS 256
+#define MAX_CHUNKS ((HANDLE_INDEX_MASK + 1) / CHUNK_SLOTS)
+#define NO_SLOT UINT32_MAX
+
+struct PoolChunk {
+	uint16_t	 generations[CHUNK_SLOTS];
+	/* the next free slot of a free slot, the position in the live list of a
+	 * used one */
+	uint32_t	 links[CHUNK_SLOTS];
+	bool		 used[CHUNK_SLOTS];
+	_Alignas(max_align_t) unsigned char objects[];
+};
+
+struct HandlePool {
+	size_t		 objectSize;
+	struct PoolChunk *chunks[MAX_CHUNKS];
+	uint32_t	 chunkCount;
+	uint32_t	 freeSlot;
+	uint32_t	*live;
+	uint32_t	 liveCount;
+	uint32_t	 liveCapacity;
+};
+
+#define POOL_INITIALIZER(type) \
+	{ sizeof(type), { NULL }, 0, NO_SLOT, NULL, 0, 0 }
+
+static struct HandlePool imagePool = POOL_INITIALIZER(struct CGImage);
+static struct HandlePool meshPool = POOL_INITIALIZER(struct CGMeshData);
+static struct HandlePool shaderPool = POOL_INITIALIZER(struct CGShaderData);
+
+static struct PoolChunk *
+getChunk(const struct HandlePool *pool, uint32_t slot) {
+	return pool->chunks[slot / CHUNK_SLOTS];
+}
+
+static void *
+getObject(const struct HandlePool *pool, uint32_t slot) {
+	return getChunk(pool, slot)->objects
+		 + (slot % CHUNK_SLOTS) * pool->objectSize;
+}
+
+static bool
+addChunk(struct HandlePool *pool) {
+	struct PoolChunk *chunk;
+	uint32_t first;
+	uint32_t i;
+
+	if (pool->chunkCount == MAX_CHUNKS)
+		return false;
+
+	chunk = cgCalloc(1, sizeof(struct PoolChunk)
+					 + CHUNK_SLOTS * pool->objectSize);
+	if (chunk == NULL)
+		return false;
+
+	/* The free list runs through the new slots in order, so they're used
+	 * front to back. */
+	first = pool->chunkCount * CHUNK_SLOTS;
+	for (i = 0; i < CHUNK_SLOTS; i++) {
+		chunk->generations[i] = 1;
+		chunk->links[i] = i + 1 < CHUNK_SLOTS ? first + i + 1 : pool->freeSlot;
+	}
+
+	pool->chunks[pool->chunkCount++] = chunk;
+	pool->freeSlot = first;
+	return true;
+}
+
+/**
+ * Takes a free slot and returns its handle, or zero if the pool is full or out
+ * of memory. The object is zeroed.
+ */
+static uint32_t
+allocateHandle(struct HandlePool *pool, const char *function) {
+	struct PoolChunk *chunk;
+	uint32_t *live;
+	uint32_t capacity;
+	uint32_t slot;
+
+	if (pool->liveCount == pool->liveCapacity) {
+		capacity = pool->liveCapacity > 0 ? pool->liveCapacity * 2
+										  : CHUNK_SLOTS;
+		live = cgRealloc(pool->live, capacity * sizeof(uint32_t));
+		if (live == NULL) {
+			fprintf(stderr, "[%s] Failed to allocate a handle!\n", function);
+			return 0;
+		}
+
+		pool->live = live;
+		pool->liveCapacity = capacity;
+	}
+
+	if (pool->freeSlot == NO_SLOT && !addChunk(pool)) {
+		fprintf(stderr, "[%s] Failed to allocate a handle!\n", function);
+		return 0;
+	}
+
+	slot = pool->freeSlot;
+	chunk = getChunk(pool, slot);
+	pool->freeSlot = chunk->links[slot % CHUNK_SLOTS];
+
+	chunk->used[slot % CHUNK_SLOTS] = true;
+	chunk->links[slot % CHUNK_SLOTS] = pool->liveCount;
+	memset(getObject(pool, slot), 0, pool->objectSize);
+
+	pool->live[pool->liveCount] = (uint32_t) chunk->generations[slot
+						% CHUNK_SLOTS] << HANDLE_INDEX_BITS | slot;
+	return pool->live[pool->liveCount++];
+}
+
+/**
+ * Returns the object of a handle, or NULL if the handle is stale or invalid.
+ */
+static void *
+lookupHandle(const struct HandlePool *pool, uint32_t handle) {
+	struct PoolChunk *chunk;
+	uint32_t slot = handle & HANDLE_INDEX_MASK;
+
+	if (slot / CHUNK_SLOTS >= pool->chunkCount)
+		return NULL;
+
+	chunk = getChunk(pool, slot);
+	if (!chunk->used[slot % CHUNK_SLOTS] || chunk->generations[slot
+			% CHUNK_SLOTS] != handle >> HANDLE_INDEX_BITS)
+		return NULL;
+
+	return getObject(pool, slot);
+}
+
+/**
+ * Frees the slot of a handle returned by lookupHandle, which makes the handle
+ * stale.
+ */
+static void
+freeHandle(struct HandlePool *pool, uint32_t handle) {
+	struct PoolChunk *chunk;
+	uint32_t slot = handle & HANDLE_INDEX_MASK;
+	uint32_t position;
+	uint32_t moved;
+
+	chunk = getChunk(pool, slot);
+	position = chunk->links[slot % CHUNK_SLOTS];
+
+	/* The last live handle takes the place of this one. */
+	moved = pool->live[--pool->liveCount];
+	pool->live[position] = moved;
+	getChunk(pool, moved & HANDLE_INDEX_MASK)->links[(moved
+			& HANDLE_INDEX_MASK) % CHUNK_SLOTS] = position;
+
+	chunk->used[slot % CHUNK_SLOTS] = false;
+
+	/* A slot whose generations are used up is retired rather than wrapped
+	 * around, which would make its oldest stale handles valid again. */
+	if (chunk->generations[slot % CHUNK_SLOTS] == MAX_GENERATION)
+		return;
+
+	chunk->generations[slot % CHUNK_SLOTS]++;
+	chunk->links[slot % CHUNK_SLOTS] = pool->freeSlot;
+	pool->freeSlot = slot;
+}
+
+/**
+ * Deletes what's left in a pool and frees it.
+ */
+static void
+destroyPool(struct HandlePool *pool, void (*delete)(void *)) {
+	uint32_t i;
+
+	for (i = 0; i < pool->liveCount; i++)
+		delete(getObject(pool, pool->live[i] & HANDLE_INDEX_MASK));
+
+	for (i = 0; i < pool->chunkCount; i++) {
+		cgFree(pool->chunks[i]);
+		pool->chunks[i] = NULL;
+	}
+
+	cgFree(pool->live);
+	pool->live = NULL;
+	pool->chunkCount = 0;
+	pool->freeSlot = NO_SLOT;
+	pool->liveCount = 0;
+	pool->liveCapacity = 0;
+}
+
+static void
+deleteImage(void *image) {
+	CGDeleteImage(image);
+}
+
+static void
+deleteMesh(void *mesh) {
+	CGDeleteMesh(mesh);
+}
+
+static void
+deleteShader(void *shader) {
+	CGDeleteShader(shader);
+}
+
+void
+destroyPools(void) {
+	destroyPool(&imagePool, deleteImage);
+	destroyPool(&meshPool, deleteMesh);
+	destroyPool(&shaderPool, deleteShader);
+}
+
+CGImageHandle
+CGCreateImage(struct CGImageInitData *initData) {
+	CGImageHandle handle;
+
+	handle = allocateHandle(&imagePool, "CGCreateImage");
+	if (handle != 0 && !CGLoadImage(lookupHandle(&imagePool, handle),
+									 initData)) {
+		freeHandle(&imagePool, handle);
+		return 0;
+	}
+
+	return handle;
+}
+
+CGMeshHandle
+CGCreateMesh(struct CGMeshInitData *initData) {
+	CGMeshHandle handle;
+
+	handle = allocateHandle(&meshPool, "CGCreateMesh");
+	if (handle != 0 && !CGLoadMesh(lookupHandle(&meshPool, handle),
+									initData)) {
+		freeHandle(&meshPool, handle);
+		return 0;
+	}
+
+	return handle;
+}
+
+CGShaderHandle
+CGCreateShader(struct CGShaderInitData *initData) {
+	CGShaderHandle handle;
+
+	handle = allocateHandle(&shaderPool, "CGCreateShader");
+	if (handle != 0 && !CGLoadShader(lookupHandle(&shaderPool, handle),
+									  initData)) {
+		freeHandle(&shaderPool, handle);
+		return 0;
+	}
+
+	return handle;
+}
+
+struct CGImage *
+CGGetImage(CGImageHandle handle) {
+	return lookupHandle(&imagePool, handle);
+}
+
+struct CGMeshData *
+CGGetMesh(CGMeshHandle handle) {
+	return lookupHandle(&meshPool, handle);
+}
+
+struct CGShaderData *
+CGGetShader(CGShaderHandle handle) {
+	return lookupHandle(&shaderPool, handle);
+}
+
+const CGImageHandle *
+CGGetImageHandles(size_t *count) {
+	*count = imagePool.liveCount;
+	return imagePool.live;
+}
+
+const CGMeshHandle *
+CGGetMeshHandles(size_t *count) {
+	*count = meshPool.liveCount;
+	return meshPool.live;
+}
+
+const CGShaderHandle *
+CGGetShaderHandles(size_t *count) {
+	*count = shaderPool.liveCount;
+	return shaderPool.live;
+}
+
+void
+CGDestroyImage(CGImageHandle handle) {
+	struct CGImage *image = lookupHandle(&imagePool, handle);
+
+	if (image == NULL) {
+		fprintf(stderr, "[CGDestroyImage] Stale handle 0x%08" PRIx32 "!\n",
+				handle);
+		return;
+	}
+
+	CGDeleteImage(image);
+	freeHandle(&imagePool, handle);
+}
+
+void
+CGDestroyMesh(CGMeshHandle handle) {
+	struct CGMeshData *mesh = lookupHandle(&meshPool, handle);
+
+	if (mesh == NULL) {
+		fprintf(stderr, "[CGDestroyMesh] Stale handle 0x%08" PRIx32 "!\n",
+				handle);
+		return;
+	}
+
+	CGDeleteMesh(mesh);
+	freeHandle(&meshPool, handle);
+}
+
+void
+CGDestroyShader(CGShaderHandle handle) {
+	struct CGShaderData *shader = lookupHandle(&shaderPool, handle);
+
+	if (shader == NULL) {
+		fprintf(stderr, "[CGDestroyShader] Stale handle 0x%08" PRIx32 "!\n",
+				handle);
+		return;
+	}
+
+	CGDeleteShader(shader);
+	freeHandle(&shaderPool, handle);
+}
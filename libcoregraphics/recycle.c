@@ -0,0 +1,342 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Recycling of buffers and textures. Instead of deleting them, CGDeleteMesh
+ * and CGDeleteImage hand their objects to free lists, from which CGLoadMesh
+ * and CGLoadImage take objects that fit before generating new ones, and fill
+ * them with glBufferSubData and glTexSubImage2D. Buffers are bucketed by the
+ * power of two their size rounds up to and fit requests of at least half
+ * their size; textures only fit the same format, size and level count. An
+ * object is only reused once the frames that may have drawn with it are no
+ * longer in flight, and the least recently released objects are deleted to
+ * stay within the budget.
+ */
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <GL/glew.h>
+
+#include "internal.h"
+
+#define BUFFER_BUCKETS 48
+#define TEXTURE_BUCKETS 64
+#define DEFAULT_RECYCLE_BUDGET (32 << 20)
+
+struct RecycledObject {
+	GLuint		 name;
+	bool		 texture;
+	/* of buffers */
+	GLsizeiptr	 capacity;
+	/* of textures */
+	GLint		 internalFormat;
+	int		 width;
+	int		 height;
+	int		 levelCount;
+	/* the video memory it takes */
+	size_t		 size;
+	/* the frame it was released in */
+	uint64_t	 frame;
+	/* in its bucket, the newest first */
+	struct RecycledObject *previous;
+	struct RecycledObject *next;
+	/* in the order of release, across all buckets */
+	struct RecycledObject *older;
+	struct RecycledObject *newer;
+};
+
+struct RecycleBucket {
+	struct RecycledObject *newest;
+	struct RecycledObject *oldest;
+};
+
+static struct RecycleBucket bufferBuckets[BUFFER_BUCKETS];
+static struct RecycleBucket textureBuckets[TEXTURE_BUCKETS];
+static struct RecycledObject *oldestRecycled = NULL;
+static struct RecycledObject *newestRecycled = NULL;
+static size_t recycleBudget = DEFAULT_RECYCLE_BUDGET;
+static size_t recycledSize = 0;
+
+/**
+ * The bucket of the smallest power of two that holds size.
+ */
+static struct RecycleBucket *
+getBufferBucket(GLsizeiptr size) {
+	int bucket = 0;
+
+	while (bucket + 1 < BUFFER_BUCKETS && ((GLsizeiptr) 1 << bucket) < size)
+		bucket++;
+
+	return &bufferBuckets[bucket];
+}
+
+static struct RecycleBucket *
+getTextureBucket(GLint internalFormat, int width, int height, int levelCount) {
+	uint32_t hash = (uint32_t) internalFormat;
+
+	hash = hash * 31 + (uint32_t) width;
+	hash = hash * 31 + (uint32_t) height;
+	hash = hash * 31 + (uint32_t) levelCount;
+	return &textureBuckets[hash % TEXTURE_BUCKETS];
+}
+
+static struct RecycleBucket *
+getBucket(const struct RecycledObject *object) {
+	if (object->texture)
+		return getTextureBucket(object->internalFormat, object->width,
+								object->height, object->levelCount);
+
+	return getBufferBucket(object->capacity);
+}
+
+static void
+unlinkObject(struct RecycledObject *object) {
+	struct RecycleBucket *bucket = getBucket(object);
+
+	if (object->previous != NULL)
+		object->previous->next = object->next;
+	else
+		bucket->newest = object->next;
+	if (object->next != NULL)
+		object->next->previous = object->previous;
+	else
+		bucket->oldest = object->previous;
+
+	if (object->older != NULL)
+		object->older->newer = object->newer;
+	else
+		oldestRecycled = object->newer;
+	if (object->newer != NULL)
+		object->newer->older = object->older;
+	else
+		newestRecycled = object->older;
+
+	recycledSize -= object->size;
+}
+
+static void
+deleteObject(struct RecycledObject *object) {
+	if (object->texture)
+		glDeleteTextures(1, &object->name);
+	else
+		glDeleteBuffers(1, &object->name);
+
+	cgFree(object);
+}
+
+/**
+ * Deletes the least recently released objects until the rest fits the budget.
+ */
+static void
+trimRecycled(void) {
+	struct RecycledObject *object;
+
+	while (recycledSize > recycleBudget) {
+		object = oldestRecycled;
+		unlinkObject(object);
+		deleteObject(object);
+	}
+}
+
+void
+CGSetRecycleBudget(size_t bytes) {
+	recycleBudget = bytes;
+	trimRecycled();
+}
+
+size_t
+CGGetRecycledMemory(void) {
+	return recycledSize;
+}
+
+/**
+ * Takes over an object, or deletes it if it doesn't fit the budget at all.
+ */
+static void
+recycleObject(struct RecycledObject *object) {
+	struct RecycleBucket *bucket = getBucket(object);
+
+	if (object->size > recycleBudget) {
+		deleteObject(object);
+		return;
+	}
+
+	object->frame = getFrameIndex();
+	object->previous = NULL;
+	object->next = bucket->newest;
+	if (bucket->newest != NULL)
+		bucket->newest->previous = object;
+	else
+		bucket->oldest = object;
+	bucket->newest = object;
+
+	object->newer = NULL;
+	object->older = newestRecycled;
+	if (newestRecycled != NULL)
+		newestRecycled->newer = object;
+	else
+		oldestRecycled = object;
+	newestRecycled = object;
+
+	recycledSize += object->size;
+	trimRecycled();
+}
+
+/**
+ * Takes the oldest object of a bucket that matches and is no longer drawn
+ * with, searching from the oldest, as those are the likeliest to be idle.
+ */
+static struct RecycledObject *
+takeObject(struct RecycleBucket *bucket, bool texture, GLsizeiptr size,
+		   GLint internalFormat, int width, int height, int levelCount) {
+	struct RecycledObject *object;
+
+	for (object = bucket->oldest; object != NULL; object = object->previous) {
+		if (!isFrameRetired(object->frame))
+			continue;
+
+		if (texture ? object->texture && object->internalFormat
+					  == internalFormat && object->width == width
+					  && object->height == height
+					  && object->levelCount == levelCount
+					: !object->texture && object->capacity >= size) {
+			unlinkObject(object);
+			return object;
+		}
+	}
+
+	return NULL;
+}
+
+GLuint
+acquireBuffer(GLsizeiptr size, GLsizeiptr *capacity) {
+	struct RecycledObject *object;
+	GLuint name;
+
+	object = takeObject(getBufferBucket(size), false, size, 0, 0, 0, 0);
+	if (object == NULL)
+		return 0;
+
+	name = object->name;
+	*capacity = object->capacity;
+	cgFree(object);
+	return name;
+}
+
+void
+releaseBuffer(GLuint buffer, GLsizeiptr capacity) {
+	struct RecycledObject *object;
+
+	if (buffer == 0)
+		return;
+
+	object = cgCalloc(1, sizeof(struct RecycledObject));
+	if (object == NULL || capacity <= 0) {
+		cgFree(object);
+		glDeleteBuffers(1, &buffer);
+		return;
+	}
+
+	object->name = buffer;
+	object->capacity = capacity;
+	object->size = capacity;
+	recycleObject(object);
+}
+
+GLuint
+acquireTexture(GLint internalFormat, int width, int height, int levelCount) {
+	struct RecycledObject *object;
+	GLuint name;
+
+	object = takeObject(getTextureBucket(internalFormat, width, height,
+										 levelCount), true, 0, internalFormat,
+						width, height, levelCount);
+	if (object == NULL)
+		return 0;
+
+	name = object->name;
+	cgFree(object);
+	return name;
+}
+
+void
+releaseTexture(GLuint texture, GLint internalFormat, int width, int height,
+			   int levelCount, size_t size) {
+	struct RecycledObject *object;
+
+	if (texture == 0)
+		return;
+
+	object = cgCalloc(1, sizeof(struct RecycledObject));
+	if (object == NULL) {
+		glDeleteTextures(1, &texture);
+		return;
+	}
+
+	/* Whoever gets it next expects the defaults. */
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+					GL_NEAREST_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_LOD, -1000.0f);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_LOD, 1000.0f);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	/* Still in video memory, as far as the accounting is concerned. */
+	trackGPUMemory(CG_MC_TEXTURE, texture, size, "recycled");
+
+	object->name = texture;
+	object->texture = true;
+	object->internalFormat = internalFormat;
+	object->width = width;
+	object->height = height;
+	object->levelCount = levelCount;
+	object->size = size;
+	recycleObject(object);
+}
+
+void
+deleteRecycled(void) {
+	struct RecycledObject *object;
+
+	while (oldestRecycled != NULL) {
+		object = oldestRecycled;
+		unlinkObject(object);
+		deleteObject(object);
+	}
+}
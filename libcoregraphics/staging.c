@@ -0,0 +1,293 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The staging ring: one buffer object that stays persistently mapped for the
+ * lifetime of the context, so decoders can write pixels straight into memory
+ * the GPU pulls from. Blocks are handed out in ring order and reclaimed once
+ * the fence inserted after their last upload has signaled.
+ *
+ * The buffer is placed in client memory and mapped for reading too, because
+ * mipmap generation and format checks read the pixels back; write-combined
+ * memory would make that very slow.
+ */
+
+#include "libcg.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <GL/glew.h>
+#include <GL/glx.h>
+
+#include "internal.h"
+
+#define MAX_BLOCKS 256
+#define BLOCK_ALIGNMENT 64
+
+enum BlockState {
+	BS_USED,
+	/* released, waiting for the fence */
+	BS_RELEASED,
+	BS_COMPLETE,
+};
+
+struct StagingBlock {
+	size_t		 offset;
+	size_t		 size;
+	GLsync		 fence;
+	enum BlockState	 state;
+};
+
+static size_t stagingSize = 64 * 1024 * 1024;
+static GLuint stagingBuffer = 0;
+static unsigned char *stagingMemory = NULL;
+
+/* Everything below is protected by stagingMutex. */
+static pthread_mutex_t stagingMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct StagingBlock blocks[MAX_BLOCKS];
+static size_t firstBlock = 0;
+static size_t blockCount = 0;
+/* where the next block starts if there's room */
+static size_t head = 0;
+
+static struct StagingBlock *
+getBlock(size_t index) {
+	return &blocks[(firstBlock + index) % MAX_BLOCKS];
+}
+
+/**
+ * Frees the completed blocks at the start of the ring. Blocks released out of
+ * order wait for the older ones.
+ */
+static void
+reclaimBlocks(void) {
+	while (blockCount > 0 && getBlock(0)->state == BS_COMPLETE) {
+		firstBlock = (firstBlock + 1) % MAX_BLOCKS;
+		blockCount--;
+	}
+
+	if (blockCount == 0) {
+		firstBlock = 0;
+		head = 0;
+	}
+}
+
+bool
+startStaging(void) {
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT
+						   | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	if (stagingSize == 0 || !GLEW_ARB_buffer_storage)
+		return false;
+
+	glGenBuffers(1, &stagingBuffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stagingSize, NULL,
+					flags | GL_CLIENT_STORAGE_BIT);
+	stagingMemory = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stagingSize,
+									 flags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (stagingMemory == NULL) {
+		fputs("[startStaging] Failed to map the staging buffer!\n", stderr);
+		glDeleteBuffers(1, &stagingBuffer);
+		stagingBuffer = 0;
+		return false;
+	}
+
+	return true;
+}
+
+void
+stopStaging(void) {
+	size_t i;
+
+	if (stagingBuffer == 0)
+		return;
+
+	for (i = 0; i < blockCount; i++) {
+		if (getBlock(i)->fence != NULL)
+			glDeleteSync(getBlock(i)->fence);
+	}
+	firstBlock = 0;
+	blockCount = 0;
+	head = 0;
+
+	/* Deleting a buffer unmaps it. */
+	glDeleteBuffers(1, &stagingBuffer);
+	stagingBuffer = 0;
+	stagingMemory = NULL;
+}
+
+unsigned char *
+allocateStaging(size_t size) {
+	struct StagingBlock *block;
+	size_t tail;
+	size_t offset;
+
+	if (stagingMemory == NULL || size == 0)
+		return NULL;
+
+	size = (size + BLOCK_ALIGNMENT - 1) & ~(size_t) (BLOCK_ALIGNMENT - 1);
+
+	pthread_mutex_lock(&stagingMutex);
+	reclaimBlocks();
+
+	if (blockCount == MAX_BLOCKS)
+		goto full;
+
+	if (blockCount == 0) {
+		if (size > stagingSize)
+			goto full;
+		offset = 0;
+	} else {
+		tail = getBlock(0)->offset;
+
+		if (getBlock(blockCount - 1)->offset >= tail) {
+			/* The used blocks are contiguous, try after them and then
+			 * before them. */
+			if (stagingSize - head >= size)
+				offset = head;
+			else if (tail >= size)
+				offset = 0;
+			else
+				goto full;
+		} else if (tail - head >= size) {
+			offset = head;
+		} else {
+			goto full;
+		}
+	}
+
+	block = getBlock(blockCount++);
+	block->offset = offset;
+	block->size = size;
+	block->fence = NULL;
+	block->state = BS_USED;
+	head = offset + size;
+
+	pthread_mutex_unlock(&stagingMutex);
+	return stagingMemory + offset;
+
+full:
+	pthread_mutex_unlock(&stagingMutex);
+	return NULL;
+}
+
+bool
+isStagingMemory(const void *pointer) {
+	const unsigned char *bytes = pointer;
+
+	return stagingMemory != NULL && bytes >= stagingMemory
+		&& bytes < stagingMemory + stagingSize;
+}
+
+void
+releaseStaging(void *pointer) {
+	size_t offset = (unsigned char *) pointer - stagingMemory;
+	struct StagingBlock *block;
+	size_t i;
+
+	pthread_mutex_lock(&stagingMutex);
+	for (i = 0; i < blockCount; i++) {
+		block = getBlock(i);
+		if (block->offset != offset || block->state != BS_USED)
+			continue;
+
+		/* Without a context, the memory can't have been used by OpenGL.
+		 * Otherwise the fence covers every upload submitted from it. */
+		if (glXGetCurrentContext() == NULL) {
+			block->state = BS_COMPLETE;
+		} else {
+			block->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+			block->state = BS_RELEASED;
+		}
+		break;
+	}
+
+	reclaimBlocks();
+	pthread_mutex_unlock(&stagingMutex);
+}
+
+void
+retireStaging(void) {
+	struct StagingBlock *block;
+	GLenum status;
+	size_t i;
+
+	if (stagingMemory == NULL)
+		return;
+
+	pthread_mutex_lock(&stagingMutex);
+	for (i = 0; i < blockCount; i++) {
+		block = getBlock(i);
+		if (block->state != BS_RELEASED)
+			continue;
+
+		status = glClientWaitSync(block->fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			continue;
+
+		glDeleteSync(block->fence);
+		block->fence = NULL;
+		block->state = BS_COMPLETE;
+	}
+
+	reclaimBlocks();
+	pthread_mutex_unlock(&stagingMutex);
+}
+
+const void *
+bindUnpackSource(const void *pixels) {
+	if (!isStagingMemory(pixels))
+		return pixels;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+	return (const void *) (uintptr_t)
+		((const unsigned char *) pixels - stagingMemory);
+}
+
+bool
+getStagingOffset(const void *pointer, GLuint *buffer, GLintptr *offset) {
+	if (!isStagingMemory(pointer))
+		return false;
+
+	*buffer = stagingBuffer;
+	*offset = (const unsigned char *) pointer - stagingMemory;
+	return true;
+}
+
+void
+CGSetStagingBufferSize(size_t size) {
+	stagingSize = size;
+}
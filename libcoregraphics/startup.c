@@ -0,0 +1,340 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Startup profiling. Until the first frame is presented, the stages of
+ * CGInitialize and the work of loading every asset are recorded as spans,
+ * which are then printed as a report and written as a trace in the Chrome
+ * trace event format, as configured with CGSetStartupProfile.
+ */
+
+#include "libcg.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+#define MAX_SPANS 4096
+#define MAX_THREADS 64
+#define DETAIL_SIZE 64
+/* The number of individual spans in the report. */
+#define SLOWEST_SPANS 16
+
+struct Span {
+	const char	*name;
+	char		 detail[DETAIL_SIZE];
+	int		 thread;
+	double		 start;
+	double		 end;
+	size_t		 bytes;
+};
+
+/* The spans of one name together, for the report. */
+struct SpanTotal {
+	const char	*name;
+	int		 count;
+	double		 time;
+	double		 maxTime;
+	size_t		 bytes;
+};
+
+static struct CGStartupProfile profile = { false, NULL };
+
+static pthread_mutex_t spanMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct Span spans[MAX_SPANS];
+static int spanCount = 0;
+static int droppedSpans = 0;
+static const char *threadNames[MAX_THREADS];
+static int threadCount = 0;
+/* Read without the mutex, so spans cost nothing once startup is over. */
+static bool recording = false;
+
+static __thread int threadIndex = -1;
+
+/**
+ * Like getTime, which texenc doesn't link.
+ */
+static double
+getSpanTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+CGSetStartupProfile(const struct CGStartupProfile *newProfile) {
+	pthread_mutex_lock(&spanMutex);
+	memcpy(&profile, newProfile, sizeof(profile));
+	__atomic_store_n(&recording, profile.report || profile.tracePath != NULL,
+					 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&spanMutex);
+}
+
+/**
+ * Needs the mutex.
+ */
+static int
+getThreadIndex(void) {
+	if (threadIndex == -1 && threadCount < MAX_THREADS) {
+		threadIndex = threadCount++;
+		threadNames[threadIndex] = NULL;
+	}
+
+	return threadIndex;
+}
+
+void
+setSpanThreadName(const char *name) {
+	int thread;
+
+	if (!__atomic_load_n(&recording, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&spanMutex);
+	thread = getThreadIndex();
+	if (thread != -1)
+		threadNames[thread] = name;
+	pthread_mutex_unlock(&spanMutex);
+}
+
+int
+beginSpan(const char *name, const char *detail) {
+	struct Span *span;
+	size_t length;
+	int index = -1;
+
+	if (!__atomic_load_n(&recording, __ATOMIC_RELAXED))
+		return -1;
+
+	pthread_mutex_lock(&spanMutex);
+	if (!recording) {
+		pthread_mutex_unlock(&spanMutex);
+		return -1;
+	}
+
+	if (spanCount == MAX_SPANS) {
+		droppedSpans++;
+		pthread_mutex_unlock(&spanMutex);
+		return -1;
+	}
+
+	index = spanCount++;
+	span = &spans[index];
+	span->name = name;
+	span->thread = getThreadIndex();
+	span->end = 0.0;
+	span->bytes = 0;
+
+	/* Paths are cut at the front, since their end tells most. */
+	span->detail[0] = '\0';
+	if (detail != NULL) {
+		length = strlen(detail);
+		if (length < DETAIL_SIZE)
+			memcpy(span->detail, detail, length + 1);
+		else
+			snprintf(span->detail, DETAIL_SIZE, "...%s",
+					 detail + length - (DETAIL_SIZE - 4));
+	}
+
+	span->start = getSpanTime();
+	pthread_mutex_unlock(&spanMutex);
+
+	return index;
+}
+
+void
+endSpan(int index, size_t bytes) {
+	double end;
+
+	if (index == -1)
+		return;
+
+	end = getSpanTime();
+	pthread_mutex_lock(&spanMutex);
+	spans[index].end = end;
+	spans[index].bytes = bytes;
+	pthread_mutex_unlock(&spanMutex);
+}
+
+static int
+compareTotals(const void *a, const void *b) {
+	const struct SpanTotal *totalA = a;
+	const struct SpanTotal *totalB = b;
+
+	return (totalA->time < totalB->time) - (totalA->time > totalB->time);
+}
+
+static int
+compareSpans(const void *a, const void *b) {
+	double durationA = spans[*(const int *) a].end
+					 - spans[*(const int *) a].start;
+	double durationB = spans[*(const int *) b].end
+					 - spans[*(const int *) b].start;
+
+	return (durationA < durationB) - (durationA > durationB);
+}
+
+static void
+printReport(double start, double end) {
+	struct SpanTotal *totals;
+	int *order;
+	int totalCount = 0;
+	int i;
+	int j;
+
+	totals = cgCalloc(spanCount, sizeof(struct SpanTotal));
+	order = cgMalloc(spanCount * sizeof(int));
+	if (totals == NULL || order == NULL) {
+		fputs("[CGStartup] Failed to allocate the report!\n", stderr);
+		cgFree(totals);
+		cgFree(order);
+		return;
+	}
+
+	for (i = 0; i < spanCount; i++) {
+		for (j = 0; j < totalCount && strcmp(totals[j].name, spans[i].name)
+			 != 0; j++)
+			continue;
+
+		if (j == totalCount)
+			totals[totalCount++].name = spans[i].name;
+		totals[j].count++;
+		totals[j].time += spans[i].end - spans[i].start;
+		totals[j].bytes += spans[i].bytes;
+		if (spans[i].end - spans[i].start > totals[j].maxTime)
+			totals[j].maxTime = spans[i].end - spans[i].start;
+		order[i] = i;
+	}
+
+	qsort(totals, totalCount, sizeof(struct SpanTotal), compareTotals);
+	qsort(order, spanCount, sizeof(int), compareSpans);
+
+	printf("Startup took %.3f ms until the first frame.\n",
+		   (end - start) * 1000.0);
+	printf("%-24s %6s %10s %10s %12s\n", "stage", "count", "total ms",
+		   "max ms", "bytes");
+	for (i = 0; i < totalCount; i++)
+		printf("%-24s %6i %10.3f %10.3f %12zu\n", totals[i].name,
+			   totals[i].count, totals[i].time * 1000.0,
+			   totals[i].maxTime * 1000.0, totals[i].bytes);
+
+	printf("\n%-24s %10s %12s %6s %s\n", "slowest", "ms", "bytes", "thread",
+		   "detail");
+	for (i = 0; i < spanCount && i < SLOWEST_SPANS; i++)
+		printf("%-24s %10.3f %12zu %6i %s\n", spans[order[i]].name,
+			   (spans[order[i]].end - spans[order[i]].start) * 1000.0,
+			   spans[order[i]].bytes, spans[order[i]].thread,
+			   spans[order[i]].detail);
+
+	if (droppedSpans > 0)
+		printf("%i spans didn't fit and were dropped.\n", droppedSpans);
+
+	cgFree(totals);
+	cgFree(order);
+}
+
+/**
+ * Writes the spans as complete events of the Chrome trace event format, which
+ * chrome://tracing and Perfetto can open. Timestamps are in microseconds since
+ * the first span.
+ */
+static void
+writeStartupTrace(const char *path, double start) {
+	FILE *file;
+	int i;
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		perror("[CGStartup] fopen() failure");
+		return;
+	}
+
+	fputs("{\"traceEvents\":[\n", file);
+	for (i = 0; i < threadCount; i++) {
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%i,\"args\":{\"name\":", i);
+		writeJSONString(file, threadNames[i] != NULL ? threadNames[i]
+													: "thread");
+		fputs("}},\n", file);
+	}
+
+	for (i = 0; i < spanCount; i++) {
+		fputs("{\"name\":", file);
+		writeJSONString(file, spans[i].name);
+		fprintf(file, ",\"cat\":\"startup\",\"ph\":\"X\",\"ts\":%.3f,"
+				"\"dur\":%.3f,\"pid\":1,\"tid\":%i,\"args\":{\"bytes\":%zu,"
+				"\"detail\":", (spans[i].start - start) * 1e6,
+				(spans[i].end - spans[i].start) * 1e6, spans[i].thread,
+				spans[i].bytes);
+		writeJSONString(file, spans[i].detail);
+		fprintf(file, "}}%s\n", i + 1 < spanCount ? "," : "");
+	}
+	fputs("]}\n", file);
+
+	if (fclose(file) != 0)
+		fprintf(stderr, "[CGStartup] Failed to write '%s'!\n", path);
+}
+
+void
+finishStartup(void) {
+	double start;
+	double end;
+	int i;
+
+	if (!__atomic_load_n(&recording, __ATOMIC_RELAXED))
+		return;
+
+	/* Spans that are still open (like uploads in flight) end here. */
+	end = getSpanTime();
+	pthread_mutex_lock(&spanMutex);
+	__atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+
+	start = end;
+	for (i = 0; i < spanCount; i++) {
+		if (spans[i].end == 0.0)
+			spans[i].end = end;
+		if (spans[i].start < start)
+			start = spans[i].start;
+	}
+
+	if (spanCount > 0) {
+		if (profile.report)
+			printReport(start, end);
+		if (profile.tracePath != NULL)
+			writeStartupTrace(profile.tracePath, start);
+	}
+
+	pthread_mutex_unlock(&spanMutex);
+}
@@ -0,0 +1,420 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Render statistics. libcg.h routes the GL entry points that matter for the
+ * cost of a frame through the wrappers below, which count what they do before
+ * calling the real entry point. The counts are kept per thread, and those of
+ * the render thread are collected by CGStart at the end of every frame.
+ */
+
+/* The wrappers call the real entry points. */
+#undef CG_GL_WRAP
+
+#include "libcg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "internal.h"
+
+/* The number of frames the averages are taken over. */
+#define AVERAGE_FRAMES 60
+
+static __thread struct CGRenderStats currentStats;
+/* What the wrappers set on the context of the calling thread, starting with
+ * the defaults of GL. */
+static __thread struct GLState glState = {
+	.activeTexture = GL_TEXTURE0,
+	.blendSourceRGB = GL_ONE,
+	.blendDestinationRGB = GL_ZERO,
+	.blendSourceAlpha = GL_ONE,
+	.blendDestinationAlpha = GL_ZERO,
+};
+
+static struct CGRenderStats recentStats[AVERAGE_FRAMES];
+static unsigned int recentStatsCount = 0;
+static struct CGRenderStats averageStats;
+
+static uint64_t
+countTriangles(GLenum mode, GLsizei count) {
+	switch (mode) {
+		case GL_TRIANGLES:
+			return count / 3;
+		case GL_TRIANGLE_STRIP:
+		case GL_TRIANGLE_FAN:
+			return count > 2 ? count - 2 : 0;
+		case GL_TRIANGLES_ADJACENCY:
+			return count / 6;
+		case GL_TRIANGLE_STRIP_ADJACENCY:
+			return count > 4 ? (count - 4) / 2 : 0;
+		default:
+			return 0;
+	}
+}
+
+static void
+countDraw(GLenum mode, GLsizei count, GLsizei instances) {
+	currentStats.drawCalls++;
+	currentStats.triangles += countTriangles(mode, count) * instances;
+}
+
+void
+CGDrawArrays(GLenum mode, GLint first, GLsizei count) {
+	countDraw(mode, count, 1);
+	glDrawArrays(mode, first, count);
+}
+
+void
+CGDrawArraysInstanced(GLenum mode, GLint first, GLsizei count,
+					  GLsizei instances) {
+	countDraw(mode, count, instances);
+	glDrawArraysInstanced(mode, first, count, instances);
+}
+
+void
+CGDrawElements(GLenum mode, GLsizei count, GLenum type, const void *indices) {
+	countDraw(mode, count, 1);
+	glDrawElements(mode, count, type, indices);
+}
+
+void
+CGDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type,
+						const void *indices, GLsizei instances) {
+	countDraw(mode, count, instances);
+	glDrawElementsInstanced(mode, count, type, indices, instances);
+}
+
+void
+CGDrawRangeElements(GLenum mode, GLuint start, GLuint end, GLsizei count,
+					GLenum type, const void *indices) {
+	countDraw(mode, count, 1);
+	glDrawRangeElements(mode, start, end, count, type, indices);
+}
+
+void
+CGUseProgram(GLuint program) {
+	currentStats.programBinds++;
+	glState.program = program;
+	glUseProgram(program);
+}
+
+void
+CGBindTexture(GLenum target, GLuint texture) {
+	unsigned int unit = glState.activeTexture - GL_TEXTURE0;
+
+	currentStats.textureBinds++;
+	if (target == GL_TEXTURE_2D && unit < SHADOWED_TEXTURE_UNITS)
+		glState.textures[unit] = texture;
+	glBindTexture(target, texture);
+}
+
+void
+CGBufferData(GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
+	if (data != NULL)
+		currentStats.bufferUploadBytes += size;
+	glBufferData(target, size, data, usage);
+	trackBufferData(target, size);
+}
+
+void
+CGBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size,
+				const void *data) {
+	currentStats.bufferUploadBytes += size;
+	glBufferSubData(target, offset, size, data);
+}
+
+void
+CGActiveTexture(GLenum unit) {
+	currentStats.stateChanges++;
+	glState.activeTexture = unit;
+	glActiveTexture(unit);
+}
+
+/**
+ * Returns where the binding of a buffer target is kept in the state, or -1 if
+ * it isn't.
+ */
+int
+getBufferTarget(GLenum target) {
+	switch (target) {
+		case GL_ARRAY_BUFFER:
+			return BT_ARRAY;
+		case GL_ELEMENT_ARRAY_BUFFER:
+			return BT_ELEMENT_ARRAY;
+		case GL_UNIFORM_BUFFER:
+			return BT_UNIFORM;
+		case GL_PIXEL_UNPACK_BUFFER:
+			return BT_PIXEL_UNPACK;
+		case GL_PIXEL_PACK_BUFFER:
+			return BT_PIXEL_PACK;
+		case GL_COPY_READ_BUFFER:
+			return BT_COPY_READ;
+		case GL_COPY_WRITE_BUFFER:
+			return BT_COPY_WRITE;
+		case GL_TRANSFORM_FEEDBACK_BUFFER:
+			return BT_TRANSFORM_FEEDBACK;
+		default:
+			return -1;
+	}
+}
+
+static void
+setBufferBinding(GLenum target, GLuint buffer) {
+	int index = getBufferTarget(target);
+
+	if (index == -1)
+		return;
+
+	glState.buffers[index] = buffer;
+	if (index == BT_ELEMENT_ARRAY)
+		glState.elementBufferKnown = true;
+}
+
+void
+CGBindBuffer(GLenum target, GLuint buffer) {
+	currentStats.stateChanges++;
+	setBufferBinding(target, buffer);
+	glBindBuffer(target, buffer);
+}
+
+void
+CGBindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+	currentStats.stateChanges++;
+	setBufferBinding(target, buffer);
+	glBindBufferBase(target, index, buffer);
+}
+
+void
+CGBindBufferRange(GLenum target, GLuint index, GLuint buffer,
+				  GLintptr offset, GLsizeiptr size) {
+	currentStats.stateChanges++;
+	setBufferBinding(target, buffer);
+	glBindBufferRange(target, index, buffer, offset, size);
+}
+
+void
+CGBindFramebuffer(GLenum target, GLuint framebuffer) {
+	currentStats.stateChanges++;
+	glBindFramebuffer(target, framebuffer);
+}
+
+void
+CGBindVertexArray(GLuint array) {
+	currentStats.stateChanges++;
+	/* The element array binding is part of the vertex array. */
+	glState.vertexArray = array;
+	glState.elementBufferKnown = false;
+	glBindVertexArray(array);
+}
+
+void
+CGBlendFunc(GLenum source, GLenum destination) {
+	currentStats.stateChanges++;
+	glState.blendSourceRGB = glState.blendSourceAlpha = source;
+	glState.blendDestinationRGB = glState.blendDestinationAlpha = destination;
+	glBlendFunc(source, destination);
+}
+
+void
+CGBlendFuncSeparate(GLenum sourceRGB, GLenum destinationRGB,
+					GLenum sourceAlpha, GLenum destinationAlpha) {
+	currentStats.stateChanges++;
+	glState.blendSourceRGB = sourceRGB;
+	glState.blendDestinationRGB = destinationRGB;
+	glState.blendSourceAlpha = sourceAlpha;
+	glState.blendDestinationAlpha = destinationAlpha;
+	glBlendFuncSeparate(sourceRGB, destinationRGB, sourceAlpha,
+						destinationAlpha);
+}
+
+void
+CGCullFace(GLenum mode) {
+	currentStats.stateChanges++;
+	glCullFace(mode);
+}
+
+void
+CGDepthFunc(GLenum func) {
+	currentStats.stateChanges++;
+	glDepthFunc(func);
+}
+
+void
+CGDepthMask(GLboolean flag) {
+	currentStats.stateChanges++;
+	glDepthMask(flag);
+}
+
+static void
+setCapability(GLenum capability, bool enabled) {
+	switch (capability) {
+		case GL_BLEND:
+			glState.blend = enabled;
+			break;
+		case GL_CULL_FACE:
+			glState.cullFace = enabled;
+			break;
+		case GL_DEPTH_TEST:
+			glState.depthTest = enabled;
+			break;
+		case GL_SCISSOR_TEST:
+			glState.scissorTest = enabled;
+			break;
+		default:
+			break;
+	}
+}
+
+void
+CGDisable(GLenum capability) {
+	currentStats.stateChanges++;
+	setCapability(capability, false);
+	glDisable(capability);
+}
+
+void
+CGEnable(GLenum capability) {
+	currentStats.stateChanges++;
+	setCapability(capability, true);
+	glEnable(capability);
+}
+
+void
+CGScissor(GLint x, GLint y, GLsizei width, GLsizei height) {
+	currentStats.stateChanges++;
+	glScissor(x, y, width, height);
+}
+
+void
+CGViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+	currentStats.stateChanges++;
+	glState.viewport[0] = x;
+	glState.viewport[1] = y;
+	glState.viewport[2] = width;
+	glState.viewport[3] = height;
+	glViewport(x, y, width, height);
+}
+
+void
+beginFrameStats(void) {
+	memset(&currentStats, 0, sizeof(currentStats));
+}
+
+void
+endFrameStats(double renderTime, double swapTime) {
+	struct CGRenderStats *stats;
+	unsigned int count;
+	unsigned int i;
+
+	currentStats.renderTime = renderTime;
+	currentStats.swapTime = swapTime;
+	recentStats[recentStatsCount % AVERAGE_FRAMES] = currentStats;
+	recentStatsCount++;
+
+	/* Summed up again every frame, so nothing drifts. */
+	count = recentStatsCount < AVERAGE_FRAMES ? recentStatsCount
+											  : AVERAGE_FRAMES;
+	memset(&averageStats, 0, sizeof(averageStats));
+	for (i = 0; i < count; i++) {
+		stats = &recentStats[i];
+		averageStats.drawCalls += stats->drawCalls;
+		averageStats.triangles += stats->triangles;
+		averageStats.programBinds += stats->programBinds;
+		averageStats.textureBinds += stats->textureBinds;
+		averageStats.bufferUploadBytes += stats->bufferUploadBytes;
+		averageStats.stateChanges += stats->stateChanges;
+		averageStats.renderTime += stats->renderTime;
+		averageStats.swapTime += stats->swapTime;
+	}
+
+	averageStats.drawCalls /= count;
+	averageStats.triangles /= count;
+	averageStats.programBinds /= count;
+	averageStats.textureBinds /= count;
+	averageStats.bufferUploadBytes /= count;
+	averageStats.stateChanges /= count;
+	averageStats.renderTime /= count;
+	averageStats.swapTime /= count;
+}
+
+const struct GLState *
+getGLState(void) {
+	return &glState;
+}
+
+void
+restoreGLBindings(void) {
+	/* The element array buffer comes back with the vertex array. */
+	glBindBuffer(GL_ARRAY_BUFFER, glState.buffers[BT_ARRAY]);
+	glBindVertexArray(glState.vertexArray);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, glState.textures[0]);
+	glActiveTexture(glState.activeTexture);
+	glUseProgram(glState.program);
+}
+
+void
+unbindDeletedBuffer(GLuint buffer) {
+	int i;
+
+	for (i = 0; i < BUFFER_TARGETS; i++) {
+		if (glState.buffers[i] == buffer)
+			glState.buffers[i] = 0;
+	}
+}
+
+void
+unbindDeletedTexture(GLuint texture) {
+	int i;
+
+	for (i = 0; i < SHADOWED_TEXTURE_UNITS; i++) {
+		if (glState.textures[i] == texture)
+			glState.textures[i] = 0;
+	}
+}
+
+const struct CGRenderStats *
+getLastFrameStats(void) {
+	return recentStatsCount == 0
+		 ? NULL : &recentStats[(recentStatsCount - 1) % AVERAGE_FRAMES];
+}
+
+bool
+CGGetRenderStats(struct CGRenderStats *last, struct CGRenderStats *average) {
+	if (recentStatsCount == 0)
+		return false;
+
+	if (last != NULL)
+		memcpy(last, getLastFrameStats(), sizeof(*last));
+	if (average != NULL)
+		memcpy(average, &averageStats, sizeof(*average));
+	return true;
+}
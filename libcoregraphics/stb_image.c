@@ -1,2 +1,13 @@
+#include <stddef.h>
+
+/* Defined in decoder.c, so stb_image can decode into memory of libcg. */
+void *cgSTBIMalloc(size_t size);
+void *cgSTBIRealloc(void *pointer, size_t size);
+void cgSTBIFree(void *pointer);
+
+#define STBI_MALLOC(size) cgSTBIMalloc(size)
+#define STBI_REALLOC(pointer, size) cgSTBIRealloc(pointer, size)
+#define STBI_FREE(pointer) cgSTBIFree(pointer)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -0,0 +1,337 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Tracing. Every thread that enters a zone gets a track, a ring buffer of its
+ * most recent zones that only the thread itself writes to, so recording a
+ * zone takes no lock. Counters are recorded in the same way. CGWriteTrace
+ * copies the tracks while they're written and drops the events that were
+ * overwritten meanwhile. The GPU zones of libcg.c are resolved into a track of
+ * their own on the same clock.
+ */
+
+#include "libcg.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+/* A power of two, so the indices can keep counting when they wrap. */
+#define TRACK_EVENTS 16384
+#define MAX_TRACKS 64
+
+struct TraceEvent {
+	const char	*name;
+	uint64_t	 start;
+	/* zero for counters */
+	uint64_t	 end;
+	double		 value;
+};
+
+struct TraceTrack {
+	/* set through CGSetThreadName, may change while the trace is written */
+	const char	*name;
+	int		 id;
+	/* the number of events ever pushed, only written by the owner */
+	uint64_t	 head;
+	struct TraceEvent events[TRACK_EVENTS];
+};
+
+static pthread_mutex_t trackMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Tracks are never freed, so threads don't have to unregister theirs. */
+static struct TraceTrack *tracks[MAX_TRACKS];
+static int trackCount = 0;
+static bool tracing = false;
+
+static __thread struct TraceTrack *threadTrack = NULL;
+static __thread const char *threadName = NULL;
+/* Set once no track could be created, so that isn't tried for every zone. */
+static __thread bool threadUntracked = false;
+
+uint64_t
+getTraceTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool
+isTracing(void) {
+	return __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+}
+
+void
+CGSetTracing(bool enabled) {
+	__atomic_store_n(&tracing, enabled, __ATOMIC_RELAXED);
+}
+
+struct TraceTrack *
+createTraceTrack(const char *name) {
+	struct TraceTrack *track;
+
+	pthread_mutex_lock(&trackMutex);
+	if (trackCount == MAX_TRACKS) {
+		pthread_mutex_unlock(&trackMutex);
+		return NULL;
+	}
+
+	track = cgCalloc(1, sizeof(struct TraceTrack));
+	if (track == NULL) {
+		pthread_mutex_unlock(&trackMutex);
+		fputs("[CGTrace] Failed to allocate a track!\n", stderr);
+		return NULL;
+	}
+
+	track->name = name;
+	track->id = trackCount;
+	tracks[trackCount] = track;
+	__atomic_store_n(&trackCount, trackCount + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trackMutex);
+
+	return track;
+}
+
+static void
+pushEvent(struct TraceTrack *track, const char *name, uint64_t start,
+		  uint64_t end, double value) {
+	struct TraceEvent *event;
+
+	event = &track->events[track->head % TRACK_EVENTS];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+	event->value = value;
+	__atomic_store_n(&track->head, track->head + 1, __ATOMIC_RELEASE);
+}
+
+void
+pushTraceEvent(struct TraceTrack *track, const char *name, uint64_t start,
+			   uint64_t end) {
+	pushEvent(track, name, start, end, 0.0);
+}
+
+void
+CGSetThreadName(const char *name) {
+	threadName = name;
+	if (threadTrack != NULL)
+		__atomic_store_n(&threadTrack->name, name, __ATOMIC_RELAXED);
+
+	setSpanThreadName(name);
+}
+
+/**
+ * Returns the track of the calling thread, creating it if needed, or NULL if
+ * there's no room left.
+ */
+static struct TraceTrack *
+getThreadTrack(void) {
+	if (threadTrack == NULL && !threadUntracked) {
+		threadTrack = createTraceTrack(threadName != NULL ? threadName
+													   : "thread");
+		threadUntracked = threadTrack == NULL;
+	}
+
+	return threadTrack;
+}
+
+struct CGTraceZone
+CGBeginTraceZone(const char *name) {
+	struct CGTraceZone zone = { NULL, 0 };
+
+	if (!isTracing() || getThreadTrack() == NULL)
+		return zone;
+
+	zone.name = name;
+	zone.start = getTraceTime();
+	return zone;
+}
+
+void
+CGEndTraceZone(struct CGTraceZone *zone) {
+	/* Zones that began while tracing are recorded even if it stopped since,
+	 * so the ones around CGSetTracing are complete. */
+	if (zone->name != NULL)
+		pushTraceEvent(threadTrack, zone->name, zone->start, getTraceTime());
+}
+
+void
+recordTraceZone(const char *name, uint64_t start, uint64_t end) {
+	if (isTracing() && getThreadTrack() != NULL)
+		pushEvent(threadTrack, name, start, end, 0.0);
+}
+
+void
+CGTraceCounter(const char *name, double value) {
+	if (isTracing() && getThreadTrack() != NULL)
+		pushEvent(threadTrack, name, getTraceTime(), 0, value);
+}
+
+void
+writeJSONString(FILE *file, const char *string) {
+	fputc('"', file);
+	for (; *string != '\0'; string++) {
+		if (*string == '"' || *string == '\\')
+			fprintf(file, "\\%c", *string);
+		else if ((unsigned char) *string < 0x20)
+			fprintf(file, "\\u%04x", *string);
+		else
+			fputc(*string, file);
+	}
+	fputc('"', file);
+}
+
+/**
+ * Copies the events of a track that are still there into events, which holds
+ * TRACK_EVENTS, and returns their count.
+ */
+static size_t
+copyTrack(struct TraceTrack *track, struct TraceEvent *events) {
+	uint64_t head;
+	uint64_t first;
+	uint64_t valid;
+	uint64_t i;
+
+	head = __atomic_load_n(&track->head, __ATOMIC_ACQUIRE);
+	first = head > TRACK_EVENTS ? head - TRACK_EVENTS : 0;
+	for (i = first; i < head; i++)
+		events[i - first] = track->events[i % TRACK_EVENTS];
+
+	/* Whatever the owner pushed meanwhile overwrote the oldest events, and
+	 * the event it may be writing right now, at the head it hasn't published
+	 * yet, takes one more slot. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	valid = __atomic_load_n(&track->head, __ATOMIC_RELAXED) + 1;
+	valid = valid > TRACK_EVENTS ? valid - TRACK_EVENTS : 0;
+	if (valid <= first)
+		return head - first;
+	if (valid >= head)
+		return 0;
+
+	memmove(events, events + (valid - first),
+			(head - valid) * sizeof(struct TraceEvent));
+	return head - valid;
+}
+
+/**
+ * Whether an event (partly) happened at or after since.
+ */
+static bool
+isEventSince(const struct TraceEvent *event, uint64_t since) {
+	return (event->end == 0 ? event->start : event->end) >= since;
+}
+
+bool
+writeTrace(const char *path, uint64_t since) {
+	struct TraceEvent *events[MAX_TRACKS] = { NULL };
+	struct TraceEvent *event;
+	size_t counts[MAX_TRACKS];
+	uint64_t origin = UINT64_MAX;
+	FILE *file;
+	bool first = true;
+	bool success = false;
+	int count;
+	int i;
+	size_t j;
+
+	count = __atomic_load_n(&trackCount, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		events[i] = cgMalloc(TRACK_EVENTS * sizeof(struct TraceEvent));
+		if (events[i] == NULL) {
+			fputs("[CGWriteTrace] Failed to allocate a track!\n", stderr);
+			goto end;
+		}
+
+		counts[i] = copyTrack(tracks[i], events[i]);
+		for (j = 0; j < counts[i]; j++) {
+			if (isEventSince(&events[i][j], since)
+				&& events[i][j].start < origin)
+				origin = events[i][j].start;
+		}
+	}
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		perror("[CGWriteTrace] fopen() failure");
+		goto end;
+	}
+
+	/* Complete and counter events of the Chrome trace event format, which
+	 * chrome://tracing and Perfetto can open, in microseconds. */
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+	for (i = 0; i < count; i++) {
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%i,\"args\":{\"name\":", first ? "" : ",", i);
+		writeJSONString(file, __atomic_load_n(&tracks[i]->name,
+											  __ATOMIC_RELAXED));
+		fputs("}}", file);
+		first = false;
+	}
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < counts[i]; j++) {
+			event = &events[i][j];
+			if (!isEventSince(event, since))
+				continue;
+
+			fputs(",\n{\"name\":", file);
+			writeJSONString(file, event->name);
+			if (event->end == 0)
+				fprintf(file, ",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+						"\"tid\":%i,\"args\":{\"value\":%g}}",
+						(event->start - origin) / 1e3, i, event->value);
+			else
+				fprintf(file, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+						"\"pid\":1,\"tid\":%i}",
+						(event->start - origin) / 1e3,
+						(event->end - event->start) / 1e3, i);
+		}
+	}
+	fputs("\n]}\n", file);
+
+	success = fclose(file) == 0;
+	if (!success)
+		fprintf(stderr, "[CGWriteTrace] Failed to write '%s'!\n", path);
+
+end:
+	for (i = 0; i < count; i++)
+		cgFree(events[i]);
+	return success;
+}
+
+bool
+CGWriteTrace(const char *path) {
+	return writeTrace(path, 0);
+}
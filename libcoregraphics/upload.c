@@ -0,0 +1,641 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * The loader thread. It runs a second OpenGL context that shares its objects
+ * with the context of the render thread, so texture and buffer uploads can be
+ * performed without stalling the frame. Every upload is followed by a fence,
+ * which the render thread checks before using the object.
+ *
+ * Uploads are scheduled by priority and split into row bands (textures) or
+ * ranges (buffers), so the loader never transfers more than the per-frame
+ * budget between two calls of beginUploadFrame by CGStart.
+ */
+
+#include "libcg.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/glew.h>
+#include <GL/glx.h>
+
+#include "internal.h"
+
+enum UploadKind {
+	UK_BUFFER,
+	UK_TEXTURE,
+};
+
+enum LoaderState {
+	LS_STOPPED,
+	LS_STARTING,
+	LS_RUNNING,
+	LS_FAILED,
+};
+
+struct CGUpload {
+	enum UploadKind	 kind;
+	union {
+		struct CGBufferUploadInfo buffer;
+		struct CGTextureUploadInfo texture;
+	} info;
+	int		 priority;
+	/* rows (textures) or bytes (buffers) transferred so far */
+	size_t		 progress;
+	GLsync		 fence;
+	/* set by the loader thread once the commands are submitted */
+	bool		 submitted;
+	/* set when a thread waits for it, which lets it ignore the budget */
+	bool		 waited;
+	struct CGUpload	*next;
+};
+
+static pthread_t loaderThread;
+static GLXContext loaderContext = NULL;
+static GLXPbuffer loaderPbuffer = None;
+
+/* Everything below is protected by queueMutex. */
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t submittedCond = PTHREAD_COND_INITIALIZER;
+static enum LoaderState loaderState = LS_STOPPED;
+static bool loaderStopping = false;
+static struct CGUpload *queueHead = NULL;
+static struct CGUpload *queueTail = NULL;
+/* Queued uploads that a thread waits for. The budget only refills when a frame
+ * starts, and the waiting thread may be the one that starts frames. */
+static size_t waitedCount = 0;
+
+/* The per-frame budget, zero meaning unlimited, and what's left of it. */
+static size_t budgetBytes = 16 * 1024 * 1024;
+static double budgetTime = 0.004;
+static size_t creditBytes = 16 * 1024 * 1024;
+static double creditTime = 0.004;
+
+/* What the loader did since the last call to beginUploadFrame. */
+static size_t frameBytes = 0;
+static double frameTime = 0.0;
+
+static size_t
+componentCount(GLenum format) {
+	switch (format) {
+		case GL_RED:
+		case GL_DEPTH_COMPONENT:
+			return 1;
+		case GL_RG:
+			return 2;
+		case GL_RGB:
+		case GL_BGR:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+static size_t
+componentSize(GLenum type) {
+	switch (type) {
+		case GL_UNSIGNED_SHORT:
+		case GL_SHORT:
+		case GL_HALF_FLOAT:
+			return 2;
+		case GL_UNSIGNED_INT:
+		case GL_INT:
+		case GL_FLOAT:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+/**
+ * The size of a row of the source pixels. Rows are tightly packed.
+ */
+static size_t
+textureRowSize(const struct CGTextureUploadInfo *texture) {
+	return (size_t) texture->width * componentCount(texture->format)
+		 * componentSize(texture->type);
+}
+
+/**
+ * The amount of work (rows or bytes) left of the upload.
+ */
+static size_t
+remainingWork(const struct CGUpload *upload) {
+	if (upload->kind == UK_TEXTURE)
+		return upload->info.texture.height - upload->progress;
+	return upload->info.buffer.size - upload->progress;
+}
+
+static bool
+hasCredit(void) {
+	if (loaderStopping || waitedCount > 0)
+		return true;
+
+	return (budgetBytes == 0 || creditBytes > 0)
+		&& (budgetTime == 0.0 || creditTime > 0.0);
+}
+
+/**
+ * Returns the queued upload with the highest priority, the oldest one first if
+ * there are several. Uploads that are waited for go before all others.
+ */
+static struct CGUpload *
+nextUpload(void) {
+	struct CGUpload *best = queueHead;
+	struct CGUpload *upload;
+
+	for (upload = queueHead; upload != NULL; upload = upload->next) {
+		if (upload->waited != best->waited ? upload->waited
+			: upload->priority > best->priority)
+			best = upload;
+	}
+
+	return best;
+}
+
+static void
+removeUpload(struct CGUpload *upload) {
+	struct CGUpload **link = &queueHead;
+	struct CGUpload *previous = NULL;
+
+	while (*link != upload) {
+		previous = *link;
+		link = &(*link)->next;
+	}
+
+	*link = upload->next;
+	if (queueTail == upload)
+		queueTail = previous;
+	upload->next = NULL;
+}
+
+/**
+ * Decides how much of the upload fits in the remaining credit, in rows or
+ * bytes. At least one row is always transferred, so rows larger than the
+ * budget still make progress. Uploads that are waited for go in one piece.
+ */
+static size_t
+chunkSize(const struct CGUpload *upload) {
+	size_t remaining = remainingWork(upload);
+	size_t rowSize;
+	size_t rows;
+
+	if (budgetBytes == 0 || loaderStopping || upload->waited)
+		return remaining;
+
+	if (upload->kind == UK_BUFFER)
+		return remaining < creditBytes ? remaining : creditBytes;
+
+	/* Compressed levels are small and go in one piece. */
+	if (upload->info.texture.compressedSize != 0)
+		return remaining;
+
+	rowSize = textureRowSize(&upload->info.texture);
+	rows = rowSize == 0 ? remaining : creditBytes / rowSize;
+	if (rows == 0)
+		rows = 1;
+
+	return remaining < rows ? remaining : rows;
+}
+
+/**
+ * Transfers the given amount of rows or bytes of the upload on the calling
+ * thread, which must have a current context. Returns the number of bytes
+ * transferred.
+ */
+static size_t
+performChunk(struct CGUpload *upload, size_t amount) {
+	struct CGBufferUploadInfo *buffer;
+	struct CGTextureUploadInfo *texture;
+	const unsigned char *source;
+	size_t rowSize;
+	size_t bytes = 0;
+	GLuint staging;
+	GLintptr stagingOffset;
+	CG_FUNCTION_ZONE();
+
+	switch (upload->kind) {
+		case UK_BUFFER:
+			buffer = &upload->info.buffer;
+			source = (const unsigned char *) buffer->data + upload->progress;
+			bytes = amount;
+
+			glBindBuffer(buffer->target, buffer->buffer);
+			if (getStagingOffset(source, &staging, &stagingOffset)) {
+				/* Staged data is copied by the GPU. */
+				if (buffer->usage != 0 && upload->progress == 0)
+					glBufferData(buffer->target, buffer->size, NULL,
+								 buffer->usage);
+				glBindBuffer(GL_COPY_READ_BUFFER, staging);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, buffer->target,
+									stagingOffset,
+									buffer->offset + upload->progress, amount);
+				glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			} else if (buffer->usage != 0 && upload->progress == 0
+				&& amount == (size_t) buffer->size) {
+				glBufferData(buffer->target, buffer->size, source,
+							 buffer->usage);
+			} else {
+				if (buffer->usage != 0 && upload->progress == 0)
+					glBufferData(buffer->target, buffer->size, NULL,
+								 buffer->usage);
+				glBufferSubData(buffer->target,
+								buffer->offset + upload->progress, amount,
+								source);
+			}
+			glBindBuffer(buffer->target, 0);
+			break;
+		case UK_TEXTURE:
+			texture = &upload->info.texture;
+			if (texture->compressedSize != 0) {
+				bytes = texture->compressedSize;
+				glBindTexture(GL_TEXTURE_2D, texture->texture);
+				glCompressedTexImage2D(GL_TEXTURE_2D, texture->level,
+									   texture->internalFormat,
+									   texture->width, texture->height, 0,
+									   texture->compressedSize,
+									   bindUnpackSource(texture->pixels));
+				glBindTexture(GL_TEXTURE_2D, 0);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				break;
+			}
+
+			rowSize = textureRowSize(texture);
+			source = (const unsigned char *) texture->pixels
+				   + upload->progress * rowSize;
+			bytes = amount * rowSize;
+			/* Staged pixels are read from the buffer instead. */
+			source = bindUnpackSource(source);
+
+			glBindTexture(GL_TEXTURE_2D, texture->texture);
+			if (upload->progress == 0 && amount == (size_t) texture->height) {
+				glTexImage2D(GL_TEXTURE_2D, texture->level,
+							 texture->internalFormat, texture->width,
+							 texture->height, 0, texture->format,
+							 texture->type, source);
+			} else {
+				if (upload->progress == 0)
+					glTexImage2D(GL_TEXTURE_2D, texture->level,
+								 texture->internalFormat, texture->width,
+								 texture->height, 0, texture->format,
+								 texture->type, NULL);
+				glTexSubImage2D(GL_TEXTURE_2D, texture->level, 0,
+								upload->progress, texture->width, amount,
+								texture->format, texture->type, source);
+			}
+			if (texture->generateMipmap
+				&& upload->progress + amount == (size_t) texture->height)
+				glGenerateMipmap(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			break;
+	}
+
+	upload->progress += amount;
+
+	/* Other contexts only see the work (and the fence) once it reaches the
+	 * server, and the budget is meant for this frame. */
+	if (remainingWork(upload) == 0)
+		upload->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	checkForErrors("performChunk", "end");
+
+	return bytes;
+}
+
+/**
+ * Calls the release function of a finished upload.
+ */
+static void
+releaseSource(struct CGUpload *upload) {
+	if (upload->kind == UK_BUFFER) {
+		if (upload->info.buffer.release)
+			upload->info.buffer.release((void *) upload->info.buffer.data,
+										upload->info.buffer.user);
+	} else if (upload->info.texture.release) {
+		upload->info.texture.release((void *) upload->info.texture.pixels,
+									 upload->info.texture.user);
+	}
+}
+
+static void *
+loaderMain(void *argument) {
+	struct CGUpload *upload;
+	size_t amount;
+	size_t bytes;
+	double start;
+	double elapsed;
+	int span;
+
+	(void) argument;
+
+	CGSetThreadName("loader");
+	pthread_mutex_lock(&queueMutex);
+	if (!glXMakeContextCurrent(display, loaderPbuffer, loaderPbuffer,
+							   loaderContext)) {
+		loaderState = LS_FAILED;
+		pthread_cond_broadcast(&submittedCond);
+		pthread_mutex_unlock(&queueMutex);
+		return NULL;
+	}
+
+	/* Rows are tightly packed, see CGInitialize. */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	loaderState = LS_RUNNING;
+	pthread_cond_broadcast(&submittedCond);
+
+	for (;;) {
+		while (!loaderStopping && (queueHead == NULL || !hasCredit()))
+			pthread_cond_wait(&queueCond, &queueMutex);
+
+		/* The queue is drained before stopping. */
+		if (queueHead == NULL)
+			break;
+
+		upload = nextUpload();
+		amount = chunkSize(upload);
+		pthread_mutex_unlock(&queueMutex);
+
+		span = beginSpan("upload", NULL);
+		start = getTime();
+		bytes = performChunk(upload, amount);
+		elapsed = getTime() - start;
+		endSpan(span, bytes);
+
+		pthread_mutex_lock(&queueMutex);
+		creditBytes = bytes < creditBytes ? creditBytes - bytes : 0;
+		creditTime -= elapsed;
+		frameBytes += bytes;
+		frameTime += elapsed;
+
+		if (remainingWork(upload) == 0) {
+			removeUpload(upload);
+			pthread_mutex_unlock(&queueMutex);
+			releaseSource(upload);
+			retireStaging();
+			pthread_mutex_lock(&queueMutex);
+
+			upload->submitted = true;
+			if (upload->waited)
+				waitedCount--;
+			pthread_cond_broadcast(&submittedCond);
+			CGRequestRedraw();
+		} else if (!hasCredit()) {
+			/* The budget only refills when a frame starts, so make sure one
+			 * does even if the program is idle. */
+			CGRequestRedraw();
+		}
+	}
+
+	pthread_mutex_unlock(&queueMutex);
+	glXMakeContextCurrent(display, None, None, NULL);
+	return NULL;
+}
+
+bool
+startLoader(void) {
+	int drawableType = 0;
+	int pbufferAttributes[] = {
+		GLX_PBUFFER_WIDTH,	1,
+		GLX_PBUFFER_HEIGHT,	1,
+		None
+	};
+
+	loaderContext = createContext(context);
+	if (loaderContext == NULL)
+		return false;
+
+	/* Contexts created with GLX_ARB_create_context can be made current without
+	 * a drawable, but legacy ones need one. */
+	glXGetFBConfigAttrib(display, fbConfig, GLX_DRAWABLE_TYPE, &drawableType);
+	if (drawableType & GLX_PBUFFER_BIT)
+		loaderPbuffer = glXCreatePbuffer(display, fbConfig, pbufferAttributes);
+
+	pthread_mutex_lock(&queueMutex);
+	loaderState = LS_STARTING;
+	loaderStopping = false;
+
+	if (pthread_create(&loaderThread, NULL, loaderMain, NULL) != 0) {
+		loaderState = LS_STOPPED;
+		pthread_mutex_unlock(&queueMutex);
+		perror("[startLoader] pthread_create() failure");
+		stopLoader();
+		return false;
+	}
+
+	while (loaderState == LS_STARTING)
+		pthread_cond_wait(&submittedCond, &queueMutex);
+	pthread_mutex_unlock(&queueMutex);
+
+	if (loaderState == LS_FAILED) {
+		pthread_join(loaderThread, NULL);
+		loaderState = LS_STOPPED;
+		stopLoader();
+		return false;
+	}
+
+	return true;
+}
+
+void
+stopLoader(void) {
+	if (loaderState == LS_RUNNING) {
+		pthread_mutex_lock(&queueMutex);
+		loaderStopping = true;
+		pthread_cond_signal(&queueCond);
+		pthread_mutex_unlock(&queueMutex);
+
+		pthread_join(loaderThread, NULL);
+		loaderState = LS_STOPPED;
+	}
+
+	if (loaderPbuffer != None) {
+		glXDestroyPbuffer(display, loaderPbuffer);
+		loaderPbuffer = None;
+	}
+
+	if (loaderContext != NULL) {
+		glXDestroyContext(display, loaderContext);
+		loaderContext = NULL;
+	}
+}
+
+static struct CGUpload *
+queueUpload(struct CGUpload *upload) {
+	pthread_mutex_lock(&queueMutex);
+	if (loaderState != LS_RUNNING) {
+		pthread_mutex_unlock(&queueMutex);
+
+		/* Without a loader thread, the render thread does all the work at
+		 * once. */
+		performChunk(upload, remainingWork(upload));
+		releaseSource(upload);
+		upload->submitted = true;
+		return upload;
+	}
+
+	if (queueTail == NULL)
+		queueHead = upload;
+	else
+		queueTail->next = upload;
+	queueTail = upload;
+
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+	return upload;
+}
+
+struct CGUpload *
+CGQueueBufferUpload(const struct CGBufferUploadInfo *info) {
+	struct CGUpload *upload;
+
+	upload = cgCalloc(1, sizeof(struct CGUpload));
+	if (upload == NULL) {
+		fputs("[CGQueueBufferUpload] Failed to allocate upload!\n", stderr);
+		return NULL;
+	}
+
+	upload->kind = UK_BUFFER;
+	upload->priority = info->priority;
+	memcpy(&upload->info.buffer, info, sizeof(*info));
+	return queueUpload(upload);
+}
+
+struct CGUpload *
+CGQueueTextureUpload(const struct CGTextureUploadInfo *info) {
+	struct CGUpload *upload;
+
+	upload = cgCalloc(1, sizeof(struct CGUpload));
+	if (upload == NULL) {
+		fputs("[CGQueueTextureUpload] Failed to allocate upload!\n", stderr);
+		return NULL;
+	}
+
+	upload->kind = UK_TEXTURE;
+	upload->priority = info->priority;
+	memcpy(&upload->info.texture, info, sizeof(*info));
+	return queueUpload(upload);
+}
+
+void
+beginUploadFrame(size_t *bytes, double *time) {
+	pthread_mutex_lock(&queueMutex);
+	*bytes = frameBytes;
+	*time = frameTime;
+	frameBytes = 0;
+	frameTime = 0.0;
+
+	creditBytes = budgetBytes;
+	creditTime = budgetTime;
+	if (queueHead != NULL)
+		pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+}
+
+void
+CGSetUploadBudget(size_t bytes, double time) {
+	pthread_mutex_lock(&queueMutex);
+	budgetBytes = bytes;
+	budgetTime = time;
+	creditBytes = bytes;
+	creditTime = time;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+}
+
+void
+CGSetUploadPriority(struct CGUpload *upload, int priority) {
+	pthread_mutex_lock(&queueMutex);
+	upload->priority = priority;
+	pthread_mutex_unlock(&queueMutex);
+}
+
+bool
+CGIsUploadComplete(struct CGUpload *upload) {
+	bool submitted;
+	GLenum status;
+
+	pthread_mutex_lock(&queueMutex);
+	submitted = upload->submitted;
+	pthread_mutex_unlock(&queueMutex);
+
+	if (!submitted)
+		return false;
+
+	if (upload->fence == NULL)
+		return true;
+
+	status = glClientWaitSync(upload->fence, 0, 0);
+	if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+		return false;
+
+	glDeleteSync(upload->fence);
+	upload->fence = NULL;
+	return true;
+}
+
+void
+CGWaitForUpload(struct CGUpload *upload) {
+	GLenum status;
+
+	pthread_mutex_lock(&queueMutex);
+	if (!upload->submitted && !upload->waited) {
+		upload->waited = true;
+		waitedCount++;
+		pthread_cond_signal(&queueCond);
+	}
+	while (!upload->submitted)
+		pthread_cond_wait(&submittedCond, &queueMutex);
+	pthread_mutex_unlock(&queueMutex);
+
+	if (upload->fence == NULL)
+		return;
+
+	do {
+		status = glClientWaitSync(upload->fence, 0, 1000000000);
+	} while (status == GL_TIMEOUT_EXPIRED);
+
+	glDeleteSync(upload->fence);
+	upload->fence = NULL;
+}
+
+void
+CGFreeUpload(struct CGUpload *upload) {
+	if (upload == NULL)
+		return;
+
+	CGWaitForUpload(upload);
+	cgFree(upload);
+}
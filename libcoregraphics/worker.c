@@ -0,0 +1,205 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * A pool of worker threads for CPU work like mipmap generation. Work is
+ * submitted as a parallel loop with runParallel: the workers and the calling
+ * thread claim indices until all of them are done.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define MAX_WORKERS 16
+
+struct WorkerJob {
+	WorkerFunc	 func;
+	void		*argument;
+	size_t		 count;
+	/* the next index to claim, and how many have finished */
+	size_t		 next;
+	size_t		 done;
+	struct WorkerJob *nextJob;
+};
+
+static pthread_t workers[MAX_WORKERS];
+static size_t workerCount = 0;
+
+/* Everything below is protected by jobMutex. */
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static bool workersStopping = false;
+static struct WorkerJob *jobHead = NULL;
+static struct WorkerJob *jobTail = NULL;
+
+/**
+ * Claims an index of the job, removing the job from the queue once every
+ * index has been claimed. Must be called with jobMutex held.
+ */
+static size_t
+claimIndex(struct WorkerJob *job) {
+	size_t index = job->next++;
+	struct WorkerJob **link;
+
+	if (job->next == job->count) {
+		for (link = &jobHead; *link != job; link = &(*link)->nextJob)
+			continue;
+
+		*link = job->nextJob;
+		if (jobTail == job) {
+			jobTail = NULL;
+			for (job = jobHead; job != NULL; job = job->nextJob)
+				jobTail = job;
+		}
+	}
+
+	return index;
+}
+
+/**
+ * Runs an index of the job and reports it as done. Must be called with
+ * jobMutex held, which is released while the function runs.
+ */
+static void
+runIndex(struct WorkerJob *job, size_t index) {
+	pthread_mutex_unlock(&jobMutex);
+	job->func(job->argument, index);
+	pthread_mutex_lock(&jobMutex);
+
+	/* The job may be gone as soon as the last index is reported. */
+	if (++job->done == job->count)
+		pthread_cond_broadcast(&doneCond);
+}
+
+static void *
+workerMain(void *argument) {
+	struct WorkerJob *job;
+
+	(void) argument;
+
+	CGSetThreadName("worker");
+	registerPerfThread();
+	pthread_mutex_lock(&jobMutex);
+	for (;;) {
+		while (jobHead == NULL && !workersStopping)
+			pthread_cond_wait(&jobCond, &jobMutex);
+
+		if (jobHead == NULL)
+			break;
+
+		job = jobHead;
+		runIndex(job, claimIndex(job));
+	}
+	pthread_mutex_unlock(&jobMutex);
+
+	return NULL;
+}
+
+bool
+startWorkers(void) {
+	long processors;
+	size_t i;
+
+	/* The thread submitting work helps out, so leave a processor for it. */
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (processors <= 1)
+		return true;
+	if (processors - 1 > MAX_WORKERS)
+		processors = MAX_WORKERS + 1;
+
+	workersStopping = false;
+	for (i = 0; i < (size_t) processors - 1; i++) {
+		if (pthread_create(&workers[i], NULL, workerMain, NULL) != 0) {
+			perror("[startWorkers] pthread_create() failure");
+			break;
+		}
+		workerCount++;
+	}
+
+	return workerCount > 0;
+}
+
+void
+stopWorkers(void) {
+	size_t i;
+
+	pthread_mutex_lock(&jobMutex);
+	workersStopping = true;
+	pthread_cond_broadcast(&jobCond);
+	pthread_mutex_unlock(&jobMutex);
+
+	for (i = 0; i < workerCount; i++)
+		pthread_join(workers[i], NULL);
+	workerCount = 0;
+}
+
+size_t
+getWorkerCount(void) {
+	return workerCount;
+}
+
+void
+runParallel(WorkerFunc func, void *argument, size_t count) {
+	struct WorkerJob job = {
+		.func = func,
+		.argument = argument,
+		.count = count,
+	};
+	size_t i;
+
+	if (count == 0)
+		return;
+
+	if (workerCount == 0 || count == 1) {
+		for (i = 0; i < count; i++)
+			func(argument, i);
+		return;
+	}
+
+	pthread_mutex_lock(&jobMutex);
+	if (jobTail == NULL)
+		jobHead = &job;
+	else
+		jobTail->nextJob = &job;
+	jobTail = &job;
+	pthread_cond_broadcast(&jobCond);
+
+	while (job.next < job.count)
+		runIndex(&job, claimIndex(&job));
+
+	while (job.done < job.count)
+		pthread_cond_wait(&doneCond, &jobMutex);
+	pthread_mutex_unlock(&jobMutex);
+}
@@ -39,6 +39,19 @@
 #include "libcg.h"
 
 /** Init Data */
+struct CGStartupProfile startupProfile = {
+	.report = true,
+	.tracePath = "startup-trace.json"
+};
+
+struct CGHitchConfig hitchConfig = {
+	.threshold = 0.1,
+	.medianFactor = 3.0,
+	.window = 5.0,
+	.directory = ".",
+	.maxCaptures = 4
+};
+
 GLfloat meshVertices[] = {
 	-0.5f, -0.5f,
 	 0.5f, -0.5f,
@@ -54,7 +67,8 @@ struct CGMeshInitData meshInitData = {
 
 struct CGImageInitData imageInitData = {
 	.path = "res/cc0textures-bricks047.jpg",
-	.type = CG_IT_JPEG
+	.type = CG_IT_JPEG,
+	.async = true
 };
 
 static const char *shaderAttributes[] = { "position" };
@@ -74,6 +88,11 @@ struct CGImage		image;
 GLint				uniformMatrix;
 GLint				uniformSampler;
 
+/* where to write a trace at shutdown, from $CG_TRACE */
+const char			*tracePath;
+/* whether to count heap allocations, if $CG_ALLOCATIONS is set */
+bool				trackAllocations;
+
 GLfloat				transformationMatrix[] = {
 	1, 0, 0, 0,
 	0, 1, 0, 0,
@@ -81,55 +100,106 @@ GLfloat				transformationMatrix[] = {
 	0, 0, 0, 1
 };
 
+bool
+loadMenu(struct CGAsset *);
+
 bool
 mainMenuRenderer(float deltaTime);
 
 void
 shutdownFunction(void);
 
+/** Assets **/
+static const char *menuDependencies[] = {
+	"menu-shader", "triangle", "bricks", NULL
+};
+
+/* Loaded together by CGLoadAssets, the menu itself once the rest is. */
+struct CGAsset assets[] = {
+	{
+		.name = "menu-shader",
+		.type = CG_AT_SHADER,
+		.data = &shader,
+		.initData = &shaderInitData
+	},
+	{
+		.name = "triangle",
+		.type = CG_AT_MESH,
+		.data = &mesh,
+		.initData = &meshInitData
+	},
+	{
+		.name = "bricks",
+		.type = CG_AT_IMAGE,
+		.data = &image,
+		.initData = &imageInitData
+	},
+	{
+		.name = "menu",
+		.type = CG_AT_CUSTOM,
+		.dependencies = menuDependencies,
+		.load = loadMenu
+	},
+};
+
+const size_t assetCount = sizeof(assets) / sizeof(assets[0]);
+
 int
 main(void) {
-	if (!CGInitialize()) {
-		fputs("[Main] CGInitialize failed.\n", stderr);
-		return EXIT_FAILURE;
-	}
+	trackAllocations = getenv("CG_ALLOCATIONS") != NULL;
+	if (trackAllocations)
+		CGSetAllocator(CGGetTrackingAllocator());
 
-	if (!CGLoadShader(&shader, &shaderInitData)) {
-		fputs("[Main] GCLoadShader failed.\n", stderr);
-		CGCleanError();
-		return EXIT_FAILURE;
-	}
+	CGSetStartupProfile(&startupProfile);
 
-	uniformMatrix = glGetUniformLocation(shader.program,
-										 "transformationMatrix");
-	uniformSampler = glGetUniformLocation(shader.program, "textureSampler");
+	tracePath = getenv("CG_TRACE");
+	if (tracePath != NULL)
+		CGSetTracing(true);
 
-	if (!CGLoadMesh(&mesh, &meshInitData)) {
-		fputs("[Main] CGLoadMesh failed.\n", stderr);
-		CGDeleteShader(&shader);
-		CGCleanError();
+	if (!CGInitialize()) {
+		fputs("[Main] CGInitialize failed.\n", stderr);
 		return EXIT_FAILURE;
 	}
 
-	if (!CGLoadImage(&image, &imageInitData)) {
-		fputs("[Main] CGLoadMesh failed.\n", stderr);
-		CGDeleteMesh(&mesh);
-		CGDeleteShader(&shader);
+	if (!CGLoadAssets(assets, assetCount)) {
+		fputs("[Main] CGLoadAssets failed.\n", stderr);
+		CGPrintAssetReport(assets, assetCount);
+		CGUnloadAssets(assets, assetCount);
 		CGCleanError();
 		return EXIT_FAILURE;
 	}
+	CGPrintAssetReport(assets, assetCount);
 
+	CGSetHitchDetection(&hitchConfig);
 	CGSetRenderFunc(mainMenuRenderer);
 	CGSetShutdownFunc(shutdownFunction);
 
 	return CGStart();
 }
 
+bool
+loadMenu(struct CGAsset *asset) {
+	(void) asset;
+
+	uniformMatrix = glGetUniformLocation(shader.program,
+										 "transformationMatrix");
+	uniformSampler = glGetUniformLocation(shader.program, "textureSampler");
+
+	return uniformMatrix != -1 && uniformSampler != -1;
+}
+
 /* new shit */
 bool
 mainMenuRenderer(float deltaTime) {
+	CG_FUNCTION_ZONE();
+
 	(void) deltaTime;
 
+	/* Keep rendering (and polling) until the coarsest level has arrived, the
+	 * finer ones are streamed in by CGStart. */
+	if (!CGIsImageReady(&image))
+		return true;
+
 	glUseProgram(shader.program);
 	glUniformMatrix4fv(uniformMatrix, 1, GL_FALSE, transformationMatrix);
 	glUniform1i(uniformSampler, 0);
@@ -140,12 +210,26 @@ mainMenuRenderer(float deltaTime) {
 	glBindVertexArray(mesh.vao);
 	glDrawArrays(GL_TRIANGLES, 0, mesh.count);
 
+	/* The menu is static, so don't redraw until something happens. */
+	CGSetFrameClean();
+
 	return true;
 }
 
 void
 shutdownFunction(void) {
-	CGDeleteImage(&image);
-	CGDeleteMesh(&mesh);
-	CGDeleteShader(&shader);
+	if (tracePath != NULL)
+		CGWriteTrace(tracePath);
+
+	CGUnloadAssets(assets, assetCount);
+
+	if (trackAllocations) {
+		struct CGAllocationStats stats;
+
+		CGGetAllocationStats(&stats);
+		printf("[Main] %zu bytes in %zu heap allocations left, %zu bytes at "
+			   "most, %llu allocations in total.\n", stats.bytes,
+			   stats.allocations, stats.peakBytes,
+			   (unsigned long long) stats.totalAllocations);
+	}
 }
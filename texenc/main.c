@@ -0,0 +1,620 @@
+/**
+ * BSD-2-Clause
+ *
+ * Copyright (c) 2020 Tristan
+ * All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS  SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND  ANY  EXPRESS  OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED  WARRANTIES  OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE  DISCLAIMED.  IN  NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE   FOR  ANY  DIRECT,  INDIRECT,  INCIDENTAL,  SPECIAL,  EXEMPLARY,  OR
+ * CONSEQUENTIAL  DAMAGES  (INCLUDING,  BUT  NOT  LIMITED  TO,  PROCUREMENT  OF
+ * SUBSTITUTE  GOODS  OR  SERVICES;  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION)  HOWEVER  CAUSED  AND  ON  ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT,  STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING  IN  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Encodes an image and its mipmaps into the block compressed texture
+ * container of libcg (see CGTextureFileHeader), offline, so CGLoadImage can
+ * upload the blocks as they are.
+ *
+ * Usage: texenc [-f bc1|bc3|bc4|bc5] [-m box|kaiser|lanczos] [-g] [-p]
+ *               input output
+ *
+ * Without -f, the format is picked from the image: BC4 for grayscale, BC5 for
+ * grayscale+alpha, BC1 for opaque color and BC3 otherwise. -g filters the
+ * mipmaps in linear space and -p premultiplies the alpha, as CGImageInitData
+ * would.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcg.h"
+
+struct Options {
+	enum CGTextureFormat format;
+	bool		 autoFormat;
+	enum CGMipFilter filter;
+	bool		 gammaCorrect;
+	bool		 premultiply;
+	const char	*input;
+	const char	*output;
+};
+
+static int
+getFormatChannels(enum CGTextureFormat format) {
+	switch (format) {
+		case CG_TF_BC4:
+			return 1;
+		case CG_TF_BC5:
+			return 2;
+		default:
+			return 4;
+	}
+}
+
+static size_t
+getBlockSize(enum CGTextureFormat format) {
+	return format == CG_TF_BC1 || format == CG_TF_BC4 ? 8 : 16;
+}
+
+/**
+ * Reads a 4x4 block as RGBA, repeating the last row and column of the image
+ * for blocks on its edges.
+ */
+static void
+fetchBlock(const unsigned char *pixels, int width, int height, int channels,
+		   int blockX, int blockY, unsigned char texels[16][4]) {
+	const unsigned char *texel;
+	int x;
+	int y;
+	int i;
+
+	for (y = 0; y < 4; y++) {
+		for (x = 0; x < 4; x++) {
+			texel = pixels + ((size_t) (blockY + y < height
+										? blockY + y : height - 1) * width
+							  + (blockX + x < width ? blockX + x : width - 1))
+							 * channels;
+			for (i = 0; i < 4; i++)
+				texels[y * 4 + x][i] = i < channels ? texel[i] : 255;
+		}
+	}
+}
+
+static uint16_t
+pack565(const float color[3]) {
+	int r = (int) (color[0] * 31.0f / 255.0f + 0.5f);
+	int g = (int) (color[1] * 63.0f / 255.0f + 0.5f);
+	int b = (int) (color[2] * 31.0f / 255.0f + 0.5f);
+
+	r = r < 0 ? 0 : r > 31 ? 31 : r;
+	g = g < 0 ? 0 : g > 63 ? 63 : g;
+	b = b < 0 ? 0 : b > 31 ? 31 : b;
+	return r << 11 | g << 5 | b;
+}
+
+/**
+ * Builds the four color palette exactly like the decoder does.
+ */
+static void
+buildColorPalette(uint16_t color0, uint16_t color1, int palette[4][3]) {
+	int i;
+
+	palette[0][0] = ((color0 >> 11) & 0x1F) * 255 / 31;
+	palette[0][1] = ((color0 >> 5) & 0x3F) * 255 / 63;
+	palette[0][2] = (color0 & 0x1F) * 255 / 31;
+	palette[1][0] = ((color1 >> 11) & 0x1F) * 255 / 31;
+	palette[1][1] = ((color1 >> 5) & 0x3F) * 255 / 63;
+	palette[1][2] = (color1 & 0x1F) * 255 / 31;
+
+	for (i = 0; i < 3; i++) {
+		palette[2][i] = (2 * palette[0][i] + palette[1][i] + 1) / 3;
+		palette[3][i] = (palette[0][i] + 2 * palette[1][i] + 1) / 3;
+	}
+}
+
+static uint32_t
+findColorIndices(const unsigned char texels[16][4], uint16_t color0,
+				 uint16_t color1, int indices[16]) {
+	int palette[4][3];
+	uint32_t bits = 0;
+	int best;
+	int bestError;
+	int error;
+	int d;
+	int i;
+	int j;
+	int k;
+
+	buildColorPalette(color0, color1, palette);
+
+	for (i = 0; i < 16; i++) {
+		best = 0;
+		bestError = INT32_MAX;
+		for (j = 0; j < 4; j++) {
+			error = 0;
+			for (k = 0; k < 3; k++) {
+				d = texels[i][k] - palette[j][k];
+				error += d * d;
+			}
+			if (error < bestError) {
+				bestError = error;
+				best = j;
+			}
+		}
+
+		indices[i] = best;
+		bits |= (uint32_t) best << (2 * i);
+	}
+
+	return bits;
+}
+
+/**
+ * Encodes the colors of a block in the four color mode of BC1. The endpoints
+ * start at the extremes along the principal axis of the colors, and are then
+ * refined by least squares for the chosen indices.
+ */
+static void
+encodeColorBlock(const unsigned char texels[16][4], unsigned char *out) {
+	static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	float covariance[6] = { 0.0f };
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	float next[3];
+	float endpoints[2][3];
+	float minimum = INFINITY;
+	float maximum = -INFINITY;
+	float d[3];
+	float t;
+	float length;
+	float aa, ab, bb, det;
+	float ax[3], bx[3];
+	int indices[16];
+	uint16_t color0;
+	uint16_t color1;
+	uint32_t bits;
+	int iteration;
+	int i;
+	int k;
+
+	for (i = 0; i < 16; i++)
+		for (k = 0; k < 3; k++)
+			mean[k] += texels[i][k] / 16.0f;
+
+	for (i = 0; i < 16; i++) {
+		for (k = 0; k < 3; k++)
+			d[k] = texels[i][k] - mean[k];
+		covariance[0] += d[0] * d[0];
+		covariance[1] += d[0] * d[1];
+		covariance[2] += d[0] * d[2];
+		covariance[3] += d[1] * d[1];
+		covariance[4] += d[1] * d[2];
+		covariance[5] += d[2] * d[2];
+	}
+
+	/* Power iteration for the principal axis. */
+	for (iteration = 0; iteration < 8; iteration++) {
+		next[0] = covariance[0] * axis[0] + covariance[1] * axis[1]
+				+ covariance[2] * axis[2];
+		next[1] = covariance[1] * axis[0] + covariance[3] * axis[1]
+				+ covariance[4] * axis[2];
+		next[2] = covariance[2] * axis[0] + covariance[4] * axis[1]
+				+ covariance[5] * axis[2];
+
+		length = sqrtf(next[0] * next[0] + next[1] * next[1]
+					   + next[2] * next[2]);
+		if (length < 1e-6f)
+			break;
+		for (k = 0; k < 3; k++)
+			axis[k] = next[k] / length;
+	}
+
+	for (i = 0; i < 16; i++) {
+		t = 0.0f;
+		for (k = 0; k < 3; k++)
+			t += (texels[i][k] - mean[k]) * axis[k];
+		if (t < minimum)
+			minimum = t;
+		if (t > maximum)
+			maximum = t;
+	}
+
+	for (k = 0; k < 3; k++) {
+		endpoints[0][k] = mean[k] + axis[k] * maximum;
+		endpoints[1][k] = mean[k] + axis[k] * minimum;
+	}
+
+	color0 = pack565(endpoints[0]);
+	color1 = pack565(endpoints[1]);
+
+	for (iteration = 0; iteration < 2 && color0 != color1; iteration++) {
+		findColorIndices(texels, color0, color1, indices);
+
+		aa = ab = bb = 0.0f;
+		memset(ax, 0, sizeof(ax));
+		memset(bx, 0, sizeof(bx));
+		for (i = 0; i < 16; i++) {
+			t = weights[indices[i]];
+			aa += t * t;
+			ab += t * (1.0f - t);
+			bb += (1.0f - t) * (1.0f - t);
+			for (k = 0; k < 3; k++) {
+				ax[k] += t * texels[i][k];
+				bx[k] += (1.0f - t) * texels[i][k];
+			}
+		}
+
+		det = aa * bb - ab * ab;
+		if (fabsf(det) < 1e-6f)
+			break;
+
+		for (k = 0; k < 3; k++) {
+			endpoints[0][k] = (bb * ax[k] - ab * bx[k]) / det;
+			endpoints[1][k] = (aa * bx[k] - ab * ax[k]) / det;
+		}
+		color0 = pack565(endpoints[0]);
+		color1 = pack565(endpoints[1]);
+	}
+
+	/* The four color mode needs color0 > color1. Equal colors select the
+	 * three color mode, where index 0 still means color0. */
+	if (color0 < color1) {
+		t = color0;
+		color0 = color1;
+		color1 = t;
+	}
+
+	bits = color0 == color1 ? 0 : findColorIndices(texels, color0, color1,
+												   indices);
+
+	out[0] = color0 & 0xFF;
+	out[1] = color0 >> 8;
+	out[2] = color1 & 0xFF;
+	out[3] = color1 >> 8;
+	for (i = 0; i < 4; i++)
+		out[4 + i] = (bits >> (8 * i)) & 0xFF;
+}
+
+/**
+ * Encodes 16 values in the eight value mode of BC4, with the minimum and
+ * maximum as endpoints.
+ */
+static void
+encodeValueBlock(const unsigned char values[16], unsigned char *out) {
+	unsigned char minimum = 255;
+	unsigned char maximum = 0;
+	unsigned char palette[8];
+	uint64_t bits = 0;
+	int best;
+	int bestError;
+	int error;
+	int i;
+	int j;
+
+	for (i = 0; i < 16; i++) {
+		if (values[i] < minimum)
+			minimum = values[i];
+		if (values[i] > maximum)
+			maximum = values[i];
+	}
+
+	out[0] = maximum;
+	out[1] = minimum;
+
+	/* With equal endpoints, index 0 is the value in either mode. */
+	if (maximum != minimum) {
+		palette[0] = maximum;
+		palette[1] = minimum;
+		for (i = 1; i < 7; i++)
+			palette[i + 1] = ((7 - i) * maximum + i * minimum + 3) / 7;
+
+		for (i = 0; i < 16; i++) {
+			best = 0;
+			bestError = INT32_MAX;
+			for (j = 0; j < 8; j++) {
+				error = abs(values[i] - palette[j]);
+				if (error < bestError) {
+					bestError = error;
+					best = j;
+				}
+			}
+			bits |= (uint64_t) best << (3 * i);
+		}
+	}
+
+	for (i = 0; i < 6; i++)
+		out[2 + i] = (bits >> (8 * i)) & 0xFF;
+}
+
+static void
+encodeBlock(enum CGTextureFormat format, const unsigned char texels[16][4],
+			unsigned char *out) {
+	unsigned char values[16];
+	int i;
+
+	switch (format) {
+		case CG_TF_BC1:
+			encodeColorBlock(texels, out);
+			break;
+		case CG_TF_BC3:
+			for (i = 0; i < 16; i++)
+				values[i] = texels[i][3];
+			encodeValueBlock(values, out);
+			encodeColorBlock(texels, out + 8);
+			break;
+		case CG_TF_BC4:
+			for (i = 0; i < 16; i++)
+				values[i] = texels[i][0];
+			encodeValueBlock(values, out);
+			break;
+		case CG_TF_BC5:
+			for (i = 0; i < 16; i++)
+				values[i] = texels[i][0];
+			encodeValueBlock(values, out);
+			for (i = 0; i < 16; i++)
+				values[i] = texels[i][1];
+			encodeValueBlock(values, out + 8);
+			break;
+	}
+}
+
+static unsigned char *
+encodeLevel(enum CGTextureFormat format, const struct CGMipLevel *level,
+			int channels, size_t *size) {
+	unsigned char texels[16][4];
+	unsigned char *blocks;
+	unsigned char *out;
+	int x;
+	int y;
+
+	*size = (size_t) ((level->width + 3) / 4) * ((level->height + 3) / 4)
+		  * getBlockSize(format);
+	blocks = malloc(*size);
+	if (blocks == NULL)
+		return NULL;
+
+	out = blocks;
+	for (y = 0; y < level->height; y += 4) {
+		for (x = 0; x < level->width; x += 4) {
+			fetchBlock(level->pixels, level->width, level->height, channels,
+					   x, y, texels);
+			encodeBlock(format, texels, out);
+			out += getBlockSize(format);
+		}
+	}
+
+	return blocks;
+}
+
+static bool
+hasAlpha(const unsigned char *pixels, size_t count) {
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (pixels[i * 4 + 3] != 255)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+premultiply(unsigned char *pixels, size_t count, int channels) {
+	unsigned char *texel;
+	size_t i;
+	int k;
+
+	for (i = 0; i < count; i++) {
+		texel = pixels + i * channels;
+		for (k = 0; k < channels - 1; k++)
+			texel[k] = (texel[k] * texel[channels - 1] + 127) / 255;
+	}
+}
+
+static bool
+writeTexture(const char *path, enum CGTextureFormat format,
+			 const struct CGMipChain *chain) {
+	struct CGTextureFileHeader header;
+	struct CGTextureFileLevel levels[CG_MAX_MIP_LEVELS];
+	unsigned char *blocks[CG_MAX_MIP_LEVELS] = { NULL };
+	size_t sizes[CG_MAX_MIP_LEVELS];
+	size_t offset;
+	FILE *file;
+	bool success = false;
+	int i;
+
+	memcpy(header.magic, CG_TEXTURE_MAGIC, sizeof(header.magic));
+	header.version = CG_TEXTURE_VERSION;
+	header.format = format;
+	header.width = chain->levels[0].width;
+	header.height = chain->levels[0].height;
+	header.levelCount = chain->levelCount;
+
+	offset = sizeof(header) + chain->levelCount * sizeof(levels[0]);
+	for (i = 0; i < chain->levelCount; i++) {
+		blocks[i] = encodeLevel(format, &chain->levels[i], chain->channels,
+								&sizes[i]);
+		if (blocks[i] == NULL) {
+			fputs("[texenc] Failed to allocate blocks!\n", stderr);
+			goto out;
+		}
+
+		levels[i].offset = offset;
+		levels[i].size = sizes[i];
+		offset += sizes[i];
+	}
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror(path);
+		goto out;
+	}
+
+	success = fwrite(&header, sizeof(header), 1, file) == 1
+		   && fwrite(levels, sizeof(levels[0]), chain->levelCount, file)
+			  == (size_t) chain->levelCount;
+	for (i = 0; success && i < chain->levelCount; i++)
+		success = fwrite(blocks[i], 1, sizes[i], file) == sizes[i];
+
+	if (fclose(file) != 0 || !success) {
+		fprintf(stderr, "[texenc] Failed to write '%s'!\n", path);
+		success = false;
+	}
+
+out:
+	for (i = 0; i < chain->levelCount; i++)
+		free(blocks[i]);
+	return success;
+}
+
+static bool
+parseOptions(int argc, char **argv, struct Options *options) {
+	int i;
+
+	memset(options, 0, sizeof(*options));
+	options->autoFormat = true;
+	options->filter = CG_MF_KAISER;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-g") == 0) {
+			options->gammaCorrect = true;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			options->premultiply = true;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			options->autoFormat = false;
+			i++;
+			if (strcmp(argv[i], "bc1") == 0)
+				options->format = CG_TF_BC1;
+			else if (strcmp(argv[i], "bc3") == 0)
+				options->format = CG_TF_BC3;
+			else if (strcmp(argv[i], "bc4") == 0)
+				options->format = CG_TF_BC4;
+			else if (strcmp(argv[i], "bc5") == 0)
+				options->format = CG_TF_BC5;
+			else
+				return false;
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "box") == 0)
+				options->filter = CG_MF_BOX;
+			else if (strcmp(argv[i], "kaiser") == 0)
+				options->filter = CG_MF_KAISER;
+			else if (strcmp(argv[i], "lanczos") == 0)
+				options->filter = CG_MF_LANCZOS;
+			else
+				return false;
+		} else {
+			return false;
+		}
+	}
+
+	if (argc - i != 2)
+		return false;
+
+	options->input = argv[i];
+	options->output = argv[i + 1];
+	return true;
+}
+
+int
+main(int argc, char **argv) {
+	struct Options options;
+	struct CGMipChain chain;
+	const struct CGImageDecoder *decoder;
+	struct CGFileView file;
+	unsigned char *pixels;
+	enum CGImageType type = CG_IT_PNG;
+	int width;
+	int height;
+	int channels;
+	bool success;
+
+	if (!parseOptions(argc, argv, &options)) {
+		fputs("Usage: texenc [-f bc1|bc3|bc4|bc5] [-m box|kaiser|lanczos] "
+			  "[-g] [-p] input output\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	if (!CGMapFile(&file, options.input, CG_FA_SEQUENTIAL))
+		return EXIT_FAILURE;
+
+	CGDetectImageType(file.data, file.size, &type);
+
+	/* Decode once to find the channels of the image, and again if the format
+	 * needs others. */
+	pixels = CGDecodeImage(file.data, file.size, type, &width, &height,
+						   &channels, 0, &decoder);
+	if (pixels == NULL) {
+		fprintf(stderr, "[texenc] Failed to decode '%s'!\n", options.input);
+		CGReleaseFileView(&file);
+		return EXIT_FAILURE;
+	}
+
+	if (options.autoFormat) {
+		switch (channels) {
+			case 1:
+				options.format = CG_TF_BC4;
+				break;
+			case 2:
+				options.format = CG_TF_BC5;
+				break;
+			case 3:
+				options.format = CG_TF_BC1;
+				break;
+			default:
+				options.format = hasAlpha(pixels, (size_t) width * height)
+							   ? CG_TF_BC3 : CG_TF_BC1;
+				break;
+		}
+	}
+
+	if (channels != getFormatChannels(options.format)) {
+		decoder->free(pixels);
+		pixels = CGDecodeImage(file.data, file.size, type, &width, &height,
+							   &channels, getFormatChannels(options.format),
+							   &decoder);
+		if (pixels == NULL) {
+			fprintf(stderr, "[texenc] Failed to convert '%s'!\n",
+					options.input);
+			CGReleaseFileView(&file);
+			return EXIT_FAILURE;
+		}
+	}
+	CGReleaseFileView(&file);
+
+	if (options.premultiply && channels != 1)
+		premultiply(pixels, (size_t) width * height, channels);
+
+	if (!CGGenerateMipChain(&chain, pixels, width, height, channels,
+							options.filter, options.gammaCorrect)) {
+		decoder->free(pixels);
+		return EXIT_FAILURE;
+	}
+
+	success = writeTexture(options.output, options.format, &chain);
+
+	CGFreeMipChain(&chain);
+	decoder->free(pixels);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}